@@ -0,0 +1,686 @@
+/*
+ * Benchmarks for libdimmer's hot paths. Results are written to stdout
+ *  as one JSON object per line, so they can be diffed and graphed.
+ *
+ * The kernels are timed on their own. Everything else goes through the
+ *  public API, against the capture device (dev_capture.c) recording
+ *  into a scratch file, so no console or hardware is needed.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "boolean.h"
+#include "dimmer.h"
+#include "fade_kernel.h"
+#include "cook_kernel.h"
+#include "dev_capture.h"
+
+    /* each measurement runs for about this long. */
+#define BENCH_TARGET_NS  50000000LL
+
+    /* the library benchmarks run on this many universes of channels. */
+#define BENCH_UNIVERSES  32
+#define BENCH_CHANNELS   (BENCH_UNIVERSES * DIMMER_UNIVERSE_SIZE)
+
+#define BENCH_OUTSTANDING_FADES  10000
+#define BENCH_LATENCY_SAMPLES    200
+
+static char capturePath[64];
+static struct CaptureHeader *capture = NULL;
+static size_t captureSize = 0;
+
+
+static long long benchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+} /* benchNow */
+
+
+static int allocFades(struct FadeArrays *fades, int count)
+{
+    size_t n = (size_t) count;
+
+    fades->channel = malloc(n * sizeof (int));
+    fades->startLevel = malloc(n * sizeof (int));
+    fades->endLevel = malloc(n * sizeof (int));
+    fades->startTime = malloc(n * sizeof (int));
+    fades->duration = malloc(n * sizeof (int));
+    fades->invDuration = malloc(n * sizeof (unsigned int));
+    fades->curve = malloc(n);
+
+    return(((fades->channel == NULL) || (fades->startLevel == NULL) ||
+            (fades->endLevel == NULL) || (fades->startTime == NULL) ||
+            (fades->duration == NULL) || (fades->invDuration == NULL) ||
+            (fades->curve == NULL)) ? -1 : 0);
+} /* allocFades */
+
+
+static void freeFades(struct FadeArrays *fades)
+{
+    free(fades->channel);
+    free(fades->startLevel);
+    free(fades->endLevel);
+    free(fades->startTime);
+    free(fades->duration);
+    free(fades->invDuration);
+    free(fades->curve);
+} /* freeFades */
+
+
+static void fillFades(struct FadeArrays *fades, int count, int now, int curves)
+/*
+ * Make up (count) fades in assorted states of completion. If (curves)
+ *  is non-zero, about one in ten gets a non-linear curve.
+ */
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        fades->channel[i] = i;
+        fades->startLevel[i] = rand() % 256;
+        fades->endLevel[i] = rand() % 256;
+        fades->duration[i] = rand() % 10000;
+        fades->startTime[i] = now - (rand() % 12000);
+        fades->invDuration[i] = fadeInverseDuration(fades->duration[i]);
+        fades->curve[i] = DIMMER_FADE_LINEAR;
+        if ((curves) && ((rand() % 10) == 0))
+            fades->curve[i] = 1 + (rand() % DIMMER_FADE_SCURVE);
+    } /* for */
+} /* fillFades */
+
+
+static void benchFadeKernels(void)
+{
+    static const struct { const char *name; FadeKernel kernel; } kernels[] =
+    {
+        { "scalar", fadeKernelScalar },
+        { "sse2", fadeKernelSSE2 },
+        { "avx2", fadeKernelAVX2 }
+    };
+    static const int counts[] = { 64, 512, 4096, 32768 };
+    const int totalKernels = sizeof (kernels) / sizeof (kernels[0]);
+    const int totalCounts = sizeof (counts) / sizeof (counts[0]);
+    struct FadeArrays fades;
+    unsigned char *levels, *done, *refLevels, *refDone;
+    long long start, elapsed;
+    long passes;
+    int now = 123456;
+    int curves, c, k;
+
+    for (curves = 0; curves <= 1; curves++)
+    {
+        for (c = 0; c < totalCounts; c++)
+        {
+            int count = counts[c];
+
+            if (allocFades(&fades, count) == -1)
+                return;
+
+            levels = malloc(count);
+            done = malloc(count);
+            refLevels = malloc(count);
+            refDone = malloc(count);
+            fillFades(&fades, count, now, curves);
+            fadeKernelScalar(&fades, count, now, refLevels, refDone);
+
+            for (k = 0; k < totalKernels; k++)
+            {
+                if (!fadeKernelAvailable(kernels[k].kernel))
+                    continue;
+
+                    /* every kernel must agree with the scalar one. */
+                kernels[k].kernel(&fades, count, now, levels, done);
+                if ((memcmp(levels, refLevels, count) != 0) ||
+                    (memcmp(done, refDone, count) != 0))
+                {
+                    fprintf(stderr, "bench: %s fade kernel disagrees with "
+                            "scalar at %d fades!\n", kernels[k].name, count);
+                    exit(1);
+                } /* if */
+
+                passes = 0;
+                start = benchNow();
+                do
+                {
+                    kernels[k].kernel(&fades, count, now + (int) passes,
+                                      levels, done);
+                    passes++;
+                    elapsed = benchNow() - start;
+                } while (elapsed < BENCH_TARGET_NS);
+
+                printf("{\"bench\":\"fade_kernel\",\"impl\":\"%s\","
+                       "\"curves\":%d,\"fades\":%d,\"ns_per_pass\":%.1f,"
+                       "\"ns_per_fade\":%.3f}\n",
+                       kernels[k].name, curves, count,
+                       (double) elapsed / passes,
+                       (double) elapsed / passes / count);
+            } /* for */
+
+            free(levels);
+            free(done);
+            free(refLevels);
+            free(refDone);
+            freeFades(&fades);
+        } /* for */
+    } /* for */
+} /* benchFadeKernels */
+
+
+static void benchCookKernels(void)
+{
+    static const struct CookKernels *kernels[] =
+    {
+        &cookKernelsScalar, &cookKernelsSSE2, &cookKernelsAVX2
+    };
+    static const int counts[] = { 512, 4096, 32768 };
+    const int totalKernels = sizeof (kernels) / sizeof (kernels[0]);
+    const int totalCounts = sizeof (counts) / sizeof (counts[0]);
+    unsigned char *raw, *mix, *sub, *cooked, *refCooked, *refMix;
+    unsigned char *curves, *refCurved;
+    static unsigned char tables[(8 * 256) + 3];
+    long long start, elapsed;
+    long passes;
+    int i, c, k;
+
+    for (c = 0; c < totalCounts; c++)
+    {
+        int count = counts[c];
+
+        raw = malloc(count);
+        mix = malloc(count);
+        sub = malloc(count);
+        cooked = malloc(count);
+        refCooked = malloc(count);
+        refMix = malloc(count);
+        curves = malloc(count);
+        refCurved = malloc(count);
+
+        for (i = 0; i < count; i++)
+        {
+            raw[i] = rand() % 256;
+            sub[i] = rand() % 256;
+            refMix[i] = rand() % 256;
+            curves[i] = rand() % 8;
+        } /* for */
+
+        for (i = 0; i < (int) sizeof (tables); i++)
+            tables[i] = rand() % 256;
+
+        cookKernelsScalar.cook(raw, refMix, 200, refCooked, count);
+        memcpy(refCurved, raw, count);
+        cookKernelsScalar.applyCurves(refCurved, curves, tables, count);
+        memcpy(mix, refMix, count);
+        cookKernelsScalar.mixSubmaster(refMix, sub, 77, count);
+
+        for (k = 0; k < totalKernels; k++)
+        {
+            if (!cookKernelsAvailable(kernels[k]))
+                continue;
+
+            kernels[k]->cook(raw, mix, 200, cooked, count);
+            if (memcmp(cooked, refCooked, count) != 0)
+            {
+                fprintf(stderr, "bench: %s cook kernel disagrees with "
+                        "scalar at %d channels!\n", kernels[k]->name, count);
+                exit(1);
+            } /* if */
+
+            memcpy(cooked, mix, count);
+            kernels[k]->mixSubmaster(cooked, sub, 77, count);
+            if (memcmp(cooked, refMix, count) != 0)
+            {
+                fprintf(stderr, "bench: %s submaster kernel disagrees with "
+                        "scalar at %d channels!\n", kernels[k]->name, count);
+                exit(1);
+            } /* if */
+
+            memcpy(cooked, raw, count);
+            kernels[k]->applyCurves(cooked, curves, tables, count);
+            if (memcmp(cooked, refCurved, count) != 0)
+            {
+                fprintf(stderr, "bench: %s curve kernel disagrees with "
+                        "scalar at %d channels!\n", kernels[k]->name, count);
+                exit(1);
+            } /* if */
+
+            passes = 0;
+            start = benchNow();
+            do
+            {
+                kernels[k]->cook(raw, mix, (int) (passes & 255), cooked, count);
+                passes++;
+                elapsed = benchNow() - start;
+            } while (elapsed < BENCH_TARGET_NS);
+
+            printf("{\"bench\":\"cook_kernel\",\"impl\":\"%s\","
+                   "\"channels\":%d,\"ns_per_pass\":%.1f}\n",
+                   kernels[k]->name, count, (double) elapsed / passes);
+
+            passes = 0;
+            start = benchNow();
+            do
+            {
+                kernels[k]->applyCurves(cooked, curves, tables, count);
+                passes++;
+                elapsed = benchNow() - start;
+            } while (elapsed < BENCH_TARGET_NS);
+
+            printf("{\"bench\":\"curve_kernel\",\"impl\":\"%s\","
+                   "\"channels\":%d,\"ns_per_pass\":%.1f}\n",
+                   kernels[k]->name, count, (double) elapsed / passes);
+        } /* for */
+
+        free(raw);
+        free(mix);
+        free(sub);
+        free(cooked);
+        free(refCooked);
+        free(refMix);
+        free(curves);
+        free(refCurved);
+    } /* for */
+} /* benchCookKernels */
+
+
+static long long cpuNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+} /* cpuNow */
+
+
+static int compareLongLong(const void *a, const void *b)
+{
+    long long diff = *((const long long *) a) - *((const long long *) b);
+    return((diff < 0) ? -1 : ((diff > 0) ? 1 : 0));
+} /* compareLongLong */
+
+
+static void printSpread(const char *bench, const char *extra,
+                        long long *samples, int count)
+/*
+ * Print the mean, median, 99th percentile and worst of (samples),
+ *  which are in nanoseconds. Sorts (samples).
+ */
+{
+    long long total = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total += samples[i];
+
+    qsort(samples, count, sizeof (long long), compareLongLong);
+    printf("{\"bench\":\"%s\",%s\"samples\":%d,\"mean_ns\":%.1f,"
+           "\"p50_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+           bench, extra, count, (double) total / count, samples[count / 2],
+           samples[(count * 99) / 100], samples[count - 1]);
+} /* printSpread */
+
+
+static void stopLibrary(void)
+{
+    dimmer_deinit();
+    if (capture != NULL)
+        munmap(capture, captureSize);
+    capture = NULL;
+    unlink(capturePath);
+} /* stopLibrary */
+
+
+static int startLibrary(void)
+/*
+ * Bring libdimmer up on the capture device, BENCH_UNIVERSES wide, and
+ *  map the capture file so we can see what comes out the other end.
+ */
+{
+    struct stat statbuf;
+    char universes[16];
+    int fd;
+
+    strcpy(capturePath, "/tmp/dimmer_bench.XXXXXX");
+    fd = mkstemp(capturePath);
+    if (fd == -1)
+        return(-1);
+    close(fd);
+
+    snprintf(universes, sizeof (universes), "%d", BENCH_UNIVERSES);
+    setenv(CAPTURE_PATH_ENV, capturePath, 1);
+    setenv(CAPTURE_UNIVERSES_ENV, universes, 1);
+
+    if ((dimmer_init(0) == -1) || (dimmer_select_device("capture") == -1))
+    {
+        fprintf(stderr, "bench: can't start the capture device!\n");
+        stopLibrary();
+        return(-1);
+    } /* if */
+
+    fd = open(capturePath, O_RDONLY);
+    if ((fd == -1) || (fstat(fd, &statbuf) == -1))
+    {
+        stopLibrary();
+        return(-1);
+    } /* if */
+
+    captureSize = (size_t) statbuf.st_size;
+    capture = mmap(NULL, captureSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (capture == MAP_FAILED)
+    {
+        capture = NULL;
+        stopLibrary();
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* startLibrary */
+
+
+static int capturedLevel(int channel, long long *when)
+/*
+ * The level of (channel) in the newest frame the capture device got,
+ *  and when it got it. -1 if there's no frame yet, or it's being
+ *  rewritten right now.
+ */
+{
+    unsigned long long head = __atomic_load_n(&capture->head,
+                                              __ATOMIC_ACQUIRE);
+    struct CaptureRecord *rec;
+    int level;
+
+    if (head == 0)
+        return(-1);
+
+    rec = (struct CaptureRecord *)
+            (((unsigned char *) (capture + 1)) +
+                (((head - 1) % capture->capacity) * capture->recordStride));
+    level = ((unsigned char *) (rec + 1))[channel];
+    *when = rec->when;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != head)
+        return(-1);
+
+    return(level);
+} /* capturedLevel */
+
+
+static void benchChannelSet(void)
+{
+    long long start, elapsed;
+    long calls = 0;
+
+    if (startLibrary() == -1)
+        return;
+
+    start = benchNow();
+    do
+    {
+        dimmer_channel_set((unsigned int) (calls % BENCH_CHANNELS),
+                           (unsigned char) calls);
+        calls++;
+        if ((calls & 1023) == 0)
+            elapsed = benchNow() - start;
+        else
+            elapsed = 0;
+    } while (elapsed < BENCH_TARGET_NS);
+
+    printf("{\"bench\":\"channel_set\",\"channels\":%d,\"calls\":%ld,"
+           "\"ns_per_call\":%.1f,\"calls_per_sec\":%.0f}\n",
+           BENCH_CHANNELS, calls, (double) elapsed / calls,
+           calls * (1000000000.0 / elapsed));
+
+    stopLibrary();
+} /* benchChannelSet */
+
+
+static void benchFadeStart(void)
+/*
+ * How long dimmer_channel_fade() takes to hand a fade off, with
+ *  BENCH_OUTSTANDING_FADES already running. Each call restarts one of
+ *  them, so the count holds steady.
+ */
+{
+    long long samples[BENCH_OUTSTANDING_FADES];
+    char extra[64];
+    long long start;
+    int i;
+
+    if (startLibrary() == -1)
+        return;
+
+    for (i = 0; i < BENCH_OUTSTANDING_FADES; i++)
+        dimmer_channel_fade(i, (unsigned char) (i | 1), 600.0);
+
+    for (i = 0; i < BENCH_OUTSTANDING_FADES; i++)
+    {
+        start = benchNow();
+        dimmer_channel_fade(i, (unsigned char) (255 - i), 600.0);
+        samples[i] = benchNow() - start;
+    } /* for */
+
+    snprintf(extra, sizeof (extra), "\"outstanding\":%d,",
+             BENCH_OUTSTANDING_FADES);
+    printSpread("fade_start", extra, samples, BENCH_OUTSTANDING_FADES);
+
+    stopLibrary();
+} /* benchFadeStart */
+
+
+static void benchFadePass(void)
+/*
+ * CPU time the whole library spends per frame with a given number of
+ *  fades moving. The first line, with none, is the floor to subtract.
+ */
+{
+    static const int counts[] = { 0, 512, 4096, BENCH_CHANNELS };
+    const int totalCounts = sizeof (counts) / sizeof (counts[0]);
+    const int hz = 200;
+    struct DimmerFrameTiming timing;
+    long long cpuStart, cpuUsed;
+    int c, i;
+
+    for (c = 0; c < totalCounts; c++)
+    {
+        if (startLibrary() == -1)
+            return;
+
+        dimmer_set_refresh_rate(hz);
+        for (i = 0; i < counts[c]; i++)
+            dimmer_channel_fade(i, 255, 600.0);
+
+        usleep(50000);   /* let it settle. */
+        dimmer_reset_timing();
+        cpuStart = cpuNow();
+        usleep(BENCH_TARGET_NS / 100);   /* ten of those. */
+        cpuUsed = cpuNow() - cpuStart;
+        dimmer_query_timing(&timing);
+
+        if (timing.frames > 0)
+        {
+            printf("{\"bench\":\"fade_pass\",\"active\":%d,\"hz\":%d,"
+                   "\"frames\":%lu,\"cpu_ns_per_frame\":%.1f}\n",
+                   counts[c], hz, timing.frames,
+                   (double) cpuUsed / timing.frames);
+        } /* if */
+
+        stopLibrary();
+    } /* for */
+} /* benchFadePass */
+
+
+static void benchCook(void)
+/*
+ * Moving the grand master recooks every channel; time that with no
+ *  submasters, with several covering everything, faders up, and with
+ *  every channel on a dimmer curve. Then time moving one of those
+ *  faders.
+ */
+{
+    static const int subCounts[] = { 0, 8, 0 };
+    static const int curveCounts[] = { 0, 0, BENCH_CHANNELS };
+    const int totalSubCounts = sizeof (subCounts) / sizeof (subCounts[0]);
+    static unsigned int channels[BENCH_CHANNELS];
+    static unsigned char levels[BENCH_CHANNELS];
+    long long start, elapsed;
+    long calls;
+    int c, i, sub;
+
+    for (i = 0; i < BENCH_CHANNELS; i++)
+    {
+        channels[i] = i;
+        levels[i] = (unsigned char) rand();
+    } /* for */
+
+    for (c = 0; c < totalSubCounts; c++)
+    {
+        if (startLibrary() == -1)
+            return;
+
+        for (sub = 0; sub < subCounts[c]; sub++)
+        {
+            dimmer_submaster_record(sub, channels, levels, BENCH_CHANNELS);
+            dimmer_submaster_set(sub, (unsigned char) (255 - sub));
+        } /* for */
+
+        for (i = 0; i < curveCounts[c]; i++)
+            dimmer_channel_curve(i, 1 + (i % DIMMER_CURVE_LED));
+
+        calls = 0;
+        start = benchNow();
+        do
+        {
+            dimmer_set_grand_master((calls & 1) ? 50 : 100);
+            calls++;
+            elapsed = benchNow() - start;
+        } while (elapsed < BENCH_TARGET_NS);
+
+        printf("{\"bench\":\"cook_grand_master\",\"channels\":%d,"
+               "\"submasters\":%d,\"curved\":%d,\"ns_per_call\":%.1f}\n",
+               BENCH_CHANNELS, subCounts[c], curveCounts[c],
+               (double) elapsed / calls);
+
+        if (subCounts[c] > 0)
+        {
+            calls = 0;
+            start = benchNow();
+            do
+            {
+                dimmer_submaster_set(0, (unsigned char) calls);
+                calls++;
+                elapsed = benchNow() - start;
+            } while (elapsed < BENCH_TARGET_NS);
+
+            printf("{\"bench\":\"cook_submaster\",\"channels\":%d,"
+                   "\"submasters\":%d,\"ns_per_call\":%.1f}\n",
+                   BENCH_CHANNELS, subCounts[c], (double) elapsed / calls);
+        } /* if */
+
+        stopLibrary();
+    } /* for */
+} /* benchCook */
+
+
+static void benchEndToEnd(void)
+/*
+ * From dimmer_channel_set() returning to the device getting a frame
+ *  with the new level in it, as timestamped by the capture device. The
+ *  sets are spread out so they land all over the frame period.
+ */
+{
+    static const int rates[] = { 0, 1000 };   /* 0 is the device's own. */
+    const int totalRates = sizeof (rates) / sizeof (rates[0]);
+    long long samples[BENCH_LATENCY_SAMPLES];
+    struct DimmerFrameTiming timing;
+    char extra[64];
+    long long start, when;
+    int count;
+    int level;
+    int c, i;
+
+    for (c = 0; c < totalRates; c++)
+    {
+        if (startLibrary() == -1)
+            return;
+
+        dimmer_set_refresh_rate(rates[c]);
+        dimmer_query_timing(&timing);
+
+        count = 0;
+        for (i = 0; i < BENCH_LATENCY_SAMPLES; i++)
+        {
+            level = (i & 1) ? 200 : 100;
+            start = benchNow();
+            dimmer_channel_set(5, (unsigned char) level);
+
+                /* give up on a sample after a second. */
+            while ((capturedLevel(5, &when) != level) &&
+                   (benchNow() - start < 1000000000LL))
+                usleep(50);
+
+            if (capturedLevel(5, &when) == level)
+                samples[count++] = when - start;
+
+            usleep(1000 + (rand() % 20000));
+        } /* for */
+
+        snprintf(extra, sizeof (extra), "\"hz\":%d,", timing.effectiveHz);
+        if (count > 0)
+            printSpread("set_to_device", extra, samples, count);
+
+        stopLibrary();
+    } /* for */
+} /* benchEndToEnd */
+
+
+static void checkScale255(void)
+/*
+ * scale255() promises exact rounding; make sure it keeps that promise.
+ */
+{
+    int a, b, want;
+
+    for (a = 0; a < 256; a++)
+    {
+        for (b = 0; b < 256; b++)
+        {
+            want = ((a * b) + 127) / 255;
+            if (scale255(a, b) != want)
+            {
+                fprintf(stderr, "bench: scale255(%d, %d) is %d, not %d!\n",
+                        a, b, scale255(a, b), want);
+                exit(1);
+            } /* if */
+        } /* for */
+    } /* for */
+} /* checkScale255 */
+
+
+int main(int argc, char **argv)
+{
+    srand(1999);
+    checkScale255();
+    benchFadeKernels();
+    benchCookKernels();
+    benchChannelSet();
+    benchFadeStart();
+    benchFadePass();
+    benchCook();
+    benchEndToEnd();
+    return(0);
+} /* main */
+
+/* end of bench.c ... */
+
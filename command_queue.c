@@ -0,0 +1,149 @@
+/*
+ * libdimmer's command queue. See command_queue.h.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "thread_rings.h"
+#include "command_queue.h"
+
+#define COMMAND_MASK  (COMMAND_RING_SIZE - 1)
+
+    /*
+     * One producer, one drainer. (head) and (tail) only ever count up,
+     *  and each is written by one side only, on a cache line of its own.
+     */
+struct CommandRing
+{
+    unsigned int head __attribute__((aligned(64)));   /* next to push.  */
+    unsigned int tail __attribute__((aligned(64)));   /* next to apply. */
+    int inUse;
+    struct ChannelCommand commands[COMMAND_RING_SIZE];
+};
+
+static __thread struct CommandRing *myRing = NULL;
+
+    /*
+     * A ring a thread leaves behind may still hold commands it pushed.
+     *  Its next owner just carries on from (head), so those still go
+     *  before the new owner's, and none are lost.
+     */
+static struct CommandRing *rings[COMMAND_MAX_PRODUCERS];
+static struct ThreadRings commandRings =
+                        THREAD_RINGS_INIT(rings, struct CommandRing, inUse);
+
+
+int commandPush(struct ChannelCommand *cmd)
+/*
+ * Queue a command from the calling thread. Never blocks.
+ *
+ *    params : cmd == command to queue.
+ *   returns : -1 if this thread's ring is full (or it couldn't get one),
+ *              0 if the command is queued.
+ */
+{
+    struct CommandRing *ring = myRing;
+    unsigned int head;
+
+    if (ring == NULL)
+    {
+        ring = (struct CommandRing *) threadRingsClaim(&commandRings);
+        if (ring == NULL)
+            return(-1);
+        myRing = ring;
+    } /* if */
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        COMMAND_RING_SIZE)
+        return(-1);
+
+    memcpy(&ring->commands[head & COMMAND_MASK], cmd,
+           sizeof (struct ChannelCommand));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return(0);
+} /* commandPush */
+
+
+int commandPending(void)
+/*
+ * Is anything waiting to be drained?
+ *
+ *    params : void.
+ *   returns : non-zero if so, zero if not.
+ */
+{
+    int count = threadRingsCount(&commandRings);
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (__atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE) !=
+            rings[i]->tail)
+            return(1);
+    } /* for */
+
+    return(0);
+} /* commandPending */
+
+
+int commandDrain(void (*apply)(const struct ChannelCommand *cmd))
+/*
+ * Apply everything queued so far, each thread's in the order it pushed
+ *  them; see command_queue.h. Commands queued while this runs wait for
+ *  the next drain, so a busy producer can't keep us here forever.
+ *
+ *    params : apply == called for each command.
+ *   returns : number of commands applied.
+ */
+{
+    unsigned int limit[COMMAND_MAX_PRODUCERS];
+    int count = threadRingsCount(&commandRings);
+    struct CommandRing *ring;
+    int drained = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        limit[i] = __atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < count; i++)
+    {
+        ring = rings[i];
+        while (ring->tail != limit[i])
+        {
+            apply(&ring->commands[ring->tail & COMMAND_MASK]);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+            drained++;
+        } /* while */
+    } /* for */
+
+    return(drained);
+} /* commandDrain */
+
+
+void commandDiscard(void)
+/*
+ * Throw away everything queued, as the drainer. Producers may keep
+ *  pushing meanwhile; what they push afterwards is kept.
+ *
+ *    params : void.
+ *   returns : void.
+ */
+{
+    int count = threadRingsCount(&commandRings);
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        __atomic_store_n(&rings[i]->tail,
+                         __atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    } /* for */
+} /* commandDiscard */
+
+/* end of command_queue.c ... */
+
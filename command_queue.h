@@ -0,0 +1,60 @@
+/*
+ * Internal declarations for libdimmer's command queue, which carries
+ *  level sets and fades from the application's threads to whoever holds
+ *  the fade lock, without the callers ever taking it. Not part of the
+ *  public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_COMMAND_QUEUE_H_
+#define _INCLUDE_COMMAND_QUEUE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMMAND_SET   0     /* (source)'s level for (channel) is (level).  */
+#define COMMAND_FADE  1     /* fade (channel) to (level), per the rest.    */
+
+#define COMMAND_RING_SIZE      1024   /* must be a power of two. */
+#define COMMAND_MAX_PRODUCERS  64
+
+struct ChannelCommand
+{
+    long long startTime;            /* fades: CLOCK_MONOTONIC nanoseconds. */
+    long long duration;             /* fades: nanoseconds.                */
+    unsigned int channel;           /* not patched yet.                   */
+    unsigned char type;             /* COMMAND_*                          */
+    unsigned char source;
+    unsigned char level;
+    unsigned char curve;            /* fades: DIMMER_FADE_*               */
+};
+
+    /*
+     * Each thread that pushes gets a ring of its own the first time, so
+     *  producers never contend with each other at all. One thread's
+     *  commands are applied in the order it pushed them. Between threads
+     *  there's no order: a drain takes whatever each ring held when it
+     *  started, one ring after another, and a command still being pushed
+     *  then waits for the next drain. A thread that needs its command to
+     *  land after another thread's must wait until that one is applied.
+     *  A dead thread's ring, and anything still in it, goes to the next
+     *  new thread.
+     *
+     * Only one thread at a time may drain (libdimmer holds fadeLock).
+     */
+int commandPush(struct ChannelCommand *cmd);
+int commandPending(void);
+int commandDrain(void (*apply)(const struct ChannelCommand *cmd));
+void commandDiscard(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_COMMAND_QUEUE_H_ */
+
+/* end of command_queue.h ... */
+
@@ -0,0 +1,382 @@
+/*
+ * Level cooking kernels for libdimmer. These turn raw channel levels
+ *  into what actually goes out to the dimmers: sources are merged,
+ *  submasters are mixed in, the grand master is applied, and each level
+ *  goes through its dimmer curve. There's a plain C version, and
+ *  SSE2/AVX2 versions picked at runtime when the CPU has them.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "boolean.h"
+#include "cook_kernel.h"
+
+#if (defined __x86_64__) || (defined __i386__)
+#define COOK_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+
+static void cookScalar(const unsigned char *raw, const unsigned char *subMix,
+                       int master, unsigned char *cooked, int count)
+{
+    int i;
+    int level;
+
+    for (i = 0; i < count; i++)
+    {
+        level = (raw[i] > subMix[i]) ? raw[i] : subMix[i];
+        cooked[i] = (unsigned char) scale255(level, master);
+    } /* for */
+} /* cookScalar */
+
+
+static void mixSubmasterScalar(unsigned char *mix, const unsigned char *levels,
+                               int master, int count)
+{
+    int i;
+    int level;
+
+    for (i = 0; i < count; i++)
+    {
+        level = scale255(levels[i], master);
+        if (level > mix[i])
+            mix[i] = (unsigned char) level;
+    } /* for */
+} /* mixSubmasterScalar */
+
+
+static void maxLevelsScalar(unsigned char *dst, const unsigned char *src,
+                            int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (src[i] > dst[i])
+            dst[i] = src[i];
+    } /* for */
+} /* maxLevelsScalar */
+
+
+static void applyCurvesScalar(unsigned char *cooked,
+                              const unsigned char *curves,
+                              const unsigned char *tables, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        cooked[i] = tables[(curves[i] << 8) + cooked[i]];
+} /* applyCurvesScalar */
+
+
+const struct CookKernels cookKernelsScalar =
+{
+    "scalar", cookScalar, mixSubmasterScalar, maxLevelsScalar,
+    applyCurvesScalar
+};
+
+
+#ifdef COOK_KERNEL_X86
+
+__attribute__((target("sse2")))
+static inline __m128i scale255SSE2(__m128i a, __m128i b)
+/*
+ * scale255() on eight 16-bit lanes. (a * b) never exceeds 65025, so
+ *  the low half of the 16-bit multiply is the whole product.
+ */
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+    return(_mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8));
+} /* scale255SSE2 */
+
+
+__attribute__((target("sse2")))
+static inline __m128i scaleBytesSSE2(__m128i levels, __m128i master)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = scale255SSE2(_mm_unpacklo_epi8(levels, zero), master);
+    __m128i hi = scale255SSE2(_mm_unpackhi_epi8(levels, zero), master);
+    return(_mm_packus_epi16(lo, hi));
+} /* scaleBytesSSE2 */
+
+
+__attribute__((target("sse2")))
+static void cookSSE2(const unsigned char *raw, const unsigned char *subMix,
+                     int master, unsigned char *cooked, int count)
+{
+    const __m128i master16 = _mm_set1_epi16((short) master);
+    __m128i level;
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        level = _mm_max_epu8(_mm_loadu_si128((const __m128i *) &raw[i]),
+                             _mm_loadu_si128((const __m128i *) &subMix[i]));
+        _mm_storeu_si128((__m128i *) &cooked[i],
+                         scaleBytesSSE2(level, master16));
+    } /* for */
+
+    cookScalar(raw + i, subMix + i, master, cooked + i, count - i);
+} /* cookSSE2 */
+
+
+__attribute__((target("sse2")))
+static void mixSubmasterSSE2(unsigned char *mix, const unsigned char *levels,
+                             int master, int count)
+{
+    const __m128i master16 = _mm_set1_epi16((short) master);
+    __m128i level;
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        level = scaleBytesSSE2(_mm_loadu_si128((const __m128i *) &levels[i]),
+                               master16);
+        level = _mm_max_epu8(level, _mm_loadu_si128((const __m128i *) &mix[i]));
+        _mm_storeu_si128((__m128i *) &mix[i], level);
+    } /* for */
+
+    mixSubmasterScalar(mix + i, levels + i, master, count - i);
+} /* mixSubmasterSSE2 */
+
+
+__attribute__((target("sse2")))
+static void maxLevelsSSE2(unsigned char *dst, const unsigned char *src,
+                          int count)
+{
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        _mm_storeu_si128((__m128i *) &dst[i],
+                  _mm_max_epu8(_mm_loadu_si128((const __m128i *) &dst[i]),
+                               _mm_loadu_si128((const __m128i *) &src[i])));
+    } /* for */
+
+    maxLevelsScalar(dst + i, src + i, count - i);
+} /* maxLevelsSSE2 */
+
+
+    /* SSE2 has no gather; a table lookup is as quick done one at a time. */
+const struct CookKernels cookKernelsSSE2 =
+{
+    "sse2", cookSSE2, mixSubmasterSSE2, maxLevelsSSE2, applyCurvesScalar
+};
+
+
+__attribute__((target("avx2")))
+static inline __m256i scale255AVX2(__m256i a, __m256i b)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, b),
+                                 _mm256_set1_epi16(128));
+    return(_mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8));
+} /* scale255AVX2 */
+
+
+__attribute__((target("avx2")))
+static inline __m256i scaleBytesAVX2(__m256i levels, __m256i master)
+{
+        /* unpack and pack both work per 128-bit half, so order survives. */
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = scale255AVX2(_mm256_unpacklo_epi8(levels, zero), master);
+    __m256i hi = scale255AVX2(_mm256_unpackhi_epi8(levels, zero), master);
+    return(_mm256_packus_epi16(lo, hi));
+} /* scaleBytesAVX2 */
+
+
+__attribute__((target("avx2")))
+static void cookAVX2(const unsigned char *raw, const unsigned char *subMix,
+                     int master, unsigned char *cooked, int count)
+{
+    const __m256i master16 = _mm256_set1_epi16((short) master);
+    __m256i level;
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        level = _mm256_max_epu8(
+                        _mm256_loadu_si256((const __m256i *) &raw[i]),
+                        _mm256_loadu_si256((const __m256i *) &subMix[i]));
+        _mm256_storeu_si256((__m256i *) &cooked[i],
+                            scaleBytesAVX2(level, master16));
+    } /* for */
+
+    cookSSE2(raw + i, subMix + i, master, cooked + i, count - i);
+} /* cookAVX2 */
+
+
+__attribute__((target("avx2")))
+static void mixSubmasterAVX2(unsigned char *mix, const unsigned char *levels,
+                             int master, int count)
+{
+    const __m256i master16 = _mm256_set1_epi16((short) master);
+    __m256i level;
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        level = scaleBytesAVX2(
+                        _mm256_loadu_si256((const __m256i *) &levels[i]),
+                        master16);
+        level = _mm256_max_epu8(level,
+                                _mm256_loadu_si256((const __m256i *) &mix[i]));
+        _mm256_storeu_si256((__m256i *) &mix[i], level);
+    } /* for */
+
+    mixSubmasterSSE2(mix + i, levels + i, master, count - i);
+} /* mixSubmasterAVX2 */
+
+
+__attribute__((target("avx2")))
+static void maxLevelsAVX2(unsigned char *dst, const unsigned char *src,
+                          int count)
+{
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *) &dst[i],
+              _mm256_max_epu8(_mm256_loadu_si256((const __m256i *) &dst[i]),
+                              _mm256_loadu_si256((const __m256i *) &src[i])));
+    } /* for */
+
+    maxLevelsSSE2(dst + i, src + i, count - i);
+} /* maxLevelsAVX2 */
+
+
+__attribute__((target("avx2")))
+static inline __m256i gatherCurvesAVX2(const unsigned char *cooked,
+                                       const unsigned char *curves,
+                                       const unsigned char *tables)
+/*
+ * Eight lookups at once, each a dword gather whose low byte is the
+ *  entry we want; the other three bytes are the entries after it.
+ */
+{
+    __m256i level = _mm256_cvtepu8_epi32(
+                        _mm_loadl_epi64((const __m128i *) cooked));
+    __m256i curve = _mm256_cvtepu8_epi32(
+                        _mm_loadl_epi64((const __m128i *) curves));
+    __m256i index = _mm256_add_epi32(_mm256_slli_epi32(curve, 8), level);
+
+    return(_mm256_and_si256(_mm256_i32gather_epi32((const int *) tables,
+                                                   index, 1),
+                            _mm256_set1_epi32(0xFF)));
+} /* gatherCurvesAVX2 */
+
+
+__attribute__((target("avx2")))
+static void applyCurvesAVX2(unsigned char *cooked, const unsigned char *curves,
+                            const unsigned char *tables, int count)
+{
+        /* packing works per 128-bit half; this puts the dwords back. */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i a;
+    __m256i b;
+    __m256i c;
+    __m256i d;
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        a = gatherCurvesAVX2(cooked + i, curves + i, tables);
+        b = gatherCurvesAVX2(cooked + i + 8, curves + i + 8, tables);
+        c = gatherCurvesAVX2(cooked + i + 16, curves + i + 16, tables);
+        d = gatherCurvesAVX2(cooked + i + 24, curves + i + 24, tables);
+        a = _mm256_packus_epi16(_mm256_packus_epi32(a, b),
+                                _mm256_packus_epi32(c, d));
+        _mm256_storeu_si256((__m256i *) &cooked[i],
+                            _mm256_permutevar8x32_epi32(a, order));
+    } /* for */
+
+    applyCurvesScalar(cooked + i, curves + i, tables, count - i);
+} /* applyCurvesAVX2 */
+
+
+const struct CookKernels cookKernelsAVX2 =
+{
+    "avx2", cookAVX2, mixSubmasterAVX2, maxLevelsAVX2, applyCurvesAVX2
+};
+
+#else   /* no x86 SIMD; these exist so callers don't need #ifdefs. */
+
+const struct CookKernels cookKernelsSSE2 =
+{
+    "sse2", cookScalar, mixSubmasterScalar, maxLevelsScalar,
+    applyCurvesScalar
+};
+
+const struct CookKernels cookKernelsAVX2 =
+{
+    "avx2", cookScalar, mixSubmasterScalar, maxLevelsScalar,
+    applyCurvesScalar
+};
+
+#endif
+
+
+int cookKernelsAvailable(const struct CookKernels *kernels)
+/*
+ * Check whether this CPU can run a given set of kernels.
+ *
+ *    params : kernels == one of the cookKernels* structs.
+ *   returns : non-zero if (kernels) is usable, zero otherwise.
+ */
+{
+    if (kernels == &cookKernelsScalar)
+        return(1);
+
+#ifdef COOK_KERNEL_X86
+    __builtin_cpu_init();
+    if (kernels == &cookKernelsSSE2)
+        return(__builtin_cpu_supports("sse2"));
+    if (kernels == &cookKernelsAVX2)
+        return(__builtin_cpu_supports("avx2"));
+#endif
+
+    return(0);
+} /* cookKernelsAvailable */
+
+
+const struct CookKernels *cookKernelsSelect(void)
+/*
+ * Pick the fastest kernels this CPU supports. The DIMMER_SIMD
+ *  environment variable overrides this, same as fadeKernelSelect().
+ *
+ *    params : void.
+ *   returns : the kernels to use.
+ */
+{
+    static const struct CookKernels *all[] =
+    {
+        &cookKernelsAVX2, &cookKernelsSSE2, &cookKernelsScalar
+    };
+    const int total = sizeof (all) / sizeof (all[0]);
+    const char *want = getenv("DIMMER_SIMD");
+    int i;
+
+    if (want != NULL)
+    {
+        for (i = 0; i < total; i++)
+        {
+            if ((strcmp(want, all[i]->name) == 0) &&
+                (cookKernelsAvailable(all[i])))
+                return(all[i]);
+        } /* for */
+    } /* if */
+
+    for (i = 0; i < total; i++)
+    {
+        if (cookKernelsAvailable(all[i]))
+            break;
+    } /* for */
+
+    return(all[i]);
+} /* cookKernelsSelect */
+
+/* end of cook_kernel.c ... */
+
@@ -0,0 +1,66 @@
+/*
+ * Internal declarations for the level cooking kernels. Not part of
+ *  the public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_COOK_KERNEL_H_
+#define _INCLUDE_COOK_KERNEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * All levels and masters here are 0-255, with 255 meaning "full."
+     *  Scaling is (level * master / 255), rounded to nearest, exactly;
+     *  every implementation must produce identical results.
+     */
+struct CookKernels
+{
+    const char *name;
+
+        /* cooked[i] = max(raw[i], subMix[i]) scaled by (master). */
+    void (*cook)(const unsigned char *raw, const unsigned char *subMix,
+                 int master, unsigned char *cooked, int count);
+
+        /* mix[i] = max(mix[i], levels[i] scaled by (master)). */
+    void (*mixSubmaster)(unsigned char *mix, const unsigned char *levels,
+                         int master, int count);
+
+        /* dst[i] = max(dst[i], src[i]). Highest-takes-precedence merge. */
+    void (*maxLevels)(unsigned char *dst, const unsigned char *src, int count);
+
+        /*
+         * cooked[i] = tables[(curves[i] * 256) + cooked[i]]: each level
+         *  looked up in its channel's 256-entry curve. (tables) needs
+         *  three more readable bytes past the last table in use.
+         */
+    void (*applyCurves)(unsigned char *cooked, const unsigned char *curves,
+                        const unsigned char *tables, int count);
+};
+
+extern const struct CookKernels cookKernelsScalar;
+extern const struct CookKernels cookKernelsSSE2;
+extern const struct CookKernels cookKernelsAVX2;
+
+int cookKernelsAvailable(const struct CookKernels *kernels);
+const struct CookKernels *cookKernelsSelect(void);
+
+    /* (a * b / 255), rounded, for 0-255 inputs. */
+static inline int scale255(int a, int b)
+{
+    int t = (a * b) + 128;
+    return((t + (t >> 8)) >> 8);
+} /* scale255 */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_COOK_KERNEL_H_ */
+
+/* end of cook_kernel.h ... */
+
@@ -0,0 +1,233 @@
+/*
+ * Support code for the "capture" device: a headless stand-in for real
+ *  hardware, for benchmarks and for looking over a show afterwards.
+ *  Every frame is copied, with a timestamp, into a ring in a
+ *  memory-mapped file; see dev_capture.h for the layout. That's one
+ *  memcpy and a clock read per frame, with no system calls, so it keeps
+ *  up with any refresh rate the library can run at.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "boolean.h"
+#include "dimmer.h"
+#include "dev_capture.h"
+#include "trace.h"
+
+#define CAPTURE_DEFAULT_FRAMES  4096
+#define CAPTURE_MAX_UNIVERSES   64
+#define CAPTURE_ALIGN           64
+
+static struct DimmerDeviceInfo devInfo;
+static struct CaptureHeader *header = NULL;
+static unsigned char *records = NULL;
+static size_t mappedSize = 0;
+
+
+static int capture_envInt(const char *name, int def, int max)
+{
+    const char *str = getenv(name);
+    int val;
+
+    if ((str == NULL) || (*str == '\0'))
+        return(def);
+
+    val = atoi(str);
+    return(((val < 1) || (val > max)) ? def : val);
+} /* capture_envInt */
+
+
+static void capture_queryModName(char *buffer, int bufSize)
+{
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_QUERY_NAME, bufSize);
+    strncpy(buffer, "capture", bufSize);
+    buffer[bufSize - 1] = '\0';  /* promises null termination. */
+} /* capture_queryModName */
+
+
+static int capture_sendFrame(unsigned char *levels)
+/*
+ * Record one frame. (seq) goes to zero while the record is being
+ *  rewritten, so a reader can tell it's torn.
+ */
+{
+    struct CaptureRecord *rec;
+    struct timespec ts;
+    unsigned long long pos;
+
+    if (header == NULL)
+    {
+        errno = EBADF;
+        return(-1);
+    } /* if */
+
+    pos = header->head;
+    rec = (struct CaptureRecord *)
+            (records + ((pos % header->capacity) * header->recordStride));
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->when = ((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+    memcpy(rec + 1, levels, header->frameSize);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, pos + 1, __ATOMIC_RELEASE);
+    return(0);
+} /* capture_sendFrame */
+
+
+static void capture_updateDevice(unsigned char *levels)
+{
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_UPDATE, devInfo.numChannels);
+    capture_sendFrame(levels);
+} /* capture_updateDevice */
+
+
+static int capture_queryExistence(void)
+{
+    const char *path = getenv(CAPTURE_PATH_ENV);
+
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_EXISTENCE, 0);
+    return(((path != NULL) && (*path != '\0')) ? 1 : 0);
+} /* capture_queryExistence */
+
+
+static int capture_queryDevice(struct DimmerDeviceInfo *info)
+{
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_QUERY_DEVICE, 0);
+    memcpy(info, &devInfo, sizeof (struct DimmerDeviceInfo));
+    return(0);
+} /* capture_queryDevice */
+
+
+static int capture_initialize(void)
+{
+    const char *path = getenv(CAPTURE_PATH_ENV);
+    int universes;
+    int capacity;
+    int frameSize;
+    int stride;
+    size_t size;
+    void *mem;
+    int fd;
+
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_INITIALIZE, 0);
+    memset(&devInfo, '\0', sizeof (struct DimmerDeviceInfo));
+
+    if ((path == NULL) || (*path == '\0'))
+    {
+        errno = ENODEV;
+        return(-1);
+    } /* if */
+
+    universes = capture_envInt(CAPTURE_UNIVERSES_ENV, 1, CAPTURE_MAX_UNIVERSES);
+    capacity = capture_envInt(CAPTURE_FRAMES_ENV, CAPTURE_DEFAULT_FRAMES,
+                              1 << 20);
+    frameSize = universes * DIMMER_UNIVERSE_SIZE;
+    stride = (sizeof (struct CaptureRecord) + frameSize + (CAPTURE_ALIGN - 1)) &
+                ~(CAPTURE_ALIGN - 1);
+    size = sizeof (struct CaptureHeader) + ((size_t) capacity * stride);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        return(-1);
+    } /* if */
+
+    if (ftruncate(fd, (off_t) size) == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        close(fd);
+        return(-1);
+    } /* if */
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);   /* the mapping keeps the file. */
+    if (mem == MAP_FAILED)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        return(-1);
+    } /* if */
+
+    header = (struct CaptureHeader *) mem;
+    records = ((unsigned char *) mem) + sizeof (struct CaptureHeader);
+    mappedSize = size;
+
+    header->version = CAPTURE_VERSION;
+    header->frameSize = frameSize;
+    header->recordStride = stride;
+    header->capacity = capacity;
+    header->numUniverses = universes;
+    header->head = 0;
+    __atomic_store_n(&header->magic, CAPTURE_MAGIC, __ATOMIC_RELEASE);
+
+    devInfo.numOutputs = universes;
+    devInfo.numChannels = frameSize;
+    devInfo.numUniverses = universes;
+    devInfo.isDuplexed = 0;
+    devInfo.refreshHz = 0;      /* whatever the library likes. */
+    return(0);
+} /* capture_initialize */
+
+
+static void capture_deinitialize(void)
+{
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_DEINITIALIZE, 0);
+    if (header != NULL)
+        munmap(header, mappedSize);   /* what's written stays in the file. */
+    header = NULL;
+    records = NULL;
+    mappedSize = 0;
+} /* capture_deinitialize */
+
+
+static int capture_channelSet(int channel, int intensity)
+{
+        /* levels only ever get recorded a whole frame at a time. */
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_CHANNEL_SET, channel);
+    return(0);
+} /* capture_channelSet */
+
+
+static int capture_setDuplexMode(__boolean shouldSet)
+{
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_SET_DUPLEX, shouldSet);
+    return(-1);
+} /* capture_setDuplexMode */
+
+
+    /*
+     * This struct is down here so I don't need
+     *  prototypes of all these functions...
+     */
+struct DimmerDeviceFunctions capture_funcs =   {
+                                                   capture_queryModName,
+                                                   capture_queryExistence,
+                                                   capture_queryDevice,
+                                                   capture_initialize,
+                                                   capture_deinitialize,
+                                                   capture_channelSet,
+                                                   capture_setDuplexMode,
+                                                   capture_updateDevice,
+                                                   NULL,   /* updateUniverse */
+                                                   capture_sendFrame,
+                                                   NULL,   /* queryAsyncOutputs */
+                                                   NULL,   /* sendChanges */
+                                                   NULL    /* setUniverseSlots */
+                                               };
+
+/* end of dev_capture.c ... */
+
@@ -0,0 +1,70 @@
+/*
+ * Header file for the "capture" device, which records every frame into
+ *  a memory-mapped ring file instead of sending it anywhere. The layout
+ *  of that file is here, for tools that read it back.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_DEV_CAPTURE_H_
+#define _INCLUDE_DEV_CAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * The capture device exists when DIMMER_CAPTURE_PATH names the file
+     *  to record into. It's created (or truncated) at initialization.
+     *  DIMMER_CAPTURE_FRAMES sets how many frames the ring holds (4096
+     *  if unset), DIMMER_CAPTURE_UNIVERSES how many universes the device
+     *  claims to have (1 if unset).
+     */
+#define CAPTURE_PATH_ENV       "DIMMER_CAPTURE_PATH"
+#define CAPTURE_FRAMES_ENV     "DIMMER_CAPTURE_FRAMES"
+#define CAPTURE_UNIVERSES_ENV  "DIMMER_CAPTURE_UNIVERSES"
+
+#define CAPTURE_MAGIC    0x50414344    /* "DCAP" */
+#define CAPTURE_VERSION  1
+
+    /*
+     * The file is a CaptureHeader, then (capacity) records, each
+     *  (recordStride) bytes long and starting on a 64-byte boundary:
+     *  a CaptureRecord, then (frameSize) bytes of levels, laid out as
+     *  updateDevice() gets them. Frame (n), counting from zero, goes in
+     *  record (n % capacity).
+     *
+     * The writer never waits for a reader. A reader can look at the file
+     *  while it's being written, the same way trace.c reads its rings:
+     *  take (head), copy a record, and keep it only if its (seq) was the
+     *  one expected there, both before and after the copy.
+     */
+struct CaptureHeader
+{
+    unsigned int magic;
+    int version;
+    int frameSize;                  /* bytes of levels per frame.         */
+    int recordStride;
+    int capacity;                   /* records in the ring.               */
+    int numUniverses;
+    unsigned long long head;        /* frames ever written.               */
+    unsigned char pad[32];
+};
+
+struct CaptureRecord
+{
+    long long when;                 /* CLOCK_MONOTONIC, nanoseconds.      */
+    unsigned long long seq;         /* frame number + 1; 0 while writing. */
+};
+
+extern struct DimmerDeviceFunctions capture_funcs;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_DEV_CAPTURE_H_ */
+
+/* end of dev_capture.h ... */
+
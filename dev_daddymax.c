@@ -1,31 +1,213 @@
 /*
  * Support code for the DaddyMax DMX512 dongle.
  *
+ * The kernel driver takes whole DMX512 packets: the start code, then
+ *  one byte per slot, in a single write() to /dev/daddymax. A packet
+ *  can stop short of 512 slots, and a short one takes less time on the
+ *  wire, so we only send as many slots as the library says are in use. Set
+ *  DIMMER_DADDYMAX_PATH to send them somewhere else instead, such as a
+ *  FIFO or a pty, to test without the hardware. If the driver latches
+ *  (keeps retransmitting the last packet on its own), set
+ *  DIMMER_DADDYMAX_LATCHED, and unchanged frames aren't sent at all.
+ *
  *  Copyright (c) 1999 Lighting and Sound Technologies.
  *   Written by Ryan C. Gordon.
  */
 
-#include <stdio.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include "boolean.h"
 #include "dimmer.h"
+#include "trace.h"
+
+#define DADDYMAX_DEFAULT_PATH  "/dev/daddymax"
+#define DADDYMAX_PATH_ENV      "DIMMER_DADDYMAX_PATH"
+#define DADDYMAX_LATCHED_ENV   "DIMMER_DADDYMAX_LATCHED"
+
+#define DMX_START_CODE  0x00       /* dimmer levels. */
+
+    /* how long to wait for the rest of a frame the device took half of. */
+#define DADDYMAX_FINISH_MS  5
+
+    /*
+     * DMX512 at 250kbaud: 44 microseconds a slot, and a break, mark after
+     *  break and start code ahead of every packet.
+     */
+#define DMX_SLOT_USECS    44
+#define DMX_PACKET_USECS  (92 + 12 + DMX_SLOT_USECS)
 
 static struct DimmerDeviceInfo devInfo;
+static int deviceFD = -1;
+static __boolean latched = __false;
+static __boolean haveLastFrame = __false;
+static unsigned char lastFrame[DIMMER_UNIVERSE_SIZE];
+static int slotCount = DIMMER_UNIVERSE_SIZE;   /* slots sent per packet. */
+
+
+static const char *daddymax_path(void)
+{
+    const char *path = getenv(DADDYMAX_PATH_ENV);
+    return(((path != NULL) && (*path != '\0')) ? path : DADDYMAX_DEFAULT_PATH);
+} /* daddymax_path */
 
 
 static void daddymax_queryModName(char *buffer, int bufSize)
 {
-    printf("daddymax_queryModName(%p, %d)\n", buffer, bufSize);
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_QUERY_NAME, bufSize);
     strncpy(buffer, "daddymax_kernel", bufSize);
     buffer[bufSize - 1] = '\0';  /* promises null termination. */
 } /* daddymax_queryModName */
 
 
+static int daddymax_finishFrame(struct iovec *iov, int iovCount, ssize_t sent)
+/*
+ * The device took part of a frame. A DMX packet can't be left half sent,
+ *  or everything after it comes out shifted, so wait a little for room
+ *  for the rest.
+ *
+ *    params : iov      == the frame, as passed to writev().
+ *             iovCount == elements in (iov).
+ *             sent     == bytes already written.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ */
+{
+    struct pollfd pfd;
+    unsigned char *ptr;
+    size_t len;
+    ssize_t rc;
+    int i;
+
+    pfd.fd = deviceFD;
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < iovCount; i++)
+    {
+        if (sent >= (ssize_t) iov[i].iov_len)
+        {
+            sent -= iov[i].iov_len;   /* this piece already went out. */
+            continue;
+        } /* if */
+
+        ptr = ((unsigned char *) iov[i].iov_base) + sent;
+        len = iov[i].iov_len - sent;
+        sent = 0;
+
+        while (len > 0)
+        {
+            rc = write(deviceFD, ptr, len);
+            if (rc == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if ((errno != EAGAIN) ||
+                    (poll(&pfd, 1, DADDYMAX_FINISH_MS) <= 0))
+                    return(-1);
+                continue;
+            } /* if */
+
+            ptr += rc;
+            len -= rc;
+        } /* while */
+    } /* for */
+
+    return(0);
+} /* daddymax_finishFrame */
+
+
+static int daddymax_sendFrame(unsigned char *levels)
+/*
+ * One DMX512 packet, in one system call: the start code and the frame
+ *  go out together with writev(), straight from the frame buffer.
+ *  Nonblocking, so a backed-up driver turns us away with EAGAIN instead
+ *  of stalling the device thread.
+ */
+{
+    unsigned char startCode = DMX_START_CODE;
+    struct iovec iov[2];
+    ssize_t total = 1 + slotCount;
+    ssize_t rc;
+
+    if (deviceFD == -1)
+    {
+        errno = EBADF;
+        return(-1);
+    } /* if */
+
+    if ((latched) && (haveLastFrame) &&
+        (memcmp(lastFrame, levels, slotCount) == 0))
+        return(0);   /* the driver is still sending this one. */
+
+    iov[0].iov_base = &startCode;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = levels;
+    iov[1].iov_len = slotCount;
+
+    do
+    {
+        rc = writev(deviceFD, iov, 2);
+    } while ((rc == -1) && (errno == EINTR));
+
+    if (rc == -1)
+        return(-1);   /* EAGAIN: the device thread will try again. */
+
+    if ((rc < total) && (daddymax_finishFrame(iov, 2, rc) == -1))
+    {
+        haveLastFrame = __false;   /* who knows what the driver has now. */
+        return(-1);
+    } /* if */
+
+    if (latched)
+    {
+        memcpy(lastFrame, levels, slotCount);
+        haveLastFrame = __true;
+    } /* if */
+
+    return(0);
+} /* daddymax_sendFrame */
+
+
+static int daddymax_queryAsyncOutputs(struct DimmerAsyncOutput *outputs,
+                                      int max)
+{
+        /* the library can't skip unchanged frames for us, so not if latched. */
+    if ((deviceFD == -1) || (latched) || (max < 1))
+        return(0);
+
+    outputs[0].fd = deviceFD;
+    outputs[0].universe = 0;
+    outputs[0].headerSize = 1;
+    outputs[0].header[0] = DMX_START_CODE;
+    return(1);
+} /* daddymax_queryAsyncOutputs */
+
+
+static void daddymax_setUniverseSlots(int universe, int slots)
+{
+    if ((universe != 0) || (slots < 1))
+        return;
+
+    if (slots > devInfo.numChannels)
+        slots = devInfo.numChannels;
+
+    if (slots != slotCount)
+    {
+        slotCount = slots;
+        haveLastFrame = __false;   /* a longer packet has news in it. */
+    } /* if */
+} /* daddymax_setUniverseSlots */
+
+
 static void daddymax_updateDevice(unsigned char *levels)
 {
-    printf("daddymax_updateDevice(%p)\n", levels);
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_UPDATE, devInfo.numChannels);
+    daddymax_sendFrame(levels);
 } /* daddymax_updateDevice */
 
 
@@ -34,11 +216,12 @@ static int daddymax_queryExistence(void)
     int retVal = 0;
     struct stat statInfo;
 
-    printf("daddymax_queryExistence()\n");
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_EXISTENCE, 0);
 
-    if (stat("/dev/daddymax", &statInfo) != -1)
+    if (stat(daddymax_path(), &statInfo) != -1)
     {
-        if (statInfo.st_mode & S_IFCHR)  /* character device? */
+            /* the real thing, or a stand-in for testing. */
+        if ((S_ISCHR(statInfo.st_mode)) || (S_ISFIFO(statInfo.st_mode)))
             retVal = 1;
     } /* if */
 
@@ -48,7 +231,7 @@ static int daddymax_queryExistence(void)
 
 static int daddymax_queryDevice(struct DimmerDeviceInfo *info)
 {
-    printf("daddymax_queryDevice(%p)\n", info);
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_QUERY_DEVICE, 0);
     memcpy(info, &devInfo, sizeof (struct DimmerDeviceInfo));
     return(0);
 } /* daddymax_queryDevice */
@@ -56,33 +239,54 @@ static int daddymax_queryDevice(struct DimmerDeviceInfo *info)
 
 static int daddymax_initialize(void)
 {
-    printf("daddymax_initialize()\n");
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_INITIALIZE, 0);
     memset(&devInfo, '\0', sizeof (struct DimmerDeviceInfo));
 
-    //open("/dev/daddymax", O_RDWR);
+        /* O_RDWR, so a FIFO opens without waiting for a reader. */
+    deviceFD = open(daddymax_path(),
+                    O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (deviceFD == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        return(-1);
+    } /* if */
+
+    latched = (getenv(DADDYMAX_LATCHED_ENV) != NULL) ? __true : __false;
+    haveLastFrame = __false;
+    slotCount = DIMMER_UNIVERSE_SIZE;
+
     devInfo.numOutputs = 1;     /* !!! lose this later! */
-    devInfo.numChannels = 512;
+    devInfo.numChannels = DIMMER_UNIVERSE_SIZE;
+    devInfo.numUniverses = 1;
     devInfo.isDuplexed = 0;
+    devInfo.refreshHz = 44;     /* a full DMX512 universe can't go faster. */
+    devInfo.slotUsecs = DMX_SLOT_USECS;
+    devInfo.packetUsecs = DMX_PACKET_USECS;
     return(0);
 } /* daddymax_initialize */
 
 
 static void daddymax_deinitialize(void)
 {
-    printf("daddymax_deinitialize()\n");
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_DEINITIALIZE, 0);
+    if (deviceFD != -1)
+        close(deviceFD);
+    deviceFD = -1;
+    haveLastFrame = __false;
 } /* daddymax_deinitialize */
 
 
 static int daddymax_channelSet(int channel, int intensity)
 {
-    printf("daddymax_channelSet(%d, %d)\n", channel, intensity);
+        /* levels only ever go out a whole frame at a time. */
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_CHANNEL_SET, channel);
     return(0);
 } /* daddymax_channelSet */
 
 
 static int daddymax_setDuplexMode(__boolean shouldSet)
 {
-    printf("daddymax_setDuplexMode(%s)\n", shouldSet ? "__true" : "__false");
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_SET_DUPLEX, shouldSet);
     return(-1);
 } /* setDuplexMode */
 
@@ -99,7 +303,12 @@ struct DimmerDeviceFunctions daddymax_funcs =   {
                                                     daddymax_deinitialize,
                                                     daddymax_channelSet,
                                                     daddymax_setDuplexMode,
-                                                    daddymax_updateDevice
+                                                    daddymax_updateDevice,
+                                                    NULL,   /* updateUniverse */
+                                                    daddymax_sendFrame,
+                                                    daddymax_queryAsyncOutputs,
+                                                    NULL,   /* sendChanges */
+                                                    daddymax_setUniverseSlots
                                                 };
 
 /* end of dev_daddymax.c ... */
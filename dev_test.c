@@ -10,19 +10,37 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
 #include "boolean.h"
 #include "dimmer.h"
+#include "trace.h"
 
 
+    /* console attributes: light grey, and yellow for a channelSet() poke. */
+#define TESTDEV_COLOR      7
+#define TESTDEV_HIGHLIGHT  14
+
 static struct DimmerDeviceInfo devInfo;
 static int cons = -1;
-static unsigned char *channelColor;
 static int lines = 25;
 static int columns = 80;
 
+    /*
+     * One row per channel. (screen) holds every row as last rendered,
+     *  (shownLevels) the level each one got from the last frame that
+     *  moved it (-1 if it needs drawing regardless), and (channelColor)
+     *  the attribute it's drawn in. Rows dirtyFirst through dirtyLast
+     *  have been rendered but not yet written to the console.
+     */
+static unsigned char *screen = NULL;
+static int *shownLevels = NULL;
+static unsigned char *channelColor = NULL;
+static int dirtyFirst = -1;
+static int dirtyLast = -1;
+
 
 static void testdev_queryModName(char *buffer, int bufSize)
 {
@@ -31,34 +49,87 @@ static void testdev_queryModName(char *buffer, int bufSize)
 } /* testdev_queryModName */
 
 
-static void testdev_updateDevice(unsigned char *levels)
+static void testdev_drawRow(int row, int level)
+/*
+ * Render one channel's bar into (screen). Nothing is written to the
+ *  console until testdev_flush().
+ */
 {
-    int max = devInfo.numChannels;
-    int i;
-    int j;
-    unsigned char buffer[columns * 2];
+    unsigned char *buffer = screen + (row * (columns * 2));
     int starCount;
+    int j;
 
     buffer[0] = '[';
     buffer[1] = 7;
     buffer[(columns * 2) - 2] = ']';
     buffer[(columns * 2) - 1] = 7;
 
+    starCount = ((int) (((double) level / 255.0) * columns)) * 2;
+    starCount += 2; /* add two since '[' is first char... */
+
+    for (j = 2; j < (columns - 1) * 2; j += 2)
+    {
+        buffer[j] = ((j < starCount) ? '*' : ' ');
+        buffer[j + 1] = channelColor[row];
+    } /* for */
+
+    if ((dirtyFirst == -1) || (row < dirtyFirst))
+        dirtyFirst = row;
+    if (row > dirtyLast)
+        dirtyLast = row;
+} /* testdev_drawRow */
+
+
+static void testdev_flush(void)
+/*
+ * Put every row redrawn since last time on the console, in one system
+ *  call. The rows are one screen line each, back to back, so the span
+ *  from the first to the last of them is one run of the console; clean
+ *  rows caught in between just get rewritten as they were.
+ */
+{
+    struct iovec iov;
+    int rowBytes = columns * 2;
+
+    if (dirtyFirst == -1)
+        return;
+
+    iov.iov_base = screen + (dirtyFirst * rowBytes);
+    iov.iov_len = (dirtyLast - dirtyFirst + 1) * rowBytes;
+    pwritev(cons, &iov, 1, (off_t) ((dirtyFirst * rowBytes) + 4));
+
+    dirtyFirst = dirtyLast = -1;
+} /* testdev_flush */
+
+
+static int testdev_sendChanges(unsigned char *levels,
+                               const unsigned char *changed)
+{
+    int max = devInfo.numChannels;
+    int i;
+
+        /* the console keeps what's on it; only redraw what moved. */
     for (i = 0; i < max; i++)
     {
-        starCount = ((int) (((double) levels[i] / 255.0) * columns)) * 2;
-        starCount += 2; /* add two since '[' is first char... */
+        if ((changed != NULL) && (!DIMMER_CHANNEL_CHANGED(changed, i)))
+            continue;
 
-        for (j = 2; j < (columns - 1) * 2; j += 2)
+        if (shownLevels[i] != levels[i])
         {
-            buffer[j] = ((j < starCount) ? '*' : ' ');
-            buffer[j + 1] = channelColor[i];
-        } /* for */
-
-        lseek(cons, (i * (columns * 2)) + 4, SEEK_SET);
-        write(cons, buffer, columns * 2);
+            shownLevels[i] = levels[i];
+            channelColor[i] = TESTDEV_COLOR;   /* back to normal. */
+            testdev_drawRow(i, levels[i]);
+        } /* if */
     } /* for */
 
+    testdev_flush();
+    return(0);
+} /* testdev_sendChanges */
+
+
+static void testdev_updateDevice(unsigned char *levels)
+{
+    testdev_sendChanges(levels, NULL);
 } /* testdev_updateDevice */
 
 
@@ -70,7 +141,7 @@ static int testdev_queryExistence(void)
 
 static int testdev_queryDevice(struct DimmerDeviceInfo *info)
 {
-    printf("dev_test::query.\n");
+    TRACE(TRACE_DEVICE_CALL, TRACE_CALL_QUERY_DEVICE, 0);
     memcpy(info, &devInfo, sizeof (struct DimmerDeviceInfo));
     return(0);
 } /* testdev_queryDevice */
@@ -127,10 +198,37 @@ static int setupConsole(char *tty)
 } /* setupConsole */
 
 
+static void testdev_forgetScreen(void)
+{
+    int i;
+
+        /* duplexed, there are three times as many rows. */
+    for (i = 0; i < devInfo.numChannels; i++)
+    {
+        channelColor[i] = TESTDEV_COLOR;
+        shownLevels[i] = -1;   /* draw everything on the next frame. */
+    } /* for */
+
+    dirtyFirst = dirtyLast = -1;
+} /* testdev_forgetScreen */
+
+
+static void testdev_freeScreen(void)
+{
+    free(screen);
+    free(shownLevels);
+    free(channelColor);
+    screen = NULL;
+    shownLevels = NULL;
+    channelColor = NULL;
+} /* testdev_freeScreen */
+
+
 static int testdev_initialize(void)
 {
     int retVal = -1;
     char *tty = ttyname(STDOUT_FILENO);
+    int rows;
 
     if (tty != NULL)
     {
@@ -142,14 +240,22 @@ static int testdev_initialize(void)
             devInfo.numOutputs = 3;
             devInfo.isDuplexed = 0;
 
-            channelColor = malloc(devInfo.numChannels);
-            if (channelColor == NULL)
+            rows = devInfo.numChannels * 3;   /* room to duplex. */
+            screen = malloc(rows * (columns * 2));
+            shownLevels = malloc(rows * sizeof (int));
+            channelColor = malloc(rows);
+            if ((screen == NULL) || (shownLevels == NULL) ||
+                (channelColor == NULL))
             {
+                testdev_freeScreen();
                 close(cons);
                 cons = -1;
             } /* if */
             else
+            {
+                testdev_forgetScreen();
                 retVal = 0;
+            } /* else */
         } /* if */
     } /* if */
 
@@ -160,18 +266,25 @@ static int testdev_initialize(void)
 static void testdev_deinitialize(void)
 {
     close(cons);
-    free(channelColor);
-    channelColor = NULL;
+    cons = -1;
+    testdev_freeScreen();
 } /* testdev_deinitialize */
 
 
 static int testdev_channelSet(int channel, int intensity)
+/*
+ * Show (intensity) on (channel) right away, highlighted, so a level
+ *  poked in behind the library's back stands out. It stays that way
+ *  until the library's own level for the channel changes.
+ */
 {
     int retVal = -1;
 
-    if (channel < devInfo.numChannels)
+    if ((channel >= 0) && (channel < devInfo.numChannels))
     {
-        channelColor[channel] = 7;   // !!! finish this.
+        channelColor[channel] = TESTDEV_HIGHLIGHT;
+        testdev_drawRow(channel, intensity);
+        testdev_flush();
         retVal = 0;
     } /* if */
 
@@ -191,6 +304,9 @@ static int testdev_setDuplexMode(__boolean shouldSet)
         devInfo.numChannels *= 3;
     } /* else */
 
+    if (screen != NULL)
+        testdev_forgetScreen();   /* the rows mean something else now. */
+
     return(0);
 } /* setDuplexMode */
 
@@ -207,7 +323,12 @@ struct DimmerDeviceFunctions testdev_funcs =   {
                                                     testdev_deinitialize,
                                                     testdev_channelSet,
                                                     testdev_setDuplexMode,
-                                                    testdev_updateDevice
+                                                    testdev_updateDevice,
+                                                    NULL,   /* updateUniverse */
+                                                    NULL,   /* sendFrame */
+                                                    NULL,   /* queryAsyncOutputs */
+                                                    testdev_sendChanges,
+                                                    NULL    /* setUniverseSlots */
                                                 };
 
 /* end of dev_testdev.c ... */
@@ -0,0 +1,613 @@
+/*
+ * The device process. See docs/overview.txt.
+ *
+ * This owns the real device modules, and keeps the dimmers fed whether
+ *  or not any application is attached. Control messages come in on the
+ *  request pipe, one at a time, and are answered on the response pipe.
+ *  Levels come in through shared memory: libdimmer publishes frames into
+ *  a FrameExchange there, and kicks a futex each time its frame clock
+ *  ticks; the output thread here wakes up and sends the newest frame.
+ *  If the kicks stop, the output thread keeps resending the last frame
+ *  at the device's refresh rate, so the lights stay up.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "boolean.h"
+#include "dimmer.h"
+#include "frame_exchange.h"
+#include "output_ring.h"
+#include "process_communication.h"
+#include "trace.h"
+
+#define DEFAULT_REFRESH_HZ  44
+
+    /* shared memory names to try before giving up; see createShared(). */
+#define SHARED_NAME_TRIES   8
+
+typedef long long nanotime_t;      /* CLOCK_MONOTONIC, in nanoseconds. */
+
+
+    /* dimmer device modules... */
+extern struct DimmerDeviceFunctions daddymax_funcs;
+extern struct DimmerDeviceFunctions capture_funcs;
+extern struct DimmerDeviceFunctions testdev_funcs;
+
+static struct DimmerDeviceFunctions *devFunctions[] = {
+                                                          &daddymax_funcs,
+                                                          &capture_funcs,
+                                                          &testdev_funcs
+                                                      };
+
+#define TOTAL_DEVICES  \
+            (sizeof (devFunctions) / sizeof (struct DimmerDeviceFunctions *))
+
+
+static int requestPipe = -1;
+static int responsePipe = -1;
+static volatile __boolean processLive = __true;
+static volatile sig_atomic_t dumpRequested = 0;
+
+    /*
+     * Everything below is only changed by the control thread, and only
+     *  while holding (deviceLock), which the output thread takes for each
+     *  frame it sends. Nobody else ever waits on it.
+     */
+static pthread_mutex_t deviceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct DimmerDeviceFunctions *activeModFuncs = NULL;
+static struct DimmerDeviceInfo devInfo;
+static struct PcShared *shared = NULL;
+static size_t sharedSize = 0;
+static char sharedName[PC_SHARED_NAME_MAX];
+static struct FrameExchange frames;
+static struct OutputRing outputRing;
+
+
+static inline nanotime_t monotonicNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((nanotime_t) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+} /* monotonicNow */
+
+
+static int readFully(void *buf, size_t len)
+{
+    unsigned char *ptr = (unsigned char *) buf;
+    ssize_t rc;
+
+    while (len > 0)
+    {
+        rc = read(requestPipe, ptr, len);
+        if ((rc == -1) && (errno == EINTR))
+            continue;
+        if (rc <= 0)
+            return(-1);
+
+        ptr += rc;
+        len -= rc;
+    } /* while */
+
+    return(0);
+} /* readFully */
+
+
+static void respond(pcmsg_t msg, const void *args, size_t argSize)
+/*
+ * Send a response and whatever follows it in one write(). If nobody's
+ *  reading, it sits in the pipe until the next client clears it out.
+ */
+{
+    unsigned char buf[sizeof (pcmsg_t) + sizeof (struct DimmerDeviceInfo) +
+                      PC_SHARED_NAME_MAX];
+
+    buf[0] = msg;
+    if (argSize > 0)
+        memcpy(buf + sizeof (pcmsg_t), args, argSize);
+    write(responsePipe, buf, sizeof (pcmsg_t) + argSize);
+} /* respond */
+
+
+static void freeShared(void)
+{
+    frameExchangeFree(&frames);
+    if (shared != NULL)
+        munmap(shared, sharedSize);
+    shared = NULL;
+    sharedSize = 0;
+
+    if (sharedName[0] != '\0')
+        shm_unlink(sharedName);
+    sharedName[0] = '\0';
+} /* freeShared */
+
+
+static int createShared(void)
+/*
+ * Make a fresh shared memory segment sized for the active device. Any
+ *  old one is unlinked first; a client still mapping it keeps the old
+ *  pages until it reattaches, and never sees a half-built segment. If
+ *  the usual name is taken by something we can't unlink, another name
+ *  is tried (see pcSharedName()).
+ */
+{
+    char name[PC_SHARED_NAME_MAX];
+    void *ptr;
+    int fd = -1;
+    int i;
+
+    freeShared();
+
+    sharedSize = pcSharedSize(devInfo.numUniverses * DIMMER_UNIVERSE_SIZE);
+    for (i = 0; (fd == -1) && (i < SHARED_NAME_TRIES); i++)
+    {
+        pcSharedName(name, sizeof (name), i);
+        if (i == 0)
+            shm_unlink(name);   /* left over from a crash, maybe. */
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if ((fd == -1) && (errno != EEXIST))
+            return(-1);
+    } /* for */
+
+    if (fd == -1)
+        return(-1);
+
+    if (ftruncate(fd, sharedSize) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        return(-1);
+    } /* if */
+
+    ptr = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return(-1);
+    } /* if */
+
+        /* ftruncate() zeroed it, so every frame starts dark. */
+    strcpy(sharedName, name);
+    shared = (struct PcShared *) ptr;
+    shared->frameSize = devInfo.numUniverses * DIMMER_UNIVERSE_SIZE;
+    shared->refreshHz = (devInfo.refreshHz > 0) ?
+                            devInfo.refreshHz : DEFAULT_REFRESH_HZ;
+    shared->daemonPid = getpid();
+    shared->state = 1;
+    shared->front = 0;
+    frameExchangeAttach(&frames, ((unsigned char *) ptr) + PC_FRAMES_OFFSET,
+                        shared->frameSize, &shared->state, &shared->front, 1);
+    __atomic_store_n(&shared->magic, PC_SHARED_MAGIC, __ATOMIC_RELEASE);
+    return(0);
+} /* createShared */
+
+
+static int queryActiveDevice(void)
+/*
+ * Refresh (devInfo) from the active module, filling in numChannels or
+ *  numUniverses the same way dimmer_query_device() does, since frames
+ *  are sized in whole universes.
+ */
+{
+    int universes;
+
+    if (activeModFuncs->queryDevice(&devInfo) == -1)
+        return(-1);
+
+    if (devInfo.numChannels <= 0)
+        devInfo.numChannels = devInfo.numUniverses * DIMMER_UNIVERSE_SIZE;
+
+    universes = (devInfo.numChannels + (DIMMER_UNIVERSE_SIZE - 1)) /
+                    DIMMER_UNIVERSE_SIZE;
+    if (universes < 1)
+        universes = 1;
+    if (devInfo.numUniverses < universes)
+        devInfo.numUniverses = universes;
+
+    return(0);
+} /* queryActiveDevice */
+
+
+static void startOutputRing(void)
+/*
+ * Write the device's outputs ourselves, asynchronously, if its module
+ *  lets us. See output_ring.h.
+ */
+{
+    struct DimmerAsyncOutput outputs[DIMMER_MAX_ASYNC_OUTPUTS];
+    int count = 0;
+    int i;
+
+    outputRingStop(&outputRing);
+    if (activeModFuncs->queryAsyncOutputs != NULL)
+        count = activeModFuncs->queryAsyncOutputs(outputs,
+                                                  DIMMER_MAX_ASYNC_OUTPUTS);
+
+    for (i = 0; i < count; i++)
+    {
+        if ((outputs[i].universe < 0) ||
+            (outputs[i].universe >= devInfo.numUniverses))
+            return;
+    } /* for */
+
+    if (count > 0)
+        outputRingStart(&outputRing, outputs, count);
+} /* startOutputRing */
+
+
+static void deinitDevice(void)
+{
+    outputRingStop(&outputRing);   /* before the module closes its ports. */
+    if (activeModFuncs != NULL)
+    {
+        activeModFuncs->deinitialize();
+        activeModFuncs = NULL;
+    } /* if */
+
+    freeShared();
+} /* deinitDevice */
+
+
+static int initDevice(int devID)
+{
+    if ((devID < 0) || (devID >= TOTAL_DEVICES))
+        return(-1);
+
+    deinitDevice();
+    if (devFunctions[devID]->initialize() == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        return(-1);
+    } /* if */
+
+    activeModFuncs = devFunctions[devID];
+    if ((queryActiveDevice() == -1) || (createShared() == -1))
+    {
+        deinitDevice();
+        return(-1);
+    } /* if */
+
+    startOutputRing();
+
+    return(0);
+} /* initDevice */
+
+
+static void *outputThreadEntry(void *args)
+/*
+ * Send the newest frame every time libdimmer kicks us. If it doesn't
+ *  kick within half a frame of when it should have, it's gone; carry on
+ *  at the device's own rate until it comes back.
+ *
+ *    params : args == always (NULL).
+ *   returns : Always (NULL). (terminates thread.)
+ */
+{
+    struct timespec deadline;
+    unsigned char *levels;
+    nanotime_t lastSent = monotonicNow();
+    nanotime_t period;
+    nanotime_t wake;
+    __boolean orphaned = __true;
+    struct PcShared *waitOn;
+    unsigned int kick;
+
+    while (processLive)
+    {
+        pthread_mutex_lock(&deviceLock);
+        if (shared == NULL)
+        {
+            pthread_mutex_unlock(&deviceLock);
+            usleep(1000000 / DEFAULT_REFRESH_HZ);   /* no device yet. */
+            continue;
+        } /* if */
+
+            /* clients can write (shared), so go by our own copy. */
+        period = 1000000000LL / ((devInfo.refreshHz > 0) ?
+                                    devInfo.refreshHz : DEFAULT_REFRESH_HZ);
+        waitOn = shared;
+        kick = __atomic_load_n(&waitOn->kick, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&deviceLock);
+
+        wake = lastSent + (orphaned ? period : period + (period / 2));
+        deadline.tv_sec = (time_t) (wake / 1000000000LL);
+        deadline.tv_nsec = (long) (wake % 1000000000LL);
+
+            /*
+             * (waitOn) was (shared) while we held the lock; the control
+             *  thread may unmap it while we wait. Only the kernel reads it
+             *  then, and it fails the wait with EFAULT instead of crashing
+             *  us; everything else goes through (shared), under the lock.
+             */
+        if (pcFutexWait(&waitOn->kick, kick, &deadline) == 0)
+            orphaned = __false;
+        else
+            orphaned = (errno == ETIMEDOUT) ? __true : orphaned;
+
+        pthread_mutex_lock(&deviceLock);
+        if ((activeModFuncs != NULL) && (shared != NULL))
+        {
+            levels = frameExchangeLatest(&frames);
+            if (outputRing.count > 0)
+                outputRingSubmit(&outputRing, levels);   /* never waits. */
+            else if (activeModFuncs->sendFrame == NULL)
+                activeModFuncs->updateDevice(levels);
+            else if (activeModFuncs->sendFrame(levels) == -1)
+                levels = NULL;   /* busy; the next wakeup tries again. */
+
+            if (levels == NULL)
+                TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_UPDATE);
+            else
+            {
+                shared->framesSent++;
+                TRACE(TRACE_FRAME_SENT, -1, frames.size);
+            } /* else */
+        } /* if */
+        pthread_mutex_unlock(&deviceLock);
+
+        lastSent = monotonicNow();
+
+        if (dumpRequested)
+        {
+            dumpRequested = 0;
+            traceDump(STDERR_FILENO);
+        } /* if */
+    } /* while */
+
+    return(NULL);
+} /* outputThreadEntry */
+
+
+static void handleSetChannel(void)
+{
+    int channel;
+    unsigned char level;
+
+    if ((readFully(&channel, sizeof (channel)) == -1) ||
+        (readFully(&level, sizeof (level)) == -1))
+        return;
+
+        /* poke it into the frame going out; the next one replaces it. */
+    pthread_mutex_lock(&deviceLock);
+    if ((shared != NULL) && (channel >= 0) &&
+        (channel < devInfo.numChannels))
+        frames.buffers[frames.front][channel] = level;
+    pthread_mutex_unlock(&deviceLock);
+} /* handleSetChannel */
+
+
+static void handleSetSlots(void)
+{
+    int universe;
+    int slots;
+
+    if ((readFully(&universe, sizeof (universe)) == -1) ||
+        (readFully(&slots, sizeof (slots)) == -1))
+        return;
+
+    pthread_mutex_lock(&deviceLock);
+    if ((activeModFuncs != NULL) && (universe >= 0) &&
+        (universe < devInfo.numUniverses))
+    {
+        if (outputRing.count > 0)
+            outputRingSetSlots(&outputRing, universe, slots);
+        if (activeModFuncs->setUniverseSlots != NULL)
+            activeModFuncs->setUniverseSlots(universe, slots);
+    } /* if */
+    pthread_mutex_unlock(&deviceLock);
+} /* handleSetSlots */
+
+
+static void handleMessage(pcmsg_t msg)
+{
+    pid_t pid;
+    __boolean duplex;
+    int devID;
+    int rc;
+
+    switch (msg)
+    {
+        case PCMSG_SET_CHANNEL:
+            handleSetChannel();   /* for speed, no response is given. */
+            break;
+
+        case PCMSG_SET_SLOTS:
+            handleSetSlots();     /* likewise. */
+            break;
+
+        case PCMSG_ARE_YOU_ALIVE:
+            pid = getpid();
+            respond(PCMSG_I_AM_ALIVE, &pid, sizeof (pid));
+            break;
+
+        case PCMSG_PLEASE_DIE:
+            respond(PCMSG_COMPLIANCE, NULL, 0);
+            processLive = __false;
+            break;
+
+        case PCMSG_QUERY_DEVICE:
+            pthread_mutex_lock(&deviceLock);
+            if (activeModFuncs == NULL)
+                respond(PCMSG_NON_COMPLIANCE, NULL, 0);
+            else
+                respond(PCMSG_COMPLIANCE, &devInfo, sizeof (devInfo));
+            pthread_mutex_unlock(&deviceLock);
+            break;
+
+        case PCMSG_DEVICE_EXISTS:
+            if (readFully(&devID, sizeof (devID)) == -1)
+                break;
+            rc = ((devID >= 0) && (devID < TOTAL_DEVICES) &&
+                  (devFunctions[devID]->queryExistence()));
+            respond(rc ? PCMSG_COMPLIANCE : PCMSG_NON_COMPLIANCE, NULL, 0);
+            break;
+
+        case PCMSG_INIT_DEVICE:
+            if (readFully(&devID, sizeof (devID)) == -1)
+                break;
+            pthread_mutex_lock(&deviceLock);
+            rc = initDevice(devID);
+            pthread_mutex_unlock(&deviceLock);
+            respond((rc == 0) ? PCMSG_COMPLIANCE : PCMSG_NON_COMPLIANCE,
+                    NULL, 0);
+            break;
+
+        case PCMSG_DEINIT_DEVICE:
+            pthread_mutex_lock(&deviceLock);
+            deinitDevice();
+            pthread_mutex_unlock(&deviceLock);
+            respond(PCMSG_COMPLIANCE, NULL, 0);
+            break;
+
+        case PCMSG_SET_DUPLEX:
+            if (readFully(&duplex, sizeof (duplex)) == -1)
+                break;
+            pthread_mutex_lock(&deviceLock);
+            rc = -1;
+            if ((activeModFuncs != NULL) &&
+                (activeModFuncs->setDuplexMode(duplex) != -1) &&
+                (queryActiveDevice() != -1))
+            {
+                rc = createShared();   /* the frame size changed. */
+                startOutputRing();
+            } /* if */
+            pthread_mutex_unlock(&deviceLock);
+            respond((rc == 0) ? PCMSG_COMPLIANCE : PCMSG_NON_COMPLIANCE,
+                    NULL, 0);
+            break;
+
+        case PCMSG_QUERY_SHARED:
+            pthread_mutex_lock(&deviceLock);
+            if (shared == NULL)
+                respond(PCMSG_NON_COMPLIANCE, NULL, 0);
+            else
+                respond(PCMSG_COMPLIANCE, sharedName, sizeof (sharedName));
+            pthread_mutex_unlock(&deviceLock);
+            break;
+
+        case PCMSG_QUERY_DEVMODS:
+            devID = TOTAL_DEVICES;
+            respond(PCMSG_COMPLIANCE, &devID, sizeof (devID));
+            break;
+
+        default:
+            respond(PCMSG_UNKNOWN_MSG, NULL, 0);
+            break;
+    } /* switch */
+} /* handleMessage */
+
+
+static int setupPipes(void)
+/*
+ * Make the rendezvous directory and named pipes, if they aren't there,
+ *  and open both pipes read/write, so neither open() blocks and neither
+ *  pipe ever sees end-of-file as clients come and go.
+ */
+{
+    char path[128];
+
+    if (pcCheckDir(__true) == -1)
+        return(-1);
+
+    pcPath(path, sizeof (path), PC_REQUEST_PIPE);
+    if ((mkfifo(path, 0600) == -1) && (errno != EEXIST))
+        return(-1);
+    requestPipe = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+
+    pcPath(path, sizeof (path), PC_RESPONSE_PIPE);
+    if ((mkfifo(path, 0600) == -1) && (errno != EEXIST))
+        return(-1);
+    responsePipe = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+
+    return(((requestPipe == -1) || (responsePipe == -1)) ? -1 : 0);
+} /* setupPipes */
+
+
+static int lockOut(void)
+/*
+ * Only one device process per user. Whoever holds the lock file is it;
+ *  the lock goes away with the process, however it dies.
+ */
+{
+    char path[128];
+    int fd;
+
+    if (pcCheckDir(__true) == -1)
+        return(-1);
+
+    pcPath(path, sizeof (path), PC_LOCK_FILE);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd == -1)
+        return(-1);
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        close(fd);
+        return(-1);
+    } /* if */
+
+    return(fd);   /* leave it open for the life of the process. */
+} /* lockOut */
+
+
+static void dumpSignal(int sig)
+{
+    dumpRequested = 1;   /* the output thread does the actual work. */
+} /* dumpSignal */
+
+
+int main(int argc, char **argv)
+{
+    pthread_t outputThread;
+    pcmsg_t msg;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, dumpSignal);   /* "kill -USR1" dumps the trace. */
+
+    if (lockOut() == -1)
+    {
+        fprintf(stderr, "%s: another device process is running.\n", argv[0]);
+        return(1);
+    } /* if */
+
+    if (setupPipes() == -1)
+    {
+        fprintf(stderr, "%s: can't set up pipes: %s\n", argv[0],
+                strerror(errno));
+        return(1);
+    } /* if */
+
+    memset(&frames, '\0', sizeof (frames));
+    if (pthread_create(&outputThread, NULL, outputThreadEntry, NULL) != 0)
+        return(1);
+
+    while ((processLive) && (readFully(&msg, sizeof (msg)) == 0))
+        handleMessage(msg);
+
+    processLive = __false;
+    pthread_join(outputThread, NULL);
+
+    pthread_mutex_lock(&deviceLock);
+    deinitDevice();
+    pthread_mutex_unlock(&deviceLock);
+
+    return(0);
+} /* main */
+
+/* end of device_process.c ... */
+
@@ -5,39 +5,174 @@
  *    Written by Ryan C. Gordon.
  */
 
+#define _GNU_SOURCE     /* for pthread_setaffinity_np(). */
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include "boolean.h"
 #include "dimmer.h"
+#include "fade_kernel.h"
+#include "cook_kernel.h"
+#include "frame_exchange.h"
+#include "work_pool.h"
+#include "output_ring.h"
+#include "command_queue.h"
+#include "process_communication.h"
+#include "trace.h"
 
 //define sched_yield() sleep(0)
 
 
     /* dimmer device modules... */
 extern struct DimmerDeviceFunctions daddymax_funcs;
+extern struct DimmerDeviceFunctions capture_funcs;
 extern struct DimmerDeviceFunctions testdev_funcs;
 
 
 
+    /*
+     * Frames go out to the device this often, and running fades are
+     *  evaluated at the same rate, unless the device module or the
+     *  application asks for something else.
+     */
+#define DEFAULT_REFRESH_HZ  44
+
+typedef long long nanotime_t;      /* CLOCK_MONOTONIC, in nanoseconds. */
+
+    /* a device that turns a frame away is offered one again this soon. */
+#define BUSY_RETRIES_PER_FRAME  8
+
+    /* level buffers start on a cache line; so does every universe in them. */
+#define LEVEL_ALIGN  64
+
+    /*
+     * Jobs smaller than these aren't worth splitting across the helper
+     *  threads; each chunk of a split job is this big, too.
+     */
+#define PARALLEL_FADES     4096
+#define PARALLEL_CHANNELS  (DIMMER_UNIVERSE_SIZE * 8)
+
+
 struct ChannelFadeStatus
 {
     __boolean fadeActive;               /* are we fading this one?          */
     unsigned int channel;               /* channel number to fade.          */
     unsigned char destinationLevel;     /* What level should it end at?     */
-    struct timeval nextFadeTime;        /* time after epoch for next fade.  */
-    struct timeval fadeTimeIncrement;   /* Amount of time between fades.    */
-    int levelChangeRate;                /* Amount to fade with each update. */
-    struct ChannelFadeStatus *next;     /* Next struct in linked list.      */
+    unsigned char curve;                /* DIMMER_FADE_* shape.             */
+    nanotime_t startTime;               /* when the level starts moving.    */
+    nanotime_t duration;                /* nanoseconds from start to end.   */
+    int heapIndex;                      /* slot in fadeHeap, -1 if absent.  */
+    int activeIndex;                    /* slot in fadeArrays, -1 if not.   */
 };
 
 
 static __boolean dimmerLibInitialized = __false;
 
+struct Submaster
+{
+    int firstChannel;           /* patched channel that levels[0] drives. */
+    int channelCount;           /* size of (levels). Zero if unrecorded.  */
+    unsigned char *levels;      /* recorded look; zero if not in the sub. */
+    unsigned char master;       /* the sub's fader, 0-255.                */
+};
+
+
+    /*
+     * When the device module can send each universe on its own, every
+     *  universe gets a thread of its own to do it, so one slow output
+     *  port can't hold up the rest. The device thread still keeps time:
+     *  each frame, it hands every worker a copy of its universe through
+     *  the worker's own frame exchange and posts (ready). A worker that
+     *  falls behind just sends the newest frame when it catches up.
+     */
+struct OutputWorker
+{
+    pthread_t thread;
+    int universe;
+    int stopping;                   /* set by stopOutputWorkers().     */
+    sem_t ready;
+    struct FrameExchange frame;     /* one universe's worth. */
+};
+
+
+    /*
+     * Which dimmers each channel drives, compiled into one block: channel
+     *  (c) drives dimmers[first[c]] through dimmers[first[c + 1] - 1],
+     *  each at proportions[] / 255 of the channel's level. A map never
+     *  changes once it's published; repatching builds a new one and
+     *  swaps it in. See publishPatchMap().
+     */
+struct PatchMap
+{
+    unsigned long long epoch;     /* one more than the map it replaced.     */
+    int numChannels;
+    int numPatches;
+    int *first;                   /* (numChannels + 1) offsets.             */
+    int *dimmers;                 /* (numPatches) patched channels.         */
+    unsigned char *proportions;   /* (numPatches) levels; 255 is all of it. */
+    struct PatchMap *nextRetired;
+};
+
+
+struct LevelSource
+{
+    __boolean inUse;              /* slot allocated?                        */
+    char name[32];                /* caller's name for it.                  */
+    unsigned char *levels;        /* this source's level for each channel.  */
+    unsigned long long *stamps;   /* mergeClock at each channel's last set. */
+};
+
+
+    /*
+     * Every buffer whose size depends on the channel layout. A resize
+     *  builds a whole new set of these off to the side, then trades it
+     *  for the set in use with swapChannelBuffers(); after that, it holds
+     *  the old set until it's freed.
+     */
+struct ChannelBuffers
+{
+    int levelStride;
+    unsigned char *rawLevels;
+    unsigned char *cookedLevels;
+    unsigned char *subMix;
+    unsigned char *mergeModes;
+    unsigned char *dimmerCurves;
+    unsigned char *sourceLevels[DIMMER_MAX_SOURCES];
+    unsigned long long *sourceStamps[DIMMER_MAX_SOURCES];
+    struct ChannelFadeStatus *fadeTable;
+    struct ChannelFadeStatus **fadeHeap;
+    int fadeHeapSize;
+    struct FadeArrays fadeArrays;   /* one block; see allocFadeArrays(). */
+    int activeFadeCount;
+    unsigned char *changeMaps;      /* one block; see useChangeMaps().   */
+    int *universeSlots;
+    struct FrameExchange frames;
+};
+
+
+    /* a new set of channel buffers, and everything else a resize needs. */
+struct ChannelLayout
+{
+    struct ChannelBuffers set;
+    struct PatchMap *map;
+    unsigned long long patchEpoch;   /* of the map (map) was made from. */
+    struct DimmerDeviceFunctions *funcs;
+    struct DimmerDeviceInfo info;
+};
+
+
 static struct DimmerSystemInfo sysInfo = {0, NULL, -1};
 static struct DimmerDeviceInfo devInfo;
 
@@ -45,11 +180,209 @@ static volatile __boolean threadLiveFlag = __false;
 static pthread_t fadeThread;
 static pthread_t deviceThread;
 static pthread_mutex_t fadeLock;
-static struct ChannelFadeStatus *fadeList = NULL;
 
+    /*
+     * A resize swaps out buffers that the device thread and the output
+     *  workers read without taking fadeLock, so output is paused for it
+     *  instead (see pauseOutput()). Pausing makes (outputGeneration) odd,
+     *  and waits for the device thread to notice between two frames and
+     *  answer by copying it into (deviceGeneration); the device thread
+     *  then waits for (outputGeneration) to move on, and carries on with
+     *  the new buffers from its very next deadline. Nothing else stops.
+     */
+static unsigned int outputGeneration = 0;
+static unsigned int deviceGeneration = 0;
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outputMoved = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t pauseLock = PTHREAD_MUTEX_INITIALIZER;
+static __boolean outputPaused = __false;
+
+    /*
+     * Fade state lives in (fadeTable), one entry per patched channel, sized
+     *  along with the level buffers. Fades still sitting out their delay
+     *  wait in (fadeHeap), a binary min-heap ordered by startTime; once
+     *  they start moving they go into (fadeArrays), compact parallel arrays
+     *  that (fadeKernel) evaluates in one pass per frame, against a single
+     *  clock reading. Neither ever needs more than one slot per channel,
+     *  so both are allocated up front. The fade thread sleeps in poll()
+     *  until the timerfd (armed for the next frame or delayed start) fires,
+     *  or until someone writes to the eventfd to tell it something changed.
+     */
+static struct ChannelFadeStatus *fadeTable = NULL;
+static struct ChannelFadeStatus **fadeHeap = NULL;
+static int fadeHeapSize = 0;
+static struct FadeArrays fadeArrays;
+static unsigned char *fadeLevels = NULL;    /* kernel output, per slot.    */
+static unsigned char *fadeDone = NULL;      /* kernel output, per slot.    */
+static int activeFadeCount = 0;
+static FadeKernel fadeKernel = fadeKernelScalar;
+static nanotime_t fadeEpoch = 0;            /* fade tick zero.             */
+static nanotime_t fadeFrameTime = 1000000000LL / DEFAULT_REFRESH_HZ;
+static int fadeTimer = -1;
+static int fadeWakeup = -1;
+
+    /*
+     * Every source (the application's own levels and fades are source 0)
+     *  has its own level buffer. They're merged per channel into
+     *  (rawLevels): HTP channels take the highest level of any source,
+     *  LTP channels take whichever source set them most recently, going
+     *  by (mergeClock) stamps. Only channels a source actually changes
+     *  are remerged.
+     *
+     * Levels are then "cooked" on their way from (rawLevels) to (cookedLevels):
+     *  every submaster's recorded look, scaled by its fader, is mixed into
+     *  (subMix) highest-takes-precedence; the higher of that and the raw
+     *  level is then scaled by the grand master. Everything is recooked
+     *  only over the channels a change actually touches.
+     */
+    /*
+     * All level buffers hold (levelStride) bytes: a whole number of
+     *  DIMMER_UNIVERSE_SIZE universes, back to back, so channel
+     *  (universe * DIMMER_UNIVERSE_SIZE + slot) is that universe's slot,
+     *  and every universe starts on its own cache line. Slots past
+     *  devInfo.numChannels are padding, and stay dark.
+     */
+static int levelStride = 0;
 static unsigned char *rawLevels = NULL;
 static unsigned char *cookedLevels = NULL;
-static int *patchTable = NULL;
+static unsigned char *subMix = NULL;
+
+    /*
+     * (patchMap) is only ever read under fadeLock, and never kept past
+     *  it, so a map that's been swapped out can be freed as soon as
+     *  somebody else takes the lock; until then it waits on
+     *  (retiredMaps). Whoever builds a new map holds (patchLock), which
+     *  nothing else takes: repatching never stops the fade thread.
+     */
+static struct PatchMap *patchMap = NULL;
+static struct PatchMap *retiredMaps = NULL;
+static unsigned long long adoptedEpoch = 0;
+static pthread_mutex_t patchLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Submaster submasters[DIMMER_MAX_SUBMASTERS];
+static struct LevelSource sources[DIMMER_MAX_SOURCES];
+static unsigned char *mergeModes = NULL;
+static int ltpChannelCount = 0;
+static unsigned long long mergeClock = 0;
+
+    /*
+     * Dimmer curves are the last step of cooking: each patched channel's
+     *  level is looked up in the 256-entry table (dimmerCurves) names
+     *  for it, so giving a channel a curve is just changing a byte. The
+     *  first BUILTIN_CURVES tables are filled in by dimmer_init(), and
+     *  dimmer_curve_create() adds more; a table never changes once it's
+     *  made. The last three bytes are for applyCurves(), which may read
+     *  that far. (curvedChannelCount) is how many patched channels aren't
+     *  linear; while there are none, cooking skips the lookups.
+     */
+#define BUILTIN_CURVES  (DIMMER_CURVE_LED + 1)
+static unsigned char curveTables[(DIMMER_MAX_CURVES * 256) + 3]
+                                                __attribute__((aligned(64)));
+static int curveCount = 0;
+static unsigned char *dimmerCurves = NULL;
+static int curvedChannelCount = 0;
+static const struct CookKernels *cookKernels = &cookKernelsScalar;
+
+    /*
+     * The device thread sends a frame at every multiple of
+     *  (deviceFrameTime), sleeping on absolute deadlines so one late frame
+     *  doesn't push back every frame after it. How far apart the frames
+     *  actually went out is tallied in (frameTiming).
+     */
+static volatile nanotime_t deviceFrameTime = 1000000000LL / DEFAULT_REFRESH_HZ;
+static int refreshHz = DEFAULT_REFRESH_HZ;
+static int rtPriority = 0;                  /* 0 == not SCHED_FIFO.        */
+static int rtCPU = -1;                      /* -1 == any CPU.              */
+static __boolean memoryLocked = __false;
+static pthread_mutex_t timingLock = PTHREAD_MUTEX_INITIALIZER;
+static struct DimmerFrameTiming frameTiming;
+
+    /*
+     * Running totals for dimmer_query_stats(), in one block per writer:
+     *  the fade thread, the device thread, and whoever holds fadeLock.
+     *  With only one thread ever writing each, counting is a plain
+     *  relaxed store, never a locked add, and readers just take relaxed
+     *  loads; nobody waits on anybody. Each block gets its own cache line
+     *  so the writers don't trip over one another.
+     */
+#define STATS_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STATS_MAX(field, n) \
+    __atomic_store_n(&(field), ((n) > (field)) ? (n) : (field), __ATOMIC_RELAXED)
+#define STATS_READ(field)  __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static struct
+{
+    unsigned long long passes;
+    long long lastPass;
+    long long totalPass;
+    long long maxPass;
+    int activeFades;        /* activeFadeCount, as of the last pass. */
+    int delayedFades;       /* fadeHeapSize, likewise.               */
+} fadeStats __attribute__((aligned(64)));
+
+static struct
+{
+    unsigned long long acquires;
+    unsigned long long contended;
+    long long totalWait;
+    long long maxWait;
+} lockStats __attribute__((aligned(64)));
+
+static struct
+{
+    unsigned long long framesSent;
+    unsigned long long errors;      /* and those of output rings now gone. */
+} deviceStats __attribute__((aligned(64)));
+
+    /*
+     * How much of each universe is worth sending: up to the last slot
+     *  that was ever lit or patched to, but at least
+     *  DIMMER_MIN_UNIVERSE_SLOTS. Only ever grows, until the next resize;
+     *  every time one does, (slotsChanged) is bumped, and the device
+     *  thread passes the news on before its next frame. If the device
+     *  says how long a universe takes to send, the frame clock runs at
+     *  (effectiveHz), as fast as (longestUniverse) allows, unless the
+     *  application picked a rate itself (refreshPinned).
+     */
+static int *universeSlots = NULL;
+static int longestUniverse = 0;
+static unsigned int slotsChanged = 0;
+static int effectiveHz = DEFAULT_REFRESH_HZ;
+static __boolean refreshPinned = __false;
+
+    /*
+     * (cookedLevels) is only ever touched by whoever is changing levels.
+     *  The device thread gets its levels through (frames) instead: when
+     *  cooked levels change, (frameDirty) is set and the fade thread is
+     *  woken, and the fade thread (the only producer) copies them into a
+     *  frame and publishes it. The device thread picks up the newest frame
+     *  each time it sends one, without locking anything. While
+     *  (frameHolds) is nonzero, changes pile up unpublished, so a batch
+     *  of them goes out in one frame; see holdFrame(). It's only touched
+     *  under fadeLock.
+     */
+static struct FrameExchange frames;
+static int frameDirty = 0;
+static int frameHolds = 0;
+
+    /*
+     * Which channels changed, one bit per channel, for device modules
+     *  that only send what changed. Whoever changes a cooked level marks
+     *  it in (pendingChanges), under fadeLock. publishFrame() hands the
+     *  marks over in (frameChanges), one map beside each of the three
+     *  frames, along with (carriedChanges): those of earlier frames the
+     *  device thread might not have seen. The device thread collects them
+     *  in (unsentChanges) until the module accepts a frame.
+     */
+static unsigned char *changeMaps = NULL;    /* one block for all six. */
+static unsigned char *frameChanges[3];
+static unsigned char *pendingChanges = NULL;
+static unsigned char *carriedChanges = NULL;
+static unsigned char *unsentChanges = NULL;
+static int changeMapSize = 0;
+static struct OutputWorker *outputWorkers = NULL;
+static int outputWorkerCount = 0;
+static struct OutputRing outputRing;   /* if the module lets us write. */
 
 static unsigned char grandMasterLevel = 255;
 static __boolean blackOutEnabled = __false;
@@ -61,7 +394,9 @@ static __boolean duplexEnabled = __false;
      */
 static struct DimmerDeviceFunctions *activeModFuncs = NULL;
 static struct DimmerDeviceFunctions *devFunctions[] = {
+                                                          &daemon_funcs,
                                                           &daddymax_funcs,
+                                                          &capture_funcs,
                                                           &testdev_funcs
                                                       };
 
@@ -69,825 +404,4437 @@ static struct DimmerDeviceFunctions *devFunctions[] = {
             (sizeof (devFunctions) / sizeof (struct DimmerDeviceFunctions *))
 
 
-static void *deviceThreadEntry(void *args)
-/*
- * Check for new "events" endlessly.
- *
- *    params : args == always (NULL).
- *   returns : Always (NULL). (terminates thread.)
- */
+static inline __boolean usingDaemon(void)
 {
-    while (threadLiveFlag)      /* endless loop. */
+    return((activeModFuncs == &daemon_funcs) ? __true : __false);
+} /* usingDaemon */
+
+
+static inline nanotime_t monotonicNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((nanotime_t) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+} /* monotonicNow */
+
+
+static inline void heapSwap(int a, int b)
+{
+    struct ChannelFadeStatus *tmp = fadeHeap[a];
+    fadeHeap[a] = fadeHeap[b];
+    fadeHeap[b] = tmp;
+    fadeHeap[a]->heapIndex = a;
+    fadeHeap[b]->heapIndex = b;
+} /* heapSwap */
+
+
+static void heapSiftUp(int i)
+{
+    int parent;
+
+    while (i > 0)
     {
-        if ((activeModFuncs != NULL) && (cookedLevels != NULL))
-            activeModFuncs->updateDevice(cookedLevels);
-        sched_yield();
+        parent = (i - 1) / 2;
+        if (fadeHeap[i]->startTime >= fadeHeap[parent]->startTime)
+            break;
+
+        heapSwap(i, parent);
+        i = parent;
     } /* while */
+} /* heapSiftUp */
 
-    return(NULL);
-} /* deviceThreadEntry */
+
+static void heapSiftDown(int i)
+{
+    int child;
+
+    while ((child = (i * 2) + 1) < fadeHeapSize)
+    {
+        if ((child + 1 < fadeHeapSize) &&
+            (fadeHeap[child + 1]->startTime < fadeHeap[child]->startTime))
+            child++;   /* right child is sooner. */
+
+        if (fadeHeap[i]->startTime <= fadeHeap[child]->startTime)
+            break;
+
+        heapSwap(i, child);
+        i = child;
+    } /* while */
+} /* heapSiftDown */
 
 
-static inline __boolean isPastTime(struct timeval *t1, struct timeval *t2)
+static void heapInsert(struct ChannelFadeStatus *fadePtr)
 /*
- * Determine if (t1) is past the time recorded in (t2).
+ * Add a fade to fadeHeap. Caller must hold fadeLock. The heap has room
+ *  for every channel, so this can't fail.
  *
- *     params : t1, t2 == times to compare.
- *    returns : __true if (t1) is greater than or EQUAL to (t2).
- *              __false otherwise.
+ *    params : fadePtr == fade to schedule. Must not already be in the heap.
+ *   returns : void.
  */
 {
-        /* check the seconds first, and if equals, check microseconds... */
-    if (t1->tv_sec > t2->tv_sec)
-        return(__true);
-    else if (t1->tv_sec < t2->tv_sec)
-        return(__false);
-    else /* equal */
-        return((t1->tv_usec >= t2->tv_usec) ? __true : __false);
-} /* isPastTime */
-
-
-static void addTimevalStructs(struct timeval *toThis, struct timeval *addThis)
-{
-        // !!! how efficient is this?
-    toThis->tv_sec += addThis->tv_sec;
-    toThis->tv_usec += addThis->tv_usec;
-    toThis->tv_sec += (long) (toThis->tv_usec / 1000000L);
-    toThis->tv_usec = (long) (toThis->tv_usec % 1000000L);
-} /* addTimevalStructs */
+    fadePtr->heapIndex = fadeHeapSize;
+    fadeHeap[fadeHeapSize++] = fadePtr;
+    heapSiftUp(fadePtr->heapIndex);
+} /* heapInsert */
 
 
-static inline void updateChannelFade(struct ChannelFadeStatus *list)
+static void heapRemove(struct ChannelFadeStatus *fadePtr)
 /*
- * Update a ChannelFadeStatus structure. Make actual changes to dimmers.
+ * Pull a fade out of fadeHeap. Caller must hold fadeLock.
  *
- *    params : list == struct to update.
+ *    params : fadePtr == fade to unschedule. Must be in the heap.
  *   returns : void.
  */
 {
-    int change = rawLevels[list->channel] + list->levelChangeRate;
+    int i = fadePtr->heapIndex;
 
-    addTimevalStructs(&list->nextFadeTime, &list->fadeTimeIncrement);
-
-        /* Make sure we don't go past destination level... */
-    if (list->levelChangeRate < 0)            /* lights are dimming? */
+    fadePtr->heapIndex = -1;
+    fadeHeapSize--;
+    if (i != fadeHeapSize)
     {
-        if (change < list->destinationLevel)
-            change = list->destinationLevel;
+        fadeHeap[i] = fadeHeap[fadeHeapSize];
+        fadeHeap[i]->heapIndex = i;
+        heapSiftUp(i);
+        heapSiftDown(fadeHeap[i]->heapIndex);
     } /* if */
-    else                                      /* lights are brightening? */
-    {
-        if (change > list->destinationLevel)
-            change = list->destinationLevel;
-    } /* else */
+} /* heapRemove */
 
-    if (change == list->destinationLevel)        /* done with this one? */
-        list->fadeActive = __false;
 
-    dimmer_channel_set(list->channel, (unsigned char) change); /* do update. */
-} /* updateChannelFade */
+static inline int fadeTicks(nanotime_t t)
+/*
+ * Convert a CLOCK_MONOTONIC time to the millisecond "fade ticks" that
+ *  fadeArrays uses. This wraps every ~49 days; the kernels only care
+ *  about differences, so that's fine.
+ */
+{
+    return((int) (unsigned int) ((t - fadeEpoch) / 1000000LL));
+} /* fadeTicks */
 
 
-static inline __boolean runFadeList(void)
+static void activeInsert(struct ChannelFadeStatus *fadePtr, int startLevel)
 /*
- * Run through the entire pending list of fades once.
+ * Add a fade to the end of fadeArrays. Caller must hold fadeLock.
  *
- *    params : list == list to run through.
- *   returns : 0 if there were no fades. 1 if there was at least one.
+ *    params : fadePtr    == fade to start running.
+ *             startLevel == level the fade moves away from.
+ *   returns : void.
  */
 {
-    __boolean retVal = __false;
-    struct timeval currentTime;
-    struct ChannelFadeStatus *list;
+    int i = activeFadeCount++;
+    nanotime_t ticks = (fadePtr->duration + 500000LL) / 1000000LL;
 
-    for (list = fadeList; list != NULL; list = list->next)
-    {
-        if (list->fadeActive == __true)
-        {
-            gettimeofday(&currentTime, NULL);
-            if (isPastTime(&currentTime, &list->nextFadeTime))
-            {
-                updateChannelFade(list);
-                retVal = __true;
-            } /* if */
-        } /* if */
-    } /* for */
+    if (ticks > 0x3FFFFFFF)    /* ~12 days. Keep differences signed. */
+        ticks = 0x3FFFFFFF;
 
-    return(retVal);
-} /* runFadeList */
+    fadePtr->activeIndex = i;
+    fadeArrays.channel[i] = fadePtr->channel;
+    fadeArrays.startLevel[i] = startLevel;
+    fadeArrays.endLevel[i] = fadePtr->destinationLevel;
+    fadeArrays.startTime[i] = fadeTicks(fadePtr->startTime);
+    fadeArrays.duration[i] = (int) ticks;
+    fadeArrays.invDuration[i] = fadeInverseDuration((int) ticks);
+    fadeArrays.curve[i] = fadePtr->curve;
+} /* activeInsert */
 
 
-static void *fadeThreadEntry(void *args)
+static void activeRemove(struct ChannelFadeStatus *fadePtr)
 /*
- * Entry point for fadeThread.
+ * Pull a fade out of fadeArrays, moving the last one into its slot.
+ *  Caller must hold fadeLock.
  *
- *    params : args == always (NULL).
- *   returns : Always (NULL). (terminates thread.)
+ *    params : fadePtr == fade to stop. Must be running.
+ *   returns : void.
  */
 {
-    __boolean atLeastOneFade = __false;
+    int i = fadePtr->activeIndex;
+    int last = --activeFadeCount;
 
-    while (threadLiveFlag == __true)  /* live until dimmer_deinit()... */
+    fadePtr->activeIndex = -1;
+    if (i != last)
     {
-        if (pthread_mutex_lock(&fadeLock) == 0)
-        {
-            atLeastOneFade = runFadeList();
-            pthread_mutex_unlock(&fadeLock);
-        } /* if */
-
-//        if (atLeastOneFade == __false)  /* Only hog CPU when active fades. */
-        sched_yield();
-    } /* while */
-
-    return(NULL);
-} /* fadeThreadEntry */
+        fadeArrays.channel[i] = fadeArrays.channel[last];
+        fadeArrays.startLevel[i] = fadeArrays.startLevel[last];
+        fadeArrays.endLevel[i] = fadeArrays.endLevel[last];
+        fadeArrays.startTime[i] = fadeArrays.startTime[last];
+        fadeArrays.duration[i] = fadeArrays.duration[last];
+        fadeArrays.invDuration[i] = fadeArrays.invDuration[last];
+        fadeArrays.curve[i] = fadeArrays.curve[last];
+        fadeTable[fadeArrays.channel[i]].activeIndex = i;
+    } /* if */
+} /* activeRemove */
 
 
-static int spinJoinableThread(pthread_t *thread, void *(*entry)(void *))
+static int allocFadeArrays(struct FadeArrays *fades, int chan)
 /*
- * Use this to spin separate, joinable threads.
+ * Allocate (fades) for (chan) channels, with room after them for the
+ *  kernel's output, all in one block starting at fades->channel. See
+ *  useFadeArrays().
  *
- *   params : thread == where to store thread handle.
- *            entry  == entry point for thread.
- *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    params : fades == arrays to set up.
+ *             chan  == number of channels.
+ *   returns : -1 if out of memory, 0 on success.
  */
 {
-    int retVal = -1;
-    pthread_attr_t attrs;
+    size_t n = (size_t) chan;
+    unsigned char *block;
 
-    pthread_attr_init(&attrs);
-    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
-    retVal = pthread_create(thread, &attrs, entry, NULL);
-    pthread_attr_destroy(&attrs);
+        /* six int-sized arrays, then three byte arrays. */
+    block = malloc((n * sizeof (int) * 6) + (n * 3));
+    if (block == NULL)
+        return(-1);
 
-    return(retVal);
-} /* spinJoinableThread */
+    fades->channel = (int *) block;
+    fades->startLevel = fades->channel + n;
+    fades->endLevel = fades->startLevel + n;
+    fades->startTime = fades->endLevel + n;
+    fades->duration = fades->startTime + n;
+    fades->invDuration = (unsigned int *) (fades->duration + n);
+    fades->curve = (unsigned char *) (fades->invDuration + n);
+    return(0);
+} /* allocFadeArrays */
 
 
-static int spinThreads(void)
+static void useFadeArrays(int chan)
+/*
+ * Find the kernel's output buffers, (fadeLevels) and (fadeDone), after
+ *  the arrays in (fadeArrays), which are sized for (chan) channels.
+ */
 {
-    int retVal = -1;
-
-    pthread_mutex_init(&fadeLock, NULL);
-
-    if (threadLiveFlag == __false)
+    if (fadeArrays.curve == NULL)
+        fadeLevels = fadeDone = NULL;
+    else
     {
-        threadLiveFlag = __true;
+        fadeLevels = fadeArrays.curve + chan;
+        fadeDone = fadeLevels + chan;
+    } /* else */
+} /* useFadeArrays */
 
-        if (spinJoinableThread(&fadeThread, fadeThreadEntry) != -1)
-        {
-            if (spinJoinableThread(&deviceThread, deviceThreadEntry) != -1)
-                retVal = 0;
 
-            else    /* no device thread? Kill off the first thread, too. */
-            {
-                threadLiveFlag = __false;
-                pthread_join(fadeThread, NULL);
-            } /* else */
-        } /* if */
+static void armFadeTimer(nanotime_t when)
+/*
+ * Program the fade timer for an absolute CLOCK_MONOTONIC time, or
+ *  disarm it.
+ *
+ *    params : when == time to fire, or zero to disarm.
+ *   returns : void.
+ */
+{
+    struct itimerspec spec;
+
+    memset(&spec, '\0', sizeof (spec));
+    if (when > 0)
+    {
+        spec.it_value.tv_sec = (time_t) (when / 1000000000LL);
+        spec.it_value.tv_nsec = (long) (when % 1000000000LL);
     } /* if */
 
-    return(retVal);
-} /* spinThreads */
+    timerfd_settime(fadeTimer, TFD_TIMER_ABSTIME, &spec, NULL);
+} /* armFadeTimer */
 
 
-static void killThreads(void)
+static inline void wakeFadeThread(void)
 {
-    if (threadLiveFlag == __true)
-    {
-        threadLiveFlag = __false;
-        pthread_join(fadeThread, NULL);
-        pthread_join(deviceThread, NULL);
-        pthread_mutex_destroy(&fadeLock);
-    } /* if */
-} /* killThreads */
+    uint64_t one = 1;
+    write(fadeWakeup, &one, sizeof (one));
+} /* wakeFadeThread */
 
 
-static int checkForDevices(void)
+static void lockTaken(void);
+
+static inline int lockFades(void)
 /*
- * Internal function called from dimmer_init(): Check to see which
- *  of supported devices exist. Fill them into (sysInfo).
- *
- *     params : void.
- *    returns : total found devices. (-1) on error.
+ * Take fadeLock, and count (and trace) how long we waited if somebody
+ *  else had it. The uncontended case costs no more than a plain lock;
+ *  (lockStats) is only written once we hold it. Then lockTaken() brings
+ *  us up to date, so whoever holds the lock sees every level set and
+ *  every patch made before they took it.
  */
 {
-    int retVal = 0;
-    int devID;
-    int max = TOTAL_DEVICES;
-
-    sysInfo.devsAvailable = malloc(max * sizeof (int));
-
-    if (sysInfo.devsAvailable == NULL)
-        return(-1);
+    nanotime_t start;
+    nanotime_t waited;
+    int rc = pthread_mutex_trylock(&fadeLock);
 
-    for (devID = 0; devID < max; devID++)
+    if (rc != EBUSY)
     {
-        if (devFunctions[devID]->queryExistence() != 0)
+        if (rc == 0)
         {
-            sysInfo.devsAvailable[retVal] = devID;
-            retVal++;
+            STATS_ADD(lockStats.acquires, 1);
+            lockTaken();
         } /* if */
-    } /* for */
+        return(rc);
+    } /* if */
 
-    sysInfo.devCount = retVal;
+    start = monotonicNow();
+    rc = pthread_mutex_lock(&fadeLock);
+    if (rc == 0)
+    {
+        waited = monotonicNow() - start;
+        STATS_ADD(lockStats.acquires, 1);
+        STATS_ADD(lockStats.contended, 1);
+        STATS_ADD(lockStats.totalWait, waited);
+        STATS_MAX(lockStats.maxWait, waited);
+        TRACE(TRACE_LOCK_WAIT, (int) (waited / 1000), 0);
+        lockTaken();
+    } /* if */
 
-    return(retVal);
-} /* checkForDevices */
+    return(rc);
+} /* lockFades */
 
 
-static int attemptAutoInit(void)
+static inline int cookMaster(void)
+{
+    return(blackOutEnabled ? 0 : grandMasterLevel);
+} /* cookMaster */
+
+
+static inline void frameChanged(void)
 /*
- * Attempt to initialize every existing device until one is successful.
- *  This is called exclusively from dimmer_init(). Parts of (sysInfo) are
- *  set here.
- *
- *   params : void.
- *  returns : 0 on successful init of any device, -1 on fatal errors and
- *             when no available device can initialize. (errno) set on errors.
- *    errno : anything dimmer_select_device() can set.
+ * Note that cookedLevels changed, so the fade thread publishes a new
+ *  frame. It only needs waking once per batch of changes, and never
+ *  when it's the one making them; it publishes before it sleeps anyhow.
  */
 {
-    int i;
-    int retVal = -1;
-    char buffer[50];
+    if ((__atomic_exchange_n(&frameDirty, 1, __ATOMIC_ACQ_REL) == 0) &&
+        (!pthread_equal(pthread_self(), fadeThread)))
+        wakeFadeThread();
+} /* frameChanged */
 
-    for (i = 0; (i < sysInfo.devCount) && (retVal == -1); i++)
+
+static inline void markChanged(int first, int count)
+/*
+ * Note a run of patched channels as changed in (pendingChanges). Caller
+ *  must hold fadeLock, or have the threads stopped.
+ */
+{
+    if (pendingChanges == NULL)
+        return;
+
+    while ((count > 0) && (first & 7))
     {
-        devFunctions[sysInfo.devsAvailable[i]]->queryModuleName(buffer,
-                                                            sizeof (buffer));
-        retVal = dimmer_select_device(buffer);
-    } /* for */
+        pendingChanges[first >> 3] |= (unsigned char) (1 << (first & 7));
+        first++;
+        count--;
+    } /* while */
 
-    return(retVal);
-} /* attemptAutoInit */
+    if (count >= 8)
+    {
+        memset(pendingChanges + (first >> 3), 0xFF, count >> 3);
+        first += count & ~7;
+        count &= 7;
+    } /* if */
 
+    while (count > 0)
+    {
+        pendingChanges[first >> 3] |= (unsigned char) (1 << (first & 7));
+        first++;
+        count--;
+    } /* while */
+} /* markChanged */
 
-static inline void deinitDevice(void)
+
+static void retuneFrameRate(void)
+/*
+ * Set the frame clock to (refreshHz), or faster, if the device can send
+ *  universes of (longestUniverse) slots faster than that and the
+ *  application didn't pin the rate.
+ */
 {
-    if (activeModFuncs != NULL)
+    long long usecs = devInfo.packetUsecs +
+                        ((long long) longestUniverse * devInfo.slotUsecs);
+    int hz = refreshHz;
+
+    if ((devInfo.slotUsecs > 0) && (!refreshPinned) &&
+        (usecs > 0) && ((usecs * hz) < 1000000))
     {
-        activeModFuncs->deinitialize();
-        activeModFuncs = NULL;
+        hz = (int) (1000000 / usecs);
+        if (hz > DIMMER_MAX_REFRESH_HZ)
+            hz = DIMMER_MAX_REFRESH_HZ;
     } /* if */
-} /* deinitDevice */
+
+    effectiveHz = hz;
+    deviceFrameTime = fadeFrameTime = 1000000000LL / hz;
+
+    pthread_mutex_lock(&timingLock);
+    frameTiming.effectiveHz = hz;
+    frameTiming.longestUniverse = longestUniverse;
+    pthread_mutex_unlock(&timingLock);
+} /* retuneFrameRate */
+
+
+static inline void useSlot(int patched)
+/*
+ * Patched channel (patched) is in use; make sure its universe gets sent
+ *  at least that far. Caller must hold fadeLock, or be the only thread
+ *  changing levels.
+ */
+{
+    int universe = patched / DIMMER_UNIVERSE_SIZE;
+    int slots = (patched % DIMMER_UNIVERSE_SIZE) + 1;
+
+    if (slots <= universeSlots[universe])
+        return;
+
+    __atomic_store_n(&universeSlots[universe], slots, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slotsChanged, 1, __ATOMIC_RELEASE);
+
+    if (slots > longestUniverse)
+    {
+        longestUniverse = slots;
+        retuneFrameRate();
+    } /* if */
+} /* useSlot */
+
+
+static struct PatchMap *allocPatchMap(int numChannels, int numPatches)
+/*
+ * One block for a map and all its arrays; free() it all at once.
+ *
+ *    params : numChannels == channels it maps.
+ *             numPatches  == channel-to-dimmer patches in it.
+ *   returns : the map, with only its sizes filled in. NULL if out of
+ *              memory.
+ */
+{
+    struct PatchMap *map;
+    size_t size = sizeof (struct PatchMap) +
+                  (sizeof (int) * (numChannels + 1 + numPatches)) +
+                  numPatches;
+
+    map = (struct PatchMap *) malloc(size);
+    if (map == NULL)
+        return(NULL);
+
+    map->epoch = 0;
+    map->numChannels = numChannels;
+    map->numPatches = numPatches;
+    map->first = (int *) (map + 1);
+    map->dimmers = map->first + numChannels + 1;
+    map->proportions = (unsigned char *) (map->dimmers + numPatches);
+    map->nextRetired = NULL;
+    return(map);
+} /* allocPatchMap */
+
+
+static struct PatchMap *identityPatchMap(int numChannels)
+/*
+ * Every channel drives the dimmer of the same number, at full.
+ */
+{
+    struct PatchMap *map = allocPatchMap(numChannels, numChannels);
+    int i;
+
+    if (map != NULL)
+    {
+        for (i = 0; i < numChannels; i++)
+        {
+            map->first[i] = i;
+            map->dimmers[i] = i;
+        } /* for */
+        map->first[numChannels] = numChannels;
+        memset(map->proportions, 255, numChannels);
+    } /* if */
+
+    return(map);
+} /* identityPatchMap */
+
+
+static inline const struct PatchMap *currentPatchMap(void)
+{
+    return(__atomic_load_n(&patchMap, __ATOMIC_ACQUIRE));
+} /* currentPatchMap */
+
+
+static void publishPatchMap(struct PatchMap *map)
+/*
+ * Swap in a new map. Caller must hold patchLock. The old one is retired,
+ *  not freed: somebody holding fadeLock might still be using it.
+ *
+ *    params : map == new map. Don't touch it again.
+ *   returns : void.
+ */
+{
+    struct PatchMap *old = patchMap;
+    struct PatchMap *head;
+
+    map->epoch = (old == NULL) ? 1 : old->epoch + 1;
+    __atomic_store_n(&patchMap, map, __ATOMIC_RELEASE);
+
+    if (old != NULL)
+    {
+        head = __atomic_load_n(&retiredMaps, __ATOMIC_RELAXED);
+        do
+        {
+            old->nextRetired = head;
+        } while (!__atomic_compare_exchange_n(&retiredMaps, &head, old, 0,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    } /* if */
+
+    wakeFadeThread();   /* so it takes the lock, and adopts the map. */
+} /* publishPatchMap */
+
+
+static void adoptPatchMap(void)
+/*
+ * Caller just took fadeLock. Whoever held it before is done with any
+ *  map retired so far, so free those. And if the map is new since the
+ *  last lock holder looked, make sure every dimmer it drives is sent.
+ */
+{
+    struct PatchMap *map = __atomic_exchange_n(&retiredMaps, NULL,
+                                               __ATOMIC_ACQUIRE);
+    struct PatchMap *next;
+    int i;
+
+    while (map != NULL)
+    {
+        next = map->nextRetired;
+        free(map);
+        map = next;
+    } /* while */
+
+    map = (struct PatchMap *) currentPatchMap();
+    if ((map != NULL) && (map->epoch != adoptedEpoch))
+    {
+        for (i = 0; i < map->numPatches; i++)
+            useSlot(map->dimmers[i]);   /* something's out there; feed it. */
+        adoptedEpoch = map->epoch;
+    } /* if */
+} /* adoptPatchMap */
+
+
+static void freePatchMaps(void)
+/*
+ * Free the map and everything retired. Only with the threads stopped.
+ */
+{
+    if (patchMap != NULL)
+        free(patchMap);
+    patchMap = NULL;
+    adoptPatchMap();   /* just the retired ones, now. */
+    adoptedEpoch = 0;
+} /* freePatchMaps */
+
+
+static void useSlots(int first, int count)
+/*
+ * useSlot() the last lit channel of a run of freshly cooked ones, in
+ *  each universe the run covers. Only looks past what's already in use.
+ */
+{
+    int end = first + count;
+    int universeEnd;
+    int universe;
+    int lowest;
+    int i;
+
+    if (universeSlots == NULL)
+        return;
+
+    while (first < end)
+    {
+        universe = first / DIMMER_UNIVERSE_SIZE;
+        universeEnd = (universe + 1) * DIMMER_UNIVERSE_SIZE;
+        lowest = (universe * DIMMER_UNIVERSE_SIZE) + universeSlots[universe];
+        if (lowest < first)
+            lowest = first;
+
+            /* a dark stretch goes by eight slots at a time. */
+        i = (universeEnd < end) ? universeEnd : end;
+        while ((i > lowest) && ((i & 7) != 0) && (cookedLevels[i - 1] == 0))
+            i--;
+        while ((i - 8 >= lowest) &&
+               (*((uint64_t *) (cookedLevels + i - 8)) == 0))
+            i -= 8;
+        while ((i > lowest) && (cookedLevels[i - 1] == 0))
+            i--;
+
+        if (i > lowest)
+            useSlot(i - 1);
+
+        first = universeEnd;
+    } /* while */
+} /* useSlots */
+
+
+static void publishFrame(void)
+/*
+ * Fade thread only: hand the device thread a copy of cookedLevels, if
+ *  they changed since the last time, along with which channels did.
+ */
+{
+    uint64_t *pending = (uint64_t *) pendingChanges;
+    uint64_t *carried = (uint64_t *) carriedChanges;
+    uint64_t *changed;
+    int i;
+
+    if (frameHolds > 0)
+        return;   /* releaseFrame() wakes us when it's time. */
+
+    if ((__atomic_exchange_n(&frameDirty, 0, __ATOMIC_ACQ_REL) != 0) &&
+        (frames.buffers[0] != NULL))
+    {
+            /*
+             * Until the device thread picks up a frame, every frame after
+             *  it has to carry its changes too; it might skip straight
+             *  to a later one.
+             */
+        if (frameExchangeTaken(&frames))
+            memset(carriedChanges, '\0', changeMapSize);
+
+        changed = (uint64_t *) frameChanges[frames.back];
+        for (i = 0; i < changeMapSize / (int) sizeof (uint64_t); i++)
+            carried[i] = changed[i] = pending[i] | carried[i];
+
+        memcpy(frameExchangeBack(&frames), cookedLevels, frames.size);
+        frameExchangePublish(&frames);
+        memset(pendingChanges, '\0', changeMapSize);
+    } /* if */
+} /* publishFrame */
+
+
+static int holdFrame(void)
+/*
+ * Keep the fade thread from publishing until releaseFrame(), so every
+ *  change made in between reaches the device in the same frame. Holds
+ *  nest, and can come from any thread. Taking fadeLock to add one means
+ *  a publish already under way finishes first, with none of the batch
+ *  in it.
+ *
+ *    params : void.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    frameHolds++;
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* holdFrame */
+
+
+static int releaseFrame(void)
+/*
+ * Undo one holdFrame(). When the last hold goes, whatever changed while
+ *  they were in place is published as one frame. Taking fadeLock here
+ *  applies everything still queued first, so none of the batch is left
+ *  behind for a later frame.
+ *
+ *    params : void.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EAGAIN (couldn't lock the fade thread.)
+ *             EINVAL (nothing was being held.)
+ */
+{
+    int holds;
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    holds = frameHolds;
+    if (holds > 0)
+        frameHolds--;
+    pthread_mutex_unlock(&fadeLock);
+
+    if (holds == 0)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+        /* frameChanged() won't have woken it while (frameDirty) stayed set. */
+    if ((holds == 1) && (__atomic_load_n(&frameDirty, __ATOMIC_ACQUIRE)))
+        wakeFadeThread();
+
+    return(0);
+} /* releaseFrame */
+
+
+static void cookChunk(void *arg, int first, int count)
+{
+    int base = *((int *) arg);
+
+    cookKernels->cook(rawLevels + base + first, subMix + base + first,
+                      cookMaster(), cookedLevels + base + first, count);
+
+    if (curvedChannelCount > 0)
+    {
+        cookKernels->applyCurves(cookedLevels + base + first,
+                                 dimmerCurves + base + first,
+                                 curveTables, count);
+    } /* if */
+} /* cookChunk */
+
+
+static inline void cookRange(int first, int count)
+/*
+ * Recalculate cookedLevels for a run of patched channels. Big runs,
+ *  like every channel after a grand master move, are split up among
+ *  the helper threads.
+ *
+ *    params : first == first patched channel to cook.
+ *             count == number of channels to cook.
+ *   returns : void.
+ */
+{
+    workPoolRun(cookChunk, &first, count, PARALLEL_CHANNELS);
+    markChanged(first, count);
+    useSlots(first, count);
+    frameChanged();
+} /* cookRange */
+
+
+static void remixSubmasters(int first, int count)
+/*
+ * Rebuild subMix for a run of patched channels from every submaster
+ *  that overlaps it, then recook those channels.
+ *
+ *    params : first == first patched channel to rebuild.
+ *             count == number of channels to rebuild.
+ *   returns : void.
+ */
+{
+    struct Submaster *sub;
+    int lo;
+    int hi;
+    int i;
+
+    memset(subMix + first, '\0', count);
+
+    for (i = 0; i < DIMMER_MAX_SUBMASTERS; i++)
+    {
+        sub = &submasters[i];
+        if ((sub->channelCount == 0) || (sub->master == 0))
+            continue;
+
+        lo = (sub->firstChannel > first) ? sub->firstChannel : first;
+        hi = sub->firstChannel + sub->channelCount;
+        if (hi > first + count)
+            hi = first + count;
+
+        if (lo < hi)
+        {
+            cookKernels->mixSubmaster(subMix + lo,
+                                      sub->levels + (lo - sub->firstChannel),
+                                      sub->master, hi - lo);
+        } /* if */
+    } /* for */
+
+    cookRange(first, count);
+} /* remixSubmasters */
+
+
+static void clearSubmasters(void)
+{
+    int i;
+
+    for (i = 0; i < DIMMER_MAX_SUBMASTERS; i++)
+    {
+        if (submasters[i].levels != NULL)
+            free(submasters[i].levels);
+    } /* for */
+
+    memset(submasters, '\0', sizeof (submasters));
+} /* clearSubmasters */
+
+
+static int mergeChannel(int patched)
+/*
+ * Work out one channel's raw level from every source.
+ *
+ *    params : patched == patched channel to merge.
+ *   returns : merged level.
+ */
+{
+    unsigned long long newest = 0;
+    int retVal = 0;
+    int i;
+
+    if (mergeModes[patched] == DIMMER_MERGE_LTP)
+    {
+        for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+        {
+            if ((sources[i].inUse) && (sources[i].stamps[patched] > newest))
+            {
+                newest = sources[i].stamps[patched];
+                retVal = sources[i].levels[patched];
+            } /* if */
+        } /* for */
+    } /* if */
+
+    else   /* HTP */
+    {
+        for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+        {
+            if ((sources[i].inUse) && (sources[i].levels[patched] > retVal))
+                retVal = sources[i].levels[patched];
+        } /* for */
+    } /* else */
+
+    return(retVal);
+} /* mergeChannel */
+
+
+static void mergeRange(int first, int count)
+/*
+ * Remerge a run of patched channels from every source, then recook
+ *  them. HTP is done a whole source at a time; LTP channels, if there
+ *  are any, are then fixed up one by one.
+ *
+ *    params : first == first patched channel to merge.
+ *             count == number of channels to merge.
+ *   returns : void.
+ */
+{
+    int i;
+
+    memset(rawLevels + first, '\0', count);
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if (sources[i].inUse)
+            cookKernels->maxLevels(rawLevels + first, sources[i].levels + first,
+                                   count);
+    } /* for */
+
+    if (ltpChannelCount > 0)
+    {
+        for (i = first; i < first + count; i++)
+        {
+            if (mergeModes[i] == DIMMER_MERGE_LTP)
+                rawLevels[i] = (unsigned char) mergeChannel(i);
+        } /* for */
+    } /* if */
+
+    cookRange(first, count);
+} /* mergeRange */
+
+
+static inline void setSourceLevel(int source, int patched,
+                                  unsigned char intensity)
+/*
+ * Store a new level from one source for an already-patched channel, and
+ *  remerge and recook just that channel.
+ *
+ *    params : source    == index into (sources). Must be in use.
+ *             patched   == index into the level buffers.
+ *             intensity == new level.
+ *   returns : void.
+ */
+{
+    int level;
+
+    sources[source].levels[patched] = intensity;
+    sources[source].stamps[patched] = ++mergeClock;
+
+    level = mergeChannel(patched);
+    rawLevels[patched] = (unsigned char) level;
+    if (subMix[patched] > level)
+        level = subMix[patched];
+    level = scale255(level, cookMaster());
+    cookedLevels[patched] = curveTables[(dimmerCurves[patched] << 8) + level];
+    pendingChanges[patched >> 3] |= (unsigned char) (1 << (patched & 7));
+    if (cookedLevels[patched] != 0)
+        useSlot(patched);
+    frameChanged();
+} /* setSourceLevel */
+
+
+static unsigned char *allocLevels(int size)
+/*
+ * A zeroed, cache-line-aligned level buffer.
+ *
+ *    params : size == bytes in it; a level stride.
+ *   returns : the new buffer, NULL if out of memory.
+ */
+{
+    void *block;
+
+    if (posix_memalign(&block, LEVEL_ALIGN, size) != 0)
+        return(NULL);
+
+    memset(block, '\0', size);
+    return((unsigned char *) block);
+} /* allocLevels */
+
+
+static unsigned char *allocChangeMaps(int size)
+/*
+ * One block for all six change maps, for (size) bytes of levels. See
+ *  useChangeMaps(). Whatever the device is sent first from them counts
+ *  as all new.
+ *
+ *    params : size == bytes of levels; a level stride.
+ *   returns : the block, NULL if out of memory.
+ */
+{
+    int mapSize = size / 8;
+    void *block;
+
+    if (posix_memalign(&block, LEVEL_ALIGN, mapSize * 6) != 0)
+        return(NULL);
+
+    memset(block, '\0', mapSize * 5);
+    memset(((unsigned char *) block) + (mapSize * 5), 0xFF, mapSize);
+    return((unsigned char *) block);
+} /* allocChangeMaps */
+
+
+static void useChangeMaps(void)
+/*
+ * Point the change maps into (changeMaps), sized for (levelStride): the
+ *  three frames' maps, then pendingChanges, carriedChanges and
+ *  unsentChanges.
+ */
+{
+    int i;
+
+    if (changeMaps == NULL)
+    {
+        for (i = 0; i < 3; i++)
+            frameChanges[i] = NULL;
+        pendingChanges = carriedChanges = unsentChanges = NULL;
+        changeMapSize = 0;
+        return;
+    } /* if */
+
+    changeMapSize = levelStride / 8;
+    for (i = 0; i < 3; i++)
+        frameChanges[i] = changeMaps + (changeMapSize * i);
+    pendingChanges = changeMaps + (changeMapSize * 3);
+    carriedChanges = changeMaps + (changeMapSize * 4);
+    unsentChanges = changeMaps + (changeMapSize * 5);
+} /* useChangeMaps */
+
+
+static int allocSourceLevels(unsigned char **levels,
+                             unsigned long long **stamps, int size)
+/*
+ * A source's level buffer, and its stamps, all zeroed.
+ *
+ *    params : levels == where to put the level buffer.
+ *             stamps == where to put the stamps.
+ *             size   == a level stride.
+ *   returns : -1 if out of memory (and both are NULL), 0 on success.
+ */
+{
+    *levels = allocLevels(size);
+    *stamps = calloc(size, sizeof (unsigned long long));
+    if ((*levels != NULL) && (*stamps != NULL))
+        return(0);
+
+    free(*levels);
+    free(*stamps);
+    *levels = NULL;
+    *stamps = NULL;
+    return(-1);
+} /* allocSourceLevels */
+
+
+static void freeSource(struct LevelSource *src)
+{
+    if (src->levels != NULL)
+        free(src->levels);
+    if (src->stamps != NULL)
+        free(src->stamps);
+    memset(src, '\0', sizeof (struct LevelSource));
+} /* freeSource */
+
+
+static inline void startChannelFade(struct ChannelFadeStatus *fadePtr)
+/*
+ * Move a fade from "scheduled" to "running": take its starting level
+ *  from wherever the channel is right now.
+ *
+ *    params : fadePtr == fade to start. Must not be in either list.
+ *   returns : void.
+ */
+{
+    activeInsert(fadePtr, sources[0].levels[fadePtr->channel]);
+    TRACE(TRACE_FADE_START, fadePtr->channel, fadePtr->destinationLevel);
+} /* startChannelFade */
+
+
+static void fadeChunk(void *arg, int first, int count)
+{
+    int now = *((int *) arg);
+    struct FadeArrays part;
+
+    part.channel = fadeArrays.channel + first;
+    part.startLevel = fadeArrays.startLevel + first;
+    part.endLevel = fadeArrays.endLevel + first;
+    part.startTime = fadeArrays.startTime + first;
+    part.duration = fadeArrays.duration + first;
+    part.invDuration = fadeArrays.invDuration + first;
+    part.curve = fadeArrays.curve + first;
+    fadeKernel(&part, count, now, fadeLevels + first, fadeDone + first);
+} /* fadeChunk */
+
+
+static inline void runFadeList(void)
+/*
+ * One fade frame: start any fades whose delay has expired, evaluate
+ *  every running fade against a single clock reading, and arm the timer
+ *  for the next frame (or the next delayed start, if nothing is moving).
+ *  The new levels all go into the application's source under one stamp,
+ *  and the span they cover is remerged and recooked once, as
+ *  dimmer_channel_set_list() does. Caller must hold fadeLock.
+ *
+ *    params : void.
+ *   returns : void.
+ */
+{
+    nanotime_t now = monotonicNow();
+    nanotime_t nextWake = 0;
+    struct ChannelFadeStatus *fadePtr;
+    struct LevelSource *src = &sources[0];
+    unsigned long long stamp;
+    int nowTicks;
+    int soonest = 0x7FFFFFFF;
+    int remaining;
+    int patched;
+    int lo = levelStride;
+    int hi = -1;
+    int i;
+
+    while ((fadeHeapSize > 0) && (fadeHeap[0]->startTime <= now))
+    {
+        fadePtr = fadeHeap[0];
+        heapRemove(fadePtr);
+        startChannelFade(fadePtr);
+    } /* while */
+
+    if (activeFadeCount > 0)
+    {
+        nowTicks = fadeTicks(now);
+        workPoolRun(fadeChunk, &nowTicks, activeFadeCount, PARALLEL_FADES);
+
+            /* walk backwards, so removal only moves already-seen slots. */
+        stamp = ++mergeClock;
+        for (i = activeFadeCount - 1; i >= 0; i--)
+        {
+            patched = fadeArrays.channel[i];
+            src->levels[patched] = fadeLevels[i];
+            src->stamps[patched] = stamp;
+            if (patched < lo)
+                lo = patched;
+            if (patched > hi)
+                hi = patched;
+
+            if (fadeDone[i])
+            {
+                fadePtr = &fadeTable[patched];
+                fadePtr->fadeActive = __false;
+                TRACE(TRACE_FADE_DONE, fadePtr->channel, fadeLevels[i]);
+                activeRemove(fadePtr);
+            } /* if */
+            else
+            {
+                    /* don't let a frame boundary make us overshoot the end. */
+                remaining = fadeArrays.startTime[i] + fadeArrays.duration[i]
+                            - nowTicks;
+                if (remaining < soonest)
+                    soonest = remaining;
+            } /* else */
+        } /* for */
+
+        if (hi >= 0)
+            mergeRange(lo, (hi - lo) + 1);
+    } /* if */
+
+    if (activeFadeCount > 0)
+    {
+        nextWake = now + fadeFrameTime;
+        if (soonest * 1000000LL < fadeFrameTime)
+            nextWake = now + ((soonest > 0) ? soonest * 1000000LL : 1);
+    } /* if */
+
+    if (fadeHeapSize > 0)
+    {
+        if ((nextWake == 0) || (fadeHeap[0]->startTime < nextWake))
+            nextWake = fadeHeap[0]->startTime;
+    } /* if */
+
+    armFadeTimer(nextWake);
+} /* runFadeList */
+
+
+static inline void countFadePass(nanotime_t took)
+/*
+ * Fade thread only: tally one pass of runFadeList() and publishFrame().
+ *  Caller holds fadeLock, so the fade counts can be read here and passed
+ *  on to dimmer_query_stats(), which can't take it.
+ */
+{
+    STATS_ADD(fadeStats.passes, 1);
+    STATS_ADD(fadeStats.totalPass, took);
+    __atomic_store_n(&fadeStats.lastPass, took, __ATOMIC_RELAXED);
+    STATS_MAX(fadeStats.maxPass, took);
+    __atomic_store_n(&fadeStats.activeFades, activeFadeCount,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&fadeStats.delayedFades, fadeHeapSize,
+                     __ATOMIC_RELAXED);
+} /* countFadePass */
+
+
+static void *fadeThreadEntry(void *args)
+/*
+ * Entry point for fadeThread. Sleeps until the next fade is due or
+ *  until dimmer_channel_fade() pokes us; never spins.
+ *
+ *    params : args == always (NULL).
+ *   returns : Always (NULL). (terminates thread.)
+ */
+{
+    struct pollfd fds[2];
+    uint64_t counter;
+    nanotime_t start;
+
+    fds[0].fd = fadeTimer;
+    fds[0].events = POLLIN;
+    fds[1].fd = fadeWakeup;
+    fds[1].events = POLLIN;
+
+    while (threadLiveFlag == __true)  /* live until dimmer_deinit()... */
+    {
+        if (lockFades() == 0)
+        {
+            start = monotonicNow();
+            runFadeList();
+            publishFrame();
+            countFadePass(monotonicNow() - start);
+            pthread_mutex_unlock(&fadeLock);
+        } /* if */
+
+        if (commandPending())
+            continue;   /* queued after we drained; don't sleep on it. */
+
+        if (poll(fds, 2, -1) > 0)
+        {
+                /* drain whatever woke us, so poll() blocks next time. */
+            if (fds[0].revents & POLLIN)
+                read(fadeTimer, &counter, sizeof (counter));
+            if (fds[1].revents & POLLIN)
+                read(fadeWakeup, &counter, sizeof (counter));
+        } /* if */
+    } /* while */
+
+    return(NULL);
+} /* fadeThreadEntry */
+
+
+static void recordFrameTiming(nanotime_t interval, nanotime_t period,
+                              int missed)
+/*
+ * Tally one frame. (interval) is how long it's been since the last one
+ *  went out, (period) is how long it should have been, and (missed) is
+ *  how many deadlines were skipped entirely because we were running late.
+ */
+{
+    const nanotime_t width = DIMMER_TIMING_BUCKET_USECS * 1000LL;
+    nanotime_t deviation = interval - period;
+    int bucket;
+
+        /* round toward negative infinity, so bucket edges stay even. */
+    if (deviation >= 0)
+        bucket = (int) (deviation / width);
+    else
+        bucket = (int) -((-deviation + width - 1) / width);
+
+    bucket += DIMMER_TIMING_BUCKETS / 2;
+    if (bucket < 0)
+        bucket = 0;
+    else if (bucket >= DIMMER_TIMING_BUCKETS)
+        bucket = DIMMER_TIMING_BUCKETS - 1;
+
+    pthread_mutex_lock(&timingLock);
+    if ((frameTiming.frames == 0) || (interval < frameTiming.minInterval))
+        frameTiming.minInterval = interval;
+    if ((frameTiming.frames == 0) || (interval > frameTiming.maxInterval))
+        frameTiming.maxInterval = interval;
+    frameTiming.frames++;
+    frameTiming.missedFrames += missed;
+    frameTiming.totalInterval += interval;
+    frameTiming.histogram[bucket]++;
+    pthread_mutex_unlock(&timingLock);
+} /* recordFrameTiming */
+
+
+static void recordBusyFrame(void)
+{
+    pthread_mutex_lock(&timingLock);
+    frameTiming.busyFrames++;
+    pthread_mutex_unlock(&timingLock);
+} /* recordBusyFrame */
+
+
+static int sendChanges(unsigned char *levels, __boolean fresh)
+/*
+ * Device thread only: hand a frame to a module that wants to know what
+ *  changed. (unsentChanges) piles up every change since the last frame
+ *  it took, so a frame it turns away loses nothing.
+ */
+{
+    uint64_t *unsent = (uint64_t *) unsentChanges;
+    const uint64_t *changed;
+    int i;
+
+    if (fresh)
+    {
+        changed = (const uint64_t *) frameChanges[frames.front];
+        for (i = 0; i < changeMapSize / (int) sizeof (uint64_t); i++)
+            unsent[i] |= changed[i];
+    } /* if */
+
+    if (activeModFuncs->sendChanges(levels, unsentChanges) == -1)
+        return(-1);
+
+    memset(unsentChanges, '\0', changeMapSize);
+    return(0);
+} /* sendChanges */
+
+
+static int sendFrame(unsigned char *levels, __boolean fresh)
+/*
+ * Device thread only: hand one whole frame to the device module.
+ *
+ *    params : levels == the frame.
+ *             fresh  == __true if it's not the same frame as last time.
+ *   returns : -1 if the device turned it away, 0 otherwise. (errno) set
+ *              on error.
+ *     errno : EAGAIN (the device is busy; try again shortly.)
+ *             anything the device module sets.
+ */
+{
+    int rc = 0;
+
+    if (activeModFuncs->sendChanges != NULL)
+        rc = sendChanges(levels, fresh);
+    else if (activeModFuncs->sendFrame != NULL)
+        rc = activeModFuncs->sendFrame(levels);
+    else
+        activeModFuncs->updateDevice(levels);
+
+    if (rc == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_UPDATE);
+        return(-1);
+    } /* if */
+
+    TRACE(TRACE_FRAME_SENT, -1, frames.size);
+    return(0);
+} /* sendFrame */
+
+
+static unsigned int tellUniverseSlots(unsigned int told)
+/*
+ * Device thread only: if any universe got longer since (told), tell the
+ *  output ring and the device module how long each one is now. Call it
+ *  after picking up a frame, so it covers everything lit in that frame.
+ *
+ *    params : told == what (slotsChanged) was the last time.
+ *   returns : what it is now; pass it next time.
+ */
+{
+    unsigned int changed = __atomic_load_n(&slotsChanged, __ATOMIC_ACQUIRE);
+    int slots;
+    int i;
+
+    if ((changed == told) || (devInfo.slotUsecs <= 0))
+        return(changed);
+
+    for (i = 0; i < devInfo.numUniverses; i++)
+    {
+        slots = __atomic_load_n(&universeSlots[i], __ATOMIC_RELAXED);
+        if (outputRing.count > 0)
+            outputRingSetSlots(&outputRing, i, slots);
+        if (activeModFuncs->setUniverseSlots != NULL)
+            activeModFuncs->setUniverseSlots(i, slots);
+    } /* for */
+
+    return(changed);
+} /* tellUniverseSlots */
+
+
+static void resetFrameTiming(void)
+{
+    pthread_mutex_lock(&timingLock);
+    memset(&frameTiming, '\0', sizeof (frameTiming));
+    frameTiming.refreshHz = refreshHz;
+    frameTiming.effectiveHz = effectiveHz;
+    frameTiming.longestUniverse = longestUniverse;
+    pthread_mutex_unlock(&timingLock);
+} /* resetFrameTiming */
+
+
+static void *outputWorkerEntry(void *args)
+/*
+ * Entry point for an OutputWorker's thread. Sends its universe whenever
+ *  the device thread says there's a new frame.
+ *
+ *    params : args == the OutputWorker.
+ *   returns : Always (NULL). (terminates thread.)
+ */
+{
+    struct OutputWorker *worker = (struct OutputWorker *) args;
+
+    while (!__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE))
+    {
+        if (sem_wait(&worker->ready) == -1)
+            continue;   /* EINTR. */
+
+            /* running behind? Those frames are stale; skip to the newest. */
+        while (sem_trywait(&worker->ready) == 0)
+            ;
+
+        if (!__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE))
+        {
+            activeModFuncs->updateUniverse(worker->universe,
+                                   frameExchangeLatest(&worker->frame));
+            TRACE(TRACE_FRAME_SENT, worker->universe, DIMMER_UNIVERSE_SIZE);
+        } /* if */
+    } /* while */
+
+    return(NULL);
+} /* outputWorkerEntry */
+
+
+static void feedOutputWorkers(unsigned char *levels)
+/*
+ * Device thread only: give every output worker its universe of
+ *  (levels), and wake it. Never waits on a worker.
+ */
+{
+    struct OutputWorker *worker;
+    int i;
+
+    for (i = 0; i < outputWorkerCount; i++)
+    {
+        worker = &outputWorkers[i];
+        memcpy(frameExchangeBack(&worker->frame),
+               levels + (worker->universe * DIMMER_UNIVERSE_SIZE),
+               DIMMER_UNIVERSE_SIZE);
+        frameExchangePublish(&worker->frame);
+        sem_post(&worker->ready);
+    } /* for */
+} /* feedOutputWorkers */
+
+
+static void stopOutputWorkers(void)
+/*
+ * Join and free every output worker, and stop the output ring. The
+ *  device thread must be gone or standing aside, so nothing posts to
+ *  them anymore.
+ */
+{
+    int i;
+
+    for (i = 0; i < outputWorkerCount; i++)
+    {
+        __atomic_store_n(&outputWorkers[i].stopping, 1, __ATOMIC_RELEASE);
+        sem_post(&outputWorkers[i].ready);
+        pthread_join(outputWorkers[i].thread, NULL);
+        sem_destroy(&outputWorkers[i].ready);
+        frameExchangeFree(&outputWorkers[i].frame);
+    } /* for */
+
+    if (outputWorkers != NULL)
+        free(outputWorkers);
+    outputWorkers = NULL;
+    outputWorkerCount = 0;
+
+        /* the ring's error count goes with it; keep it. */
+    STATS_ADD(deviceStats.errors, outputRing.errors);
+    outputRingStop(&outputRing);
+} /* stopOutputWorkers */
+
+
+static int startOutputRing(void)
+/*
+ * If the device module hands us its outputs' file descriptors, set up
+ *  (outputRing) to write them asynchronously, so the device thread
+ *  never waits on a slow port.
+ *
+ *    params : void.
+ *   returns : number of outputs in the ring, 0 if there's no ring.
+ */
+{
+    struct DimmerAsyncOutput outputs[DIMMER_MAX_ASYNC_OUTPUTS];
+    int count;
+    int i;
+
+    if ((activeModFuncs == NULL) || (activeModFuncs->queryAsyncOutputs == NULL))
+        return(0);
+
+    count = activeModFuncs->queryAsyncOutputs(outputs,
+                                              DIMMER_MAX_ASYNC_OUTPUTS);
+    for (i = 0; i < count; i++)
+    {
+        if ((outputs[i].universe < 0) ||
+            (outputs[i].universe >= devInfo.numUniverses))
+            return(0);
+    } /* for */
+
+    if ((count <= 0) || (outputRingStart(&outputRing, outputs, count) == -1))
+        return(0);
+
+    return(count);
+} /* startOutputRing */
+
+
+static int startOutputWorkers(void)
+/*
+ * Spin one output worker per universe, if the device module can take
+ *  its universes one at a time. Otherwise, there are no workers, and the
+ *  device thread sends frames itself: through an output ring if the
+ *  module allows it, else with sendFrame() or updateDevice().
+ *
+ *    params : void.
+ *   returns : -1 on error, 0 on success.
+ */
+{
+    struct OutputWorker *worker;
+    int count = devInfo.numUniverses;
+    int i;
+
+    if (startOutputRing() > 0)
+        return(0);
+
+    if ((activeModFuncs == NULL) || (activeModFuncs->updateUniverse == NULL))
+        return(0);
+
+    outputWorkers = calloc(count, sizeof (struct OutputWorker));
+    if (outputWorkers == NULL)
+        return(-1);
+
+    for (i = 0; i < count; i++)
+    {
+        worker = &outputWorkers[i];
+        worker->universe = i;
+        if (frameExchangeInit(&worker->frame, DIMMER_UNIVERSE_SIZE) == -1)
+            break;
+
+        if (sem_init(&worker->ready, 0, 0) == -1)
+        {
+            frameExchangeFree(&worker->frame);
+            break;
+        } /* if */
+
+        if (pthread_create(&worker->thread, NULL, outputWorkerEntry, worker))
+        {
+            sem_destroy(&worker->ready);
+            frameExchangeFree(&worker->frame);
+            break;
+        } /* if */
+
+        outputWorkerCount++;
+    } /* for */
+
+    return((outputWorkerCount == count) ? 0 : -1);
+} /* startOutputWorkers */
+
+
+static void standAside(void)
+/*
+ * Device thread only: output is being paused. Say so, and stay out of
+ *  everything until it's resumed. See pauseOutput().
+ */
+{
+    pthread_mutex_lock(&outputLock);
+    deviceGeneration = outputGeneration;
+    pthread_cond_broadcast(&outputMoved);
+    while ((outputGeneration == deviceGeneration) && (threadLiveFlag))
+        pthread_cond_wait(&outputMoved, &outputLock);
+    pthread_mutex_unlock(&outputLock);
+} /* standAside */
+
+
+static void *deviceThreadEntry(void *args)
+/*
+ * Entry point for deviceThread. Sends the cooked levels to the device
+ *  once per (deviceFrameTime), on absolute CLOCK_MONOTONIC deadlines.
+ *  If a frame runs so late that the next deadline has already passed,
+ *  the missed deadlines are skipped instead of sent in a burst. If the
+ *  device is too busy for a frame, it gets the newest one again a
+ *  fraction of a frame later, until the next deadline comes around.
+ *
+ *    params : args == always (NULL).
+ *   returns : Always (NULL). (terminates thread.)
+ */
+{
+    struct timespec deadline;
+    unsigned char *levels;
+    nanotime_t next = monotonicNow();
+    nanotime_t wake = next;
+    nanotime_t last = 0;
+    nanotime_t period;
+    nanotime_t now;
+    unsigned int slotsTold = slotsChanged - 1;   /* tell it right away. */
+    int lastFront;
+    int missed;
+    int rc;
+
+    while (threadLiveFlag)      /* endless loop. */
+    {
+        deadline.tv_sec = (time_t) (wake / 1000000000LL);
+        deadline.tv_nsec = (long) (wake % 1000000000LL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                               &deadline, NULL) == EINTR)
+            ;   /* just go back to sleep. */
+
+        if (__atomic_load_n(&outputGeneration, __ATOMIC_ACQUIRE) & 1)
+            standAside();
+
+        now = monotonicNow();
+        rc = 0;
+        if (usingDaemon())
+        {
+            slotsTold = tellUniverseSlots(slotsTold);
+            activeModFuncs->updateDevice(NULL);   /* frames are shared. */
+            STATS_ADD(deviceStats.framesSent, 1);
+        } /* if */
+        else if ((activeModFuncs != NULL) && (frames.buffers[0] != NULL))
+        {
+            lastFront = frames.front;
+            levels = frameExchangeLatest(&frames);
+            slotsTold = tellUniverseSlots(slotsTold);
+            if (outputRing.count > 0)
+            {
+                    /* never waits; busy outputs just sit this one out. */
+                if (outputRingSubmit(&outputRing, levels) > 0)
+                    recordBusyFrame();
+                TRACE(TRACE_FRAME_SENT, -1, frames.size);
+                STATS_ADD(deviceStats.framesSent, 1);
+            } /* if */
+            else if (outputWorkerCount > 0)
+            {
+                feedOutputWorkers(levels);
+                STATS_ADD(deviceStats.framesSent, 1);
+            } /* else if */
+            else
+            {
+                rc = sendFrame(levels, (frames.front != lastFront));
+                if (rc == 0)
+                    STATS_ADD(deviceStats.framesSent, 1);
+                else if (errno != EAGAIN)
+                    STATS_ADD(deviceStats.errors, 1);
+            } /* else */
+        } /* if */
+
+        period = deviceFrameTime;
+        if ((rc == -1) && (errno == EAGAIN))
+        {
+            recordBusyFrame();
+            wake = now + (period / BUSY_RETRIES_PER_FRAME);
+            if (wake < next + period)
+                continue;   /* same deadline; don't count it as a frame. */
+        } /* if */
+
+        next += period;
+        missed = 0;
+        if (next <= now)
+        {
+            missed = (int) (((now - next) / period) + 1);
+            next += missed * period;
+            TRACE(TRACE_FRAME_MISSED, missed, 0);
+        } /* if */
+
+        if (last != 0)
+            recordFrameTiming(now - last, period, missed);
+        last = now;
+        wake = next;
+    } /* while */
+
+    return(NULL);
+} /* deviceThreadEntry */
+
+
+static int realtimeThread(pthread_t thread, int priority, int cpu)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rc;
+
+    memset(&param, '\0', sizeof (param));
+    param.sched_priority = priority;
+    rc = pthread_setschedparam(thread,
+                               (priority > 0) ? SCHED_FIFO : SCHED_OTHER,
+                               &param);
+    if (rc == 0)
+    {
+        CPU_ZERO(&cpus);
+        if (cpu >= 0)
+            CPU_SET(cpu, &cpus);
+        else
+            sched_getaffinity(0, sizeof (cpus), &cpus);
+        rc = pthread_setaffinity_np(thread, sizeof (cpus), &cpus);
+    } /* if */
+
+    return(rc);
+} /* realtimeThread */
+
+
+static int applyRealtime(int priority, int cpu)
+/*
+ * Put the device thread into (or take it out of) real-time mode:
+ *  SCHED_FIFO at (priority), pinned to (cpu), with all our memory locked
+ *  so a page fault can't stall a frame. A (priority) of zero means normal
+ *  scheduling, a (cpu) of -1 means any CPU this process may use. Output
+ *  workers get the same priority, but are left free to run on any CPU.
+ *  Memory stays locked once it's locked: the locks are the whole
+ *  process's, and munlockall() would drop any the application took too.
+ *
+ *   params : priority == SCHED_FIFO priority, or zero.
+ *            cpu      == CPU to run on, or -1.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (not allowed to go real-time.)
+ *            anything mlockall() or pthread_setaffinity_np() can set.
+ */
+{
+    int rc;
+    int i;
+
+    if ((priority > 0) && (!memoryLocked))
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+            return(-1);
+        memoryLocked = __true;
+    } /* if */
+
+    rc = realtimeThread(deviceThread, priority, cpu);
+    for (i = 0; (rc == 0) && (i < outputWorkerCount); i++)
+        rc = realtimeThread(outputWorkers[i].thread, priority, -1);
+
+    if (rc != 0)
+    {
+        errno = rc;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* applyRealtime */
+
+
+static int setRefreshRate(int hz)
+{
+    if (threadLiveFlag)
+    {
+        if (lockFades() != 0)
+        {
+            errno = EAGAIN;
+            return(-1);
+        } /* if */
+    } /* if */
+
+    refreshHz = hz;
+    resetFrameTiming();
+    retuneFrameRate();
+
+    if (threadLiveFlag)
+    {
+        pthread_mutex_unlock(&fadeLock);
+        wakeFadeThread();
+    } /* if */
+
+    return(0);
+} /* setRefreshRate */
+
+
+static int spinJoinableThread(pthread_t *thread, void *(*entry)(void *))
+/*
+ * Use this to spin separate, joinable threads.
+ *
+ *   params : thread == where to store thread handle.
+ *            entry  == entry point for thread.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ */
+{
+    int retVal = -1;
+    pthread_attr_t attrs;
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    retVal = pthread_create(thread, &attrs, entry, NULL);
+    pthread_attr_destroy(&attrs);
+
+    return(retVal);
+} /* spinJoinableThread */
+
+
+static int spinThreads(void)
+{
+    int retVal = -1;
+
+    pthread_mutex_init(&fadeLock, NULL);
+
+    if (threadLiveFlag == __false)
+    {
+        fadeTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (fadeTimer == -1)
+            return(-1);
+
+        fadeWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fadeWakeup == -1)
+        {
+            close(fadeTimer);
+            fadeTimer = -1;
+            return(-1);
+        } /* if */
+
+        threadLiveFlag = __true;
+
+        workPoolStart();
+
+        if (spinJoinableThread(&fadeThread, fadeThreadEntry) != -1)
+        {
+            if ((startOutputWorkers() != -1) &&
+                (spinJoinableThread(&deviceThread, deviceThreadEntry) != -1))
+            {
+                    /* new threads, so they need their real-time mode back. */
+                if ((rtPriority > 0) || (rtCPU >= 0))
+                    applyRealtime(rtPriority, rtCPU);
+                retVal = 0;
+            } /* if */
+
+            else    /* no device thread? Kill off the other threads, too. */
+            {
+                threadLiveFlag = __false;
+                stopOutputWorkers();
+                wakeFadeThread();
+                pthread_join(fadeThread, NULL);
+            } /* else */
+        } /* if */
+
+        if (retVal == -1)
+        {
+            threadLiveFlag = __false;
+            workPoolStop();
+            close(fadeTimer);
+            close(fadeWakeup);
+            fadeTimer = fadeWakeup = -1;
+        } /* if */
+    } /* if */
+
+    return(retVal);
+} /* spinThreads */
+
+
+static void killThreads(void)
+{
+    if (threadLiveFlag == __true)
+    {
+        threadLiveFlag = __false;
+        wakeFadeThread();   /* get it out of poll(). */
+        pthread_mutex_lock(&outputLock);
+        pthread_cond_broadcast(&outputMoved);   /* or standAside(). */
+        pthread_mutex_unlock(&outputLock);
+        pthread_join(fadeThread, NULL);
+        pthread_join(deviceThread, NULL);
+        stopOutputWorkers();
+        workPoolStop();
+        pthread_mutex_destroy(&fadeLock);
+        close(fadeTimer);
+        close(fadeWakeup);
+        fadeTimer = fadeWakeup = -1;
+    } /* if */
+} /* killThreads */
+
+
+static void pauseOutput(void)
+/*
+ * Get the device thread to stand aside between two frames, and stop the
+ *  output workers or ring, so nothing reads the output buffers or sends
+ *  through the device module until resumeOutput(). Fades keep running,
+ *  and levels can still be set, meanwhile. One pause at a time; another
+ *  waits for this one to be resumed.
+ *
+ *    params : void.
+ *   returns : void.
+ */
+{
+    pthread_mutex_lock(&pauseLock);
+    if (!threadLiveFlag)
+        return;
+
+    pthread_mutex_lock(&outputLock);
+    outputGeneration++;   /* odd: stand aside. */
+    while (deviceGeneration != outputGeneration)
+        pthread_cond_wait(&outputMoved, &outputLock);
+    pthread_mutex_unlock(&outputLock);
+
+    stopOutputWorkers();
+    outputPaused = __true;
+} /* pauseOutput */
+
+
+static void resumeOutput(void)
+/*
+ * Undo pauseOutput(): start output workers or a ring for the device
+ *  module as it is now, and let the device thread carry on.
+ *
+ *    params : void.
+ *   returns : void.
+ */
+{
+    if (outputPaused)
+    {
+        if (startOutputWorkers() == -1)
+            stopOutputWorkers();   /* it'll just have to take whole frames. */
+        else if ((rtPriority > 0) || (rtCPU >= 0))
+            applyRealtime(rtPriority, rtCPU);   /* any workers are new. */
+
+        pthread_mutex_lock(&outputLock);
+        outputGeneration++;
+        pthread_cond_broadcast(&outputMoved);
+        pthread_mutex_unlock(&outputLock);
+        outputPaused = __false;
+    } /* if */
+
+    pthread_mutex_unlock(&pauseLock);
+} /* resumeOutput */
+
+
+static int checkForDevices(void)
+/*
+ * Internal function called from dimmer_init(): Check to see which
+ *  of supported devices exist. Fill them into (sysInfo).
+ *
+ *     params : void.
+ *    returns : total found devices. (-1) on error.
+ */
+{
+    int retVal = 0;
+    int devID;
+    int max = TOTAL_DEVICES;
+
+    sysInfo.devsAvailable = malloc(max * sizeof (int));
+
+    if (sysInfo.devsAvailable == NULL)
+        return(-1);
+
+    for (devID = 0; devID < max; devID++)
+    {
+        if (devFunctions[devID]->queryExistence() != 0)
+        {
+            sysInfo.devsAvailable[retVal] = devID;
+            retVal++;
+        } /* if */
+    } /* for */
+
+    sysInfo.devCount = retVal;
+
+    return(retVal);
+} /* checkForDevices */
+
+
+static int attemptAutoInit(void)
+/*
+ * Attempt to initialize every existing device until one is successful.
+ *  This is called exclusively from dimmer_init(). Parts of (sysInfo) are
+ *  set here.
+ *
+ *   params : void.
+ *  returns : 0 on successful init of any device, -1 on fatal errors and
+ *             when no available device can initialize. (errno) set on errors.
+ *    errno : anything dimmer_select_device() can set.
+ */
+{
+    int i;
+    int retVal = -1;
+    char buffer[50];
+
+    for (i = 0; (i < sysInfo.devCount) && (retVal == -1); i++)
+    {
+        devFunctions[sysInfo.devsAvailable[i]]->queryModuleName(buffer,
+                                                            sizeof (buffer));
+        retVal = dimmer_select_device(buffer);
+    } /* for */
+
+    return(retVal);
+} /* attemptAutoInit */
+
+
+static inline void deinitDevice(void)
+{
+    if (activeModFuncs != NULL)
+    {
+        activeModFuncs->deinitialize();
+        activeModFuncs = NULL;
+    } /* if */
+} /* deinitDevice */
+
+
+#define LED_CURVE_DIVISOR  (116LL * 116 * 116 * 255 * 255)
+
+static void buildCurveTables(void)
+/*
+ * Fill in the built-in dimmer curves. Integer math all the way, so every
+ *  machine gets exactly the same tables.
+ */
+{
+    unsigned char *table;
+    long long lightness;
+    long long cube;
+    int root = 0;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        table = curveTables + i;
+        table[DIMMER_CURVE_LINEAR << 8] = (unsigned char) i;
+        table[DIMMER_CURVE_SQUARE << 8] =
+            (unsigned char) (((i * i) + 127) / 255);
+
+            /* 255 * sqrt(i / 255), rounded, is sqrt(i * 255), rounded. */
+        while ((root + 1) * (root + 1) <= i * 255)
+            root++;
+        table[DIMMER_CURVE_INVERSE_SQUARE << 8] =
+            (unsigned char) (((i * 255) - (root * root) > root) ?
+                                root + 1 : root);
+
+        table[DIMMER_CURVE_SWITCH << 8] = (i >= 128) ? 255 : 0;
+
+            /*
+             * Take the level as CIE lightness (L* 0-100), and send the
+             *  luminance that looks that bright: ((L* + 16) / 116) cubed,
+             *  or L* / 903.3 near the bottom. Worked in units of L* / 255,
+             *  so (255 * 116) cubed over 255 is what (L* + 16) cubed is
+             *  divided by.
+             */
+        lightness = (long long) i * 100;
+        if (lightness <= 8 * 255)
+            table[DIMMER_CURVE_LED << 8] =
+                (unsigned char) (((lightness * 10) + 4516) / 9033);
+        else
+        {
+            cube = lightness + (16 * 255);
+            cube = cube * cube * cube;
+            table[DIMMER_CURVE_LED << 8] =
+                (unsigned char) ((cube + (LED_CURVE_DIVISOR / 2)) /
+                                    LED_CURVE_DIVISOR);
+        } /* else */
+    } /* for */
+
+    curveCount = BUILTIN_CURVES;
+} /* buildCurveTables */
 
 
 int dimmer_init(int autoInit)
 /*
- * This function should be called before any other function in
- *  libdimmer. This sets up some basic stuff.
+ * This function should be called before any other function in
+ *  libdimmer. This sets up some basic stuff.
+ *
+ *     params : autoInit == if not zero, select the first device that
+ *                          initializes successfully as the default device.
+ *                          if zero, no devices initializations are attempted
+ *                          by this function, and the default device is set to
+ *                          (-1) (none of the above). This function returns an
+ *                          error if this flag is set and either no devices
+ *                          exist or no devices initialize. No error is
+ *                          returned if this flag is not set and no devices
+ *                          are usable.
+ *    returns : -1 on error, 0 on success. (errno) is set on error.
+ *      errno : EPERM (trying to call init more than once).
+ *              EAGAIN (threads wouldn't spin.)
+ */
+{
+    if (dimmerLibInitialized)
+    {
+        errno = EPERM;
+        return(-1);
+    } /* if */
+
+    if (checkForDevices() <= 0)
+    {
+        errno = ENODEV;
+        return(-1);
+    } /* if */
+
+    if (autoInit)
+    {
+        if (attemptAutoInit() == -1)
+        {
+            errno = ENODEV;
+            return(-1);
+        } /* if */
+    } /* if */
+
+    fadeKernel = fadeKernelSelect(NULL);
+    cookKernels = cookKernelsSelect();
+    buildCurveTables();
+    resetFrameTiming();
+    memset(&fadeStats, '\0', sizeof (fadeStats));   /* no threads yet. */
+    memset(&lockStats, '\0', sizeof (lockStats));
+    memset(&deviceStats, '\0', sizeof (deviceStats));
+
+    if (spinThreads() == -1)
+    {
+        deinitDevice();
+        return(-1);
+    } /* if */
+
+    atexit(dimmer_deinit);
+
+    dimmerLibInitialized = __true;
+    return(0);
+} /* dimmer_init */
+
+
+#define SWAP_BUFFERS(a, b)  \
+    do { __typeof__(a) swapTmp = (a); (a) = (b); (b) = swapTmp; } while (0)
+
+static void swapChannelBuffers(struct ChannelBuffers *set, int chan)
+/*
+ * Put the buffers in (set) in use, and leave the ones they replace in
+ *  (set). Caller must hold fadeLock, with output paused, or have the
+ *  threads stopped. Every source in use needs buffers in (set), unless
+ *  it's an empty set, to free everything.
+ *
+ *    params : set  == buffers to trade.
+ *             chan == channels the ones in (set) are for.
+ *   returns : void.
+ */
+{
+    struct FrameExchange old;
+    int i;
+
+    SWAP_BUFFERS(levelStride, set->levelStride);
+    SWAP_BUFFERS(rawLevels, set->rawLevels);
+    SWAP_BUFFERS(cookedLevels, set->cookedLevels);
+    SWAP_BUFFERS(subMix, set->subMix);
+    SWAP_BUFFERS(mergeModes, set->mergeModes);
+    SWAP_BUFFERS(dimmerCurves, set->dimmerCurves);
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if (sources[i].inUse)
+        {
+            SWAP_BUFFERS(sources[i].levels, set->sourceLevels[i]);
+            SWAP_BUFFERS(sources[i].stamps, set->sourceStamps[i]);
+        } /* if */
+    } /* for */
+
+    SWAP_BUFFERS(fadeTable, set->fadeTable);
+    SWAP_BUFFERS(fadeHeap, set->fadeHeap);
+    SWAP_BUFFERS(fadeHeapSize, set->fadeHeapSize);
+    SWAP_BUFFERS(fadeArrays, set->fadeArrays);
+    SWAP_BUFFERS(activeFadeCount, set->activeFadeCount);
+    useFadeArrays(chan);
+
+    SWAP_BUFFERS(changeMaps, set->changeMaps);
+    useChangeMaps();
+    SWAP_BUFFERS(universeSlots, set->universeSlots);
+
+    frameExchangeMove(&old, &frames);
+    frameExchangeMove(&frames, &set->frames);
+    frameExchangeMove(&set->frames, &old);
+} /* swapChannelBuffers */
+
+
+static void freeChannelBuffers(struct ChannelBuffers *set)
+{
+    int i;
+
+    free(set->rawLevels);
+    free(set->cookedLevels);
+    free(set->subMix);
+    free(set->mergeModes);
+    free(set->dimmerCurves);
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        free(set->sourceLevels[i]);
+        free(set->sourceStamps[i]);
+    } /* for */
+
+    free(set->fadeTable);
+    free(set->fadeHeap);
+    free(set->fadeArrays.channel);
+    free(set->changeMaps);
+    free(set->universeSlots);
+    frameExchangeFree(&set->frames);
+    memset(set, '\0', sizeof (struct ChannelBuffers));
+} /* freeChannelBuffers */
+
+
+void dimmer_deinit(void)
+/*
+ * This is called atexit() to clean up, but for flexibility, we
+ *  set everything back to its default state.
+ *
+ *    params : void.
+ *   returns : Always (0).
+ */
+{
+    struct ChannelBuffers empty;
+    int i;
+
+    if (dimmerLibInitialized)
+    {
+        killThreads();
+        deinitDevice();
+
+        memset(&empty, '\0', sizeof (empty));
+        swapChannelBuffers(&empty, 0);
+        freeChannelBuffers(&empty);
+
+        pthread_mutex_lock(&patchLock);
+        freePatchMaps();
+        pthread_mutex_unlock(&patchLock);
+
+        clearSubmasters();
+        ltpChannelCount = 0;
+        curvedChannelCount = 0;
+        curveCount = 0;
+        for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+            freeSource(&sources[i]);
+
+        if (sysInfo.devsAvailable != NULL)
+            free(sysInfo.devsAvailable);
+
+        grandMasterLevel = 255;
+        blackOutEnabled = __false;
+
+        rtPriority = 0;   /* memory stays locked; see applyRealtime(). */
+        rtCPU = -1;
+        refreshHz = effectiveHz = DEFAULT_REFRESH_HZ;
+        refreshPinned = __false;
+        deviceFrameTime = fadeFrameTime = 1000000000LL / DEFAULT_REFRESH_HZ;
+
+        memset(&sysInfo, '\0', sizeof (struct DimmerSystemInfo));
+        sysInfo.activeDevID = -1;
+        activeModFuncs = NULL;
+        duplexEnabled = __false;
+
+        frameDirty = 0;
+        frameHolds = 0;
+        commandDiscard();
+        longestUniverse = 0;
+
+        dimmerLibInitialized = __false;
+    } /* if */
+} /* dimmer_deinit */
+
+
+static int buildChannelBuffers(struct ChannelBuffers *set, int chan,
+                               int universes, __boolean sharedFrames)
+/*
+ * Allocate a whole channel layout's worth of buffers into (set), all
+ *  dark, with no fades, and touch nothing in use.
+ *
+ *    params : set          == where to put them.
+ *             chan         == channels in the layout.
+ *             universes    == universes they're spread over.
+ *             sharedFrames == __true if the frames will be the device
+ *                              process's; they're attached later.
+ *   returns : -1 if out of memory, 0 on success. Either way, whatever
+ *              was allocated is in (set), for freeChannelBuffers().
+ */
+{
+    int stride = universes * DIMMER_UNIVERSE_SIZE;
+    int i;
+
+    memset(set, '\0', sizeof (struct ChannelBuffers));
+    set->levelStride = stride;
+    set->rawLevels = allocLevels(stride);
+    set->cookedLevels = allocLevels(stride);
+    set->subMix = allocLevels(stride);
+    set->mergeModes = allocLevels(stride);   /* zeroed is all HTP. */
+    set->dimmerCurves = allocLevels(stride);   /* and all linear. */
+    set->changeMaps = allocChangeMaps(stride);
+    set->fadeTable = malloc(sizeof (struct ChannelFadeStatus) * chan);
+    set->fadeHeap = malloc(sizeof (struct ChannelFadeStatus *) * chan);
+    set->universeSlots = malloc(sizeof (int) * universes);
+
+    if ((set->rawLevels == NULL) || (set->cookedLevels == NULL) ||
+        (set->subMix == NULL) || (set->mergeModes == NULL) ||
+        (set->dimmerCurves == NULL) || (set->changeMaps == NULL) ||
+        (set->fadeTable == NULL) || (set->fadeHeap == NULL) ||
+        (set->universeSlots == NULL) ||
+        (allocFadeArrays(&set->fadeArrays, chan) == -1))
+        return(-1);
+
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if ((sources[i].inUse) &&
+            (allocSourceLevels(&set->sourceLevels[i],
+                               &set->sourceStamps[i], stride) == -1))
+            return(-1);
+    } /* for */
+
+    memset(set->fadeTable, '\0', sizeof (struct ChannelFadeStatus) * chan);
+    for (i = 0; i < chan; i++)
+    {
+        set->fadeTable[i].channel = i;
+        set->fadeTable[i].heapIndex = -1;
+        set->fadeTable[i].activeIndex = -1;
+    } /* for */
+
+    for (i = 0; i < universes; i++)
+        set->universeSlots[i] = DIMMER_MIN_UNIVERSE_SLOTS;
+
+    if ((!sharedFrames) && (frameExchangeInit(&set->frames, stride) == -1))
+        return(-1);
+
+    return(0);
+} /* buildChannelBuffers */
+
+
+static struct PatchMap *resizePatchMap(const struct PatchMap *old, int chan)
+/*
+ * (old), fitted to (chan) channels: patches from or to channels past the
+ *  end are dropped, and any channel (old) didn't have drives the dimmer
+ *  of the same number. Caller holds patchLock.
+ *
+ *    params : old  == map to fit. NULL for one-to-one.
+ *             chan == channels in the new map.
+ *   returns : the new map, NULL if out of memory.
+ */
+{
+    int keep = (old == NULL) ? 0 : old->numChannels;
+    struct PatchMap *map;
+    int count;
+    int n = 0;
+    int c;
+    int i;
+
+    if (keep > chan)
+        keep = chan;
+
+    count = chan - keep;
+    for (i = 0; (keep > 0) && (i < old->first[keep]); i++)
+    {
+        if (old->dimmers[i] < chan)
+            count++;
+    } /* for */
+
+    map = allocPatchMap(chan, count);
+    if (map == NULL)
+        return(NULL);
+
+    for (c = 0; c < chan; c++)
+    {
+        map->first[c] = n;
+        if (c >= keep)
+        {
+            map->dimmers[n] = c;
+            map->proportions[n++] = 255;
+            continue;
+        } /* if */
+
+        for (i = old->first[c]; i < old->first[c + 1]; i++)
+        {
+            if (old->dimmers[i] < chan)
+            {
+                map->dimmers[n] = old->dimmers[i];
+                map->proportions[n++] = old->proportions[i];
+            } /* if */
+        } /* for */
+    } /* for */
+
+    map->first[chan] = n;
+    return(map);
+} /* resizePatchMap */
+
+
+static void clipSubmasters(int chan)
+/*
+ * Drop whatever part of each recorded look lies past (chan) channels.
+ *  The faders stay where they are.
+ */
+{
+    struct Submaster *sub;
+    int i;
+
+    for (i = 0; i < DIMMER_MAX_SUBMASTERS; i++)
+    {
+        sub = &submasters[i];
+        if (sub->firstChannel + sub->channelCount <= chan)
+            continue;
+
+        if (sub->firstChannel < chan)
+            sub->channelCount = chan - sub->firstChannel;
+        else
+        {
+            free(sub->levels);
+            sub->levels = NULL;
+            sub->firstChannel = sub->channelCount = 0;
+        } /* else */
+    } /* for */
+} /* clipSubmasters */
+
+
+static void carryChannels(struct ChannelBuffers *old, int oldChan, int chan)
+/*
+ * Copy everything about the channels both layouts have from the buffers
+ *  just swapped out to the ones just swapped in: every source's levels,
+ *  merge modes, and fades, running or still waiting out their delays.
+ *  Running fades keep their place, since fade ticks don't change. Caller
+ *  must hold fadeLock.
+ *
+ *    params : old     == the buffers swapped out.
+ *             oldChan == channels they were for.
+ *             chan    == channels the ones in use are for.
+ *   returns : void.
+ */
+{
+    struct ChannelFadeStatus *fadePtr;
+    int keep = (oldChan < chan) ? oldChan : chan;
+    int from;
+    int to;
+    int i;
+
+    if (old->levelStride == 0)
+        return;   /* there was nothing before. */
+
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if ((sources[i].inUse) && (old->sourceLevels[i] != NULL))
+        {
+            memcpy(sources[i].levels, old->sourceLevels[i], keep);
+            memcpy(sources[i].stamps, old->sourceStamps[i],
+                   sizeof (unsigned long long) * keep);
+        } /* if */
+    } /* for */
+
+    memcpy(rawLevels, old->rawLevels, keep);
+    memcpy(mergeModes, old->mergeModes, keep);
+    memcpy(dimmerCurves, old->dimmerCurves, keep);
+    ltpChannelCount = curvedChannelCount = 0;
+    for (i = 0; i < keep; i++)
+    {
+        if (mergeModes[i] == DIMMER_MERGE_LTP)
+            ltpChannelCount++;
+        if (dimmerCurves[i] != DIMMER_CURVE_LINEAR)
+            curvedChannelCount++;
+    } /* for */
+
+    for (i = 0; i < old->fadeHeapSize; i++)
+    {
+        if ((int) old->fadeHeap[i]->channel < chan)
+        {
+            fadePtr = &fadeTable[old->fadeHeap[i]->channel];
+            memcpy(fadePtr, old->fadeHeap[i], sizeof (*fadePtr));
+            heapInsert(fadePtr);
+        } /* if */
+    } /* for */
+
+    for (from = 0; from < old->activeFadeCount; from++)
+    {
+        i = old->fadeArrays.channel[from];
+        if (i >= chan)
+            continue;
+
+        to = activeFadeCount++;
+        fadePtr = &fadeTable[i];
+        memcpy(fadePtr, &old->fadeTable[i], sizeof (*fadePtr));
+        fadePtr->activeIndex = to;
+        fadeArrays.channel[to] = i;
+        fadeArrays.startLevel[to] = old->fadeArrays.startLevel[from];
+        fadeArrays.endLevel[to] = old->fadeArrays.endLevel[from];
+        fadeArrays.startTime[to] = old->fadeArrays.startTime[from];
+        fadeArrays.duration[to] = old->fadeArrays.duration[from];
+        fadeArrays.invDuration[to] = old->fadeArrays.invDuration[from];
+        fadeArrays.curve[to] = old->fadeArrays.curve[from];
+    } /* for */
+} /* carryChannels */
+
+
+static int installChannelBuffers(struct ChannelBuffers *set,
+                                 struct PatchMap *map,
+                                 struct DimmerDeviceFunctions *funcs,
+                                 const struct DimmerDeviceInfo *info)
+/*
+ * The guts of installChannelLayout(): swap in (set) and (map),
+ *  carry everything across, and hand the device a first frame that
+ *  looks just like the last. Caller must hold fadeLock and patchLock,
+ *  with output paused, or have the threads stopped.
+ *
+ *    params : set, map    == the new layout. (set) gets the old one.
+ *             funcs, info == the device it's for.
+ *   returns : 0 on success, else an errno value, and nothing changed.
+ */
+{
+    int oldChan = devInfo.numChannels;
+    int chan = info->numChannels;
+    __boolean sharedFrames = (funcs == &daemon_funcs) ? __true : __false;
+    int i;
+
+        /* any source made since the set was built needs buffers, too. */
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if ((sources[i].inUse) && (set->sourceLevels[i] == NULL) &&
+            (allocSourceLevels(&set->sourceLevels[i], &set->sourceStamps[i],
+                               set->levelStride) == -1))
+            return(ENOMEM);
+    } /* for */
+
+    if ((sharedFrames) &&
+        (pcAttachFrames(&set->frames, set->levelStride) == -1))
+    {
+            /* remapping let go of any frames we had there, too. */
+        if (usingDaemon())
+            frameExchangeFree(&frames);
+        return(errno);
+    } /* if */
+
+    swapChannelBuffers(set, chan);
+    activeModFuncs = funcs;
+    memcpy(&devInfo, info, sizeof (struct DimmerDeviceInfo));
+    publishPatchMap(map);
+    carryChannels(set, oldChan, chan);
+    clipSubmasters(chan);
+
+    if (set->levelStride == 0)
+        fadeEpoch = monotonicNow();
+    longestUniverse = DIMMER_MIN_UNIVERSE_SLOTS;
+    slotsChanged++;
+    retuneFrameRate();
+
+        /*
+         * If we just attached to a device process that kept the lights
+         *  up, and had nothing of our own yet, pick up where it is instead
+         *  of blacking everything out.
+         */
+    if ((set->levelStride == 0) && (sharedFrames) &&
+        (pcCurrentLevels(sources[0].levels, levelStride) == 0))
+        mergeRange(0, chan);
+    remixSubmasters(0, chan);   /* and recook everything. */
+
+        /* so the device never sees the new buffers dark. */
+    if (frames.buffers[0] != NULL)
+    {
+        memset(frameChanges[frames.back], 0xFF, changeMapSize);
+        memcpy(frameExchangeBack(&frames), cookedLevels, frames.size);
+        frameExchangePublish(&frames);
+    } /* if */
+
+    return(0);
+} /* installChannelBuffers */
+
+
+static int buildChannelLayout(struct ChannelLayout *layout,
+                              struct DimmerDeviceFunctions *funcs,
+                              const struct DimmerDeviceInfo *info)
+/*
+ * The first half of making the channel buffers match a device, needed
+ *  after a change in duplexing or after selecting a dimming device:
+ *  allocate a whole new set, and a patch map to fit, without touching
+ *  anything in use. Output carries on meanwhile. installChannelLayout()
+ *  swaps it in; freeChannelLayout() cleans up either way.
+ *
+ *     params : layout == filled in.
+ *              funcs  == device module the buffers are for.
+ *              info   == what that module says about itself.
+ *    returns : -1 on error, 0 on success. (errno) set on error.
+ *      errno : ENOMEM (couldn't allocate new buffers.)
+ */
+{
+    memset(layout, '\0', sizeof (struct ChannelLayout));
+    layout->funcs = funcs;
+    memcpy(&layout->info, info, sizeof (struct DimmerDeviceInfo));
+
+    if (!sources[0].inUse)
+    {
+        sources[0].inUse = __true;
+        strcpy(sources[0].name, "application");
+    } /* if */
+
+    pthread_mutex_lock(&patchLock);
+    layout->map = resizePatchMap(patchMap, info->numChannels);
+    layout->patchEpoch = (patchMap == NULL) ? 0 : patchMap->epoch;
+    pthread_mutex_unlock(&patchLock);
+
+    if ((layout->map == NULL) ||
+        (buildChannelBuffers(&layout->set, info->numChannels,
+                             info->numUniverses,
+                             (funcs == &daemon_funcs)) == -1))
+    {
+        errno = ENOMEM;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* buildChannelLayout */
+
+
+static int installChannelLayout(struct ChannelLayout *layout)
+/*
+ * The second half: swap in what buildChannelLayout() made, carrying
+ *  every level, merge mode, patch, submaster and fade across for the
+ *  channels both layouts have, and make (layout)'s device the active
+ *  one. Fades keep running throughout. Call it with output paused; see
+ *  pauseOutput(). Afterwards, (layout) holds the old buffers.
+ *
+ *     params : layout == from buildChannelLayout().
+ *    returns : -1 on error, 0 on success. (errno) set on error. On
+ *               error, nothing has changed.
+ *      errno : EAGAIN (couldn't lock the fade thread.)
+ *              ENOMEM (couldn't allocate new buffers.)
+ *              anything pcAttachFrames() sets.
+ */
+{
+    struct PatchMap *map;
+    int err = 0;
+
+    pthread_mutex_lock(&patchLock);   /* so no repatch is lost. */
+
+        /* somebody repatched since it was built; rare, so redo it here. */
+    if ((patchMap != NULL) && (patchMap->epoch != layout->patchEpoch))
+    {
+        map = resizePatchMap(patchMap, layout->info.numChannels);
+        if (map != NULL)
+        {
+            free(layout->map);
+            layout->map = map;
+            layout->patchEpoch = patchMap->epoch;
+        } /* if */
+        else
+            err = ENOMEM;
+    } /* if */
+
+    if (err != 0)
+        ;   /* leave it. */
+    else if ((threadLiveFlag) && (lockFades() != 0))
+        err = EAGAIN;
+    else
+    {
+        err = installChannelBuffers(&layout->set, layout->map,
+                                    layout->funcs, &layout->info);
+        if (err == 0)
+            layout->map = NULL;   /* it's the one in use now. */
+        if (threadLiveFlag)
+            pthread_mutex_unlock(&fadeLock);
+    } /* else */
+
+    pthread_mutex_unlock(&patchLock);
+
+    if (err != 0)
+    {
+        errno = err;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* installChannelLayout */
+
+
+static void freeChannelLayout(struct ChannelLayout *layout)
+/*
+ * Free whatever (layout) holds: the new buffers if they never went in,
+ *  the old ones if they did. Nothing can be using either by now.
+ */
+{
+    freeChannelBuffers(&layout->set);
+    free(layout->map);
+    layout->map = NULL;
+} /* freeChannelLayout */
+
+
+int dimmer_device_available(char *devName, int *devID)
+/*
+ * In the name of code reuse, this function will check if
+ *  a given device is available for use. This could be
+ *  accomplished on the application level by calling
+ *  dimmer_query_system(), and then checking against
+ *  devsAvailable and devCount. But we'll make your life easy. :)
+ *
+ *     params : devName == name of device module to check for availability.
+ *              devID == filled in with ID number of device module.
+ *    returns : zero if not available, non-zero if exists.
+ */
+{
+    int i;
+    int curDevID;
+    int retVal = 0;
+    char buffer[100];
+
+    for (i = 0; (i < sysInfo.devCount) && (!retVal); i++)
+    {
+        curDevID = sysInfo.devsAvailable[i];
+        devFunctions[curDevID]->queryModuleName(buffer, sizeof (buffer));
+        if (strcmp(buffer, devName) == 0)
+        {
+            *devID = curDevID;
+            retVal = -1;
+        } /* if */
+    } /* for */
+
+    return(retVal);
+} /* dimmer_device_available */
+
+
+static int queryDeviceInfo(struct DimmerDeviceFunctions *funcs,
+                           struct DimmerDeviceInfo *info)
+/*
+ * What (funcs) says about its device, with the universes filled in for
+ *  modules too old to report them.
+ *
+ *   params : funcs == device module to ask.
+ *            info  == filled in.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : Whatever device function wants to set.
+ */
+{
+    int retVal = funcs->queryDevice(info);
+    int universes;
+
+        /* older modules only know channels; cover them in universes. */
+    if ((retVal != -1) && (info->numChannels <= 0))
+        info->numChannels = info->numUniverses * DIMMER_UNIVERSE_SIZE;
+
+    universes = (info->numChannels + (DIMMER_UNIVERSE_SIZE - 1)) /
+                    DIMMER_UNIVERSE_SIZE;
+    if (universes < 1)
+        universes = 1;
+    if (info->numUniverses < universes)
+        info->numUniverses = universes;
+
+    return(retVal);
+} /* queryDeviceInfo */
+
+
+int dimmer_select_device(char *devName)
+/*
+ * Use this function to switch to a device other than the default.
+ *  You can find out the default through the dimmer_query_system()
+ *  call (returnValue.currentDevID). This function call is
+ *  unnecessary if you use the autoInit feature of dimmer_init() and
+ *  don't care what specific protocol you use.
+ *
+ * Switching devices live is fine: fades keep running, and every channel
+ *  both devices have keeps its levels, patch and submasters. The old
+ *  device keeps sending until the new one takes over.
+ *
+ *      params : devName == device module name to select.
+ *     returns : -1 on error, 0 on success. errno set.
+ *       errno : ENODEV (bogus device ID number).
+ *               anything else device initialization chooses to set.
+ */
+{
+    struct DimmerDeviceFunctions *oldFuncs = activeModFuncs;
+    struct DimmerDeviceFunctions *newFuncs;
+    struct DimmerDeviceInfo info;
+    struct ChannelLayout layout;
+    int retVal = -1;
+    int devModID;
+    int err;
+
+    if (!dimmer_device_available(devName, &devModID))
+    {
+        errno = ENODEV;
+        return(-1);
+    } /* if */
+
+    newFuncs = devFunctions[devModID];
+    if ((newFuncs != oldFuncs) && (newFuncs->initialize() == -1))
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_INITIALIZE);
+        return(-1);
+    } /* if */
+
+        /*
+         * The old device keeps the lights up while the new buffers are
+         *  built, and only stands aside for the swap.
+         */
+    memset(&layout, '\0', sizeof (layout));
+    if ((queryDeviceInfo(newFuncs, &info) != -1) &&
+        (buildChannelLayout(&layout, newFuncs, &info) != -1))
+    {
+        pauseOutput();
+        if (installChannelLayout(&layout) != -1)
+        {
+            sysInfo.activeDevID = devModID;
+            if ((oldFuncs != NULL) && (oldFuncs != newFuncs))
+                oldFuncs->deinitialize();
+            retVal = 0;  /* success. */
+        } /* if */
+        resumeOutput();
+    } /* if */
+
+    err = errno;
+    freeChannelLayout(&layout);
+    if ((retVal == -1) && (newFuncs != oldFuncs))
+        newFuncs->deinitialize();
+    errno = err;
+
+    if (retVal == 0)
+    {
+        setRefreshRate((devInfo.refreshHz > 0) ?
+                          devInfo.refreshHz : DEFAULT_REFRESH_HZ);
+    } /* if */
+
+    return(retVal);
+} /* dimmer_select_device */
+
+
+int dimmer_query_system(struct DimmerSystemInfo *info)
+/*
+ * Gets details on the system in relation to dimmer control.
+ *
+ *   params : *info == ptr to structure to fill with information.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (dimmer_init() was never called).
+ */
+{
+    int retVal = 0;
+
+    if (dimmerLibInitialized)
+        memcpy(info, &sysInfo, sizeof (struct DimmerSystemInfo));
+    else
+    {
+        retVal = -1;
+        errno = EPERM;
+    } /* else */
+
+    return(retVal);
+} /* dimmer_query_system */
+
+
+int dimmer_query_device(struct DimmerDeviceInfo *info)
+/*
+ * Get information regarding the currently selected dimming device.
+ *
+ *   params : *info == ptr to structure to fill with information.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : ENODEV (no dimmer device is selected).
+ *            Whatever device function wants to set.
+ */
+{
+    int retVal = -1;
+
+    if (activeModFuncs == NULL)
+        errno = ENODEV;
+    else
+        retVal = queryDeviceInfo(activeModFuncs, info);
+
+    return(retVal);
+} /* dimmer_query_device */
+
+
+static int queryDuplexInfo(__boolean wantDuplex,
+                           struct DimmerDeviceInfo *info)
+/*
+ * Find out what the active device would look like duplexed (or not), by
+ *  switching it over and straight back with output standing aside. That
+ *  does no allocating, so the pause is short.
+ *
+ *     params : wantDuplex == the mode to ask about.
+ *              info       == filled in.
+ *    returns : -1 on error, 0 on success. (errno) set on error.
+ *      errno : anything the device module or queryDeviceInfo() sets.
+ */
+{
+    int retVal;
+    int err;
+
+    pauseOutput();
+    retVal = activeModFuncs->setDuplexMode(wantDuplex);
+    if (retVal != -1)
+    {
+        retVal = queryDeviceInfo(activeModFuncs, info);
+        err = errno;
+        activeModFuncs->setDuplexMode(duplexEnabled);
+        errno = err;
+    } /* if */
+    resumeOutput();
+
+    return(retVal);
+} /* queryDuplexInfo */
+
+
+int dimmer_set_duplex_mode(int shouldSet)
+/*
+ * Some dimming hardware has multiple outputs. If possible, this
+ *  function call instructs that hardware on how to treat the
+ *  outputs. This call can set the hardware to attempt to duplex
+ *  (use two separate outlets to double the number of accessible
+ *  channels) the outputs, or send the same signal down both.
+ *
+ * See the (potentially nonexistant) documentation for a better
+ *  explanation of duplexing.
+ *
+ * As with dimmer_select_device(), everything carries over to the new
+ *  channel layout without stopping fades.
+ *
+ *     params : shouldSet == 1 to attempt duplexing, 0 to disable duplexing.
+ *    returns : -1 if unsuccessful, 0 on success. (errno) set on error.
+ *      errno : ENODEV  (no dimmer device is selected).
+ *              ENOSYS  (device can't duplex).
+ */
+{
+    int retVal = -1;
+    __boolean wantDuplex = (shouldSet == 0) ? __false : __true;
+    struct DimmerDeviceInfo info;
+    struct ChannelLayout layout;
+    int err;
+
+    if (activeModFuncs == NULL)
+        errno = ENODEV;
+    else if (duplexEnabled == wantDuplex)
+        retVal = 0;
+    else
+    {
+            /*
+             * The device only changes its layout while output stands
+             *  aside, since the device thread would otherwise hand it a
+             *  frame of the wrong size; the buffers are built in between,
+             *  while it still runs the old way. Fades carry on throughout.
+             */
+        memset(&layout, '\0', sizeof (layout));
+        if ((queryDuplexInfo(wantDuplex, &info) != -1) &&
+            (buildChannelLayout(&layout, activeModFuncs, &info) != -1))
+        {
+            pauseOutput();
+            if ((activeModFuncs->setDuplexMode(wantDuplex) != -1) &&
+                (installChannelLayout(&layout) != -1))
+            {
+                duplexEnabled = wantDuplex;
+                retVal = 0;
+            } /* if */
+            else
+            {
+                err = errno;
+                activeModFuncs->setDuplexMode(duplexEnabled);
+                errno = err;
+            } /* else */
+            resumeOutput();
+        } /* if */
+
+        err = errno;
+        freeChannelLayout(&layout);
+        errno = err;
+    } /* else */
+
+    return(retVal);
+} /* dimmer_set_duplex_mode */
+
+
+
+static inline void initChannelFadeStatus(struct ChannelFadeStatus *fadePtr,
+                                         unsigned char intensity,
+                                         nanotime_t duration,
+                                         nanotime_t startTime,
+                                         int curve)
+/*
+ * This is called for a queued dimmer_channel_fade_ex() to (re)initialize
+ *  a ChannelFadeStatus structure and hand it to the fading thread. All
+ *  parameters were checked before the fade was queued, so no sanity
+ *  checks should be necessary here. Caller must hold fadeLock.
+ *
+ *     params : fadePtr   == struct to initialize.
+ *              intensity == raw level to fade to.
+ *              duration  == time to fade over.
+ *              startTime == when the level starts moving.
+ *              curve     == DIMMER_FADE_* shape.
+ *    returns : void.
+ */
+{
+        /* forget whatever this channel was doing before... */
+    if (fadePtr->heapIndex != -1)
+        heapRemove(fadePtr);
+    if (fadePtr->activeIndex != -1)
+        activeRemove(fadePtr);
+
+    fadePtr->destinationLevel = intensity;
+    fadePtr->curve = (unsigned char) curve;
+    fadePtr->duration = duration;
+    fadePtr->startTime = startTime;
+
+    if (startTime > monotonicNow())
+    {
+        fadePtr->fadeActive = __true;
+        heapInsert(fadePtr);   /* starting level is picked up later. */
+    } /* if */
+    else if (sources[0].levels[fadePtr->channel] == intensity)
+    {
+        fadePtr->fadeActive = __false;   /* already there. */
+    } /* else if */
+    else
+    {
+        fadePtr->fadeActive = __true;
+        startChannelFade(fadePtr);
+    } /* else */
+} /* initChannelFadeStatus */
+
+
+static void applyCommand(const struct ChannelCommand *cmd)
+/*
+ * Carry out one queued set or fade, on every dimmer the channel drives.
+ *  Caller must hold fadeLock. The device may have changed since it was
+ *  queued, so it's checked again.
+ */
+{
+    const struct PatchMap *map = currentPatchMap();
+    int level;
+    int i;
+
+    if ((cmd->channel >= devInfo.numChannels) ||
+        (!sources[cmd->source].inUse))
+        return;
+
+    for (i = map->first[cmd->channel]; i < map->first[cmd->channel + 1]; i++)
+    {
+        level = scale255(cmd->level, map->proportions[i]);
+        if (cmd->type == COMMAND_SET)
+            setSourceLevel(cmd->source, map->dimmers[i], level);
+        else
+        {
+            initChannelFadeStatus(&fadeTable[map->dimmers[i]], level,
+                                  cmd->duration, cmd->startTime, cmd->curve);
+        } /* else */
+    } /* for */
+} /* applyCommand */
+
+
+static void drainCommands(void)
+/*
+ * Apply everything the application's threads have queued, each thread's
+ *  in the order it queued them. Caller must hold fadeLock. If it's not
+ *  the fade thread, that needs a nudge to notice any new fades.
+ */
+{
+    if ((commandDrain(applyCommand) > 0) &&
+        (!pthread_equal(pthread_self(), fadeThread)))
+        wakeFadeThread();
+} /* drainCommands */
+
+
+static void lockTaken(void)
+/*
+ * Caller just took fadeLock: catch up on whatever happened while we
+ *  waited for it.
+ */
+{
+    adoptPatchMap();
+    drainCommands();
+} /* lockTaken */
+
+
+static int queueCommand(struct ChannelCommand *cmd)
+/*
+ * Hand a set or fade to the fade thread, which applies it before its
+ *  next frame; callers never wait on each other or on fadeLock. Without
+ *  a fade thread to drain it, or if this thread has a whole ring queued
+ *  already, it's applied here and now instead, under the lock.
+ *
+ *    params : cmd == command to carry out. It must already be checked.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    if ((threadLiveFlag) && (commandPush(cmd) == 0))
+    {
+        frameChanged();   /* wakes the fade thread. */
+        return(0);
+    } /* if */
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    applyCommand(cmd);
+    pthread_mutex_unlock(&fadeLock);
+    wakeFadeThread();
+    return(0);
+} /* queueCommand */
+
+
+int dimmer_channel_set(unsigned int channel, unsigned char intensity)
+/*
+ * Set a specific channel to a specific intensity. Any number of threads
+ *  can do this at once without waiting on each other; the new level is
+ *  queued, and goes out with the next frame. One thread's sets take
+ *  effect in the order it made them; sets racing in from different
+ *  threads land in no particular order.
+ *
+ *   params : channel == see above.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (channel out of range, or no dimmer device selected).
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct ChannelCommand cmd;
+
+    if (channel >= devInfo.numChannels)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    memset(&cmd, '\0', sizeof (cmd));
+    cmd.type = COMMAND_SET;
+    cmd.channel = channel;
+    cmd.level = intensity;
+    return(queueCommand(&cmd));
+} /* dimmer_channel_set */
+
+
+int dimmer_channel_set_levels(unsigned int first, unsigned char *levels,
+                              int count)
+/*
+ * Set a run of channels at once, the way dimmer_channel_set() sets one.
+ *  They're patched and remerged in one pass, and all reach the device
+ *  in the same frame.
+ *
+ *   params : first  == first channel to set.
+ *            levels == (count) 0-255 levels, for channels (first) onward.
+ *            count  == number of channels to set.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (channel range out of bounds, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    return(dimmer_source_set_levels(0, first, levels, count));
+} /* dimmer_channel_set_levels */
+
+
+int dimmer_channel_set_list(unsigned int *channels, unsigned char *levels,
+                            int count)
+/*
+ * Set any number of channels, in any order, at once. Otherwise, this
+ *  is dimmer_channel_set_levels(). If any channel is out of range,
+ *  nothing is set.
+ *
+ *   params : channels == (count) channel numbers.
+ *            levels   == (count) levels, one for each of (channels).
+ *            count    == number of channels to set.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (a channel out of range, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct LevelSource *src = &sources[0];
+    const struct PatchMap *map;
+    unsigned long long stamp;
+    int lo = 0x7FFFFFFF;
+    int hi = -1;
+    int top = -1;
+    int patched;
+    int i;
+    int j;
+
+    if ((count < 0) || (!src->inUse))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    for (i = 0; i < count; i++)
+    {
+        if (channels[i] >= devInfo.numChannels)
+        {
+            errno = EINVAL;
+            return(-1);
+        } /* if */
+        else if ((int) channels[i] > top)
+            top = channels[i];
+    } /* for */
+
+    if (count == 0)
+        return(0);
+
+        /* the fade thread can't publish half of this while we hold it. */
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    map = currentPatchMap();
+    if (top >= map->numChannels)
+    {
+        pthread_mutex_unlock(&fadeLock);   /* the device just shrank. */
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+    stamp = ++mergeClock;
+    for (i = 0; i < count; i++)
+    {
+        for (j = map->first[channels[i]]; j < map->first[channels[i] + 1]; j++)
+        {
+            patched = map->dimmers[j];
+            src->levels[patched] = scale255(levels[i], map->proportions[j]);
+            src->stamps[patched] = stamp;
+            if (patched < lo)
+                lo = patched;
+            if (patched > hi)
+                hi = patched;
+        } /* for */
+    } /* for */
+
+    if (hi >= 0)
+        mergeRange(lo, (hi - lo) + 1);
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* dimmer_channel_set_list */
+
+
+int dimmer_begin_frame(void)
+/*
+ * Start a batch of changes that should all show up at once. Nothing
+ *  set, faded, patched or mastered from here until the matching
+ *  dimmer_commit_frame() is sent to the device; then all of it goes out
+ *  in the same frame. Until then, the device keeps getting the last
+ *  frame from before the batch, so keep batches short. Batches nest, and
+ *  any thread may start one; output resumes when the last one commits.
+ *
+ *   params : void.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (dimmer_init() was never called.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    if (!dimmerLibInitialized)
+    {
+        errno = EPERM;
+        return(-1);
+    } /* if */
+
+    return(holdFrame());
+} /* dimmer_begin_frame */
+
+
+int dimmer_commit_frame(void)
+/*
+ * End a batch started with dimmer_begin_frame(). If it was the last
+ *  one open, everything changed since the first of them goes to the
+ *  device in one frame.
+ *
+ *   params : void.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (dimmer_init() was never called.)
+ *            EINVAL (no batch was open.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    if (!dimmerLibInitialized)
+    {
+        errno = EPERM;
+        return(-1);
+    } /* if */
+
+    return(releaseFrame());
+} /* dimmer_commit_frame */
+
+
+
+int dimmer_channel_fade(unsigned int channel,
+                        unsigned char intensity,
+                        double seconds)
+/*
+ * Fade a channel. Even though the fade may take many seconds,
+ *  this call does not block. The fade is passed off to another
+ *  thread to be processed. This is the same as calling
+ *  dimmer_channel_fade_ex() with no delay and a linear curve.
+ *
+ *      params : channel = channel # to fade.
+ *               intensity = 0-255 level to fade light to.
+ *               seconds = number of seconds (or fractions thereof) that
+ *                         it should take for light to reach (intensity).
+ *      returns : -1 on error, 0 on success. (errno) set on error.
+ *        errno : EINVAL (bad agruments.)
+ *                EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    return(dimmer_channel_fade_ex(channel, intensity, seconds,
+                                  0.0, DIMMER_FADE_LINEAR));
+} /* dimmer_channel_fade */
+
+
+int dimmer_channel_fade_ex(unsigned int channel,
+                           unsigned char intensity,
+                           double seconds,
+                           double delay,
+                           int curve)
+/*
+ * Fade a channel, with more control than dimmer_channel_fade() gives.
+ *  The channel's level is computed from elapsed time every frame, so
+ *  fast fades jump as many steps per frame as they need to, and every
+ *  fade finishes on time. Starting a new fade on a channel replaces
+ *  any fade already running or waiting on it.
+ *
+ *      params : channel = channel # to fade.
+ *               intensity = 0-255 level to fade light to.
+ *               seconds = number of seconds (or fractions thereof) that
+ *                         it should take for light to reach (intensity).
+ *               delay = seconds to wait before the light starts moving.
+ *                       The fade starts from wherever the channel is at
+ *                       the end of the delay.
+ *               curve = one of the DIMMER_FADE_* constants.
+ *      returns : -1 on error, 0 on success. (errno) set on error.
+ *        errno : EINVAL (bad agruments.)
+ *                EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct ChannelCommand cmd;
+
+        /* sanity checks... */
+    if ((channel >= devInfo.numChannels) || (seconds < 0.0) || (delay < 0.0) ||
+        (curve < DIMMER_FADE_LINEAR) || (curve > DIMMER_FADE_SCURVE))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+        /* the clock starts now, not when the fade thread gets to it. */
+    memset(&cmd, '\0', sizeof (cmd));
+    cmd.type = COMMAND_FADE;
+    cmd.channel = channel;
+    cmd.level = intensity;
+    cmd.curve = (unsigned char) curve;
+    cmd.duration = (nanotime_t) (seconds * 1000000000.0);
+    cmd.startTime = monotonicNow() + (nanotime_t) (delay * 1000000000.0);
+    return(queueCommand(&cmd));
+} /* dimmer_channel_fade_ex */
+
+
+int dimmer_toggle_blackout(int shouldToggleOn)
+/*
+ * First call to this bumps all channels to zero.
+ * Next call restores (by bump) all channels to where they where before
+ *  the blackout. Any other attempts to modify a channel's intensity will
+ *  be noted, but the change will not be made during blackout.
+ *
+ *    params : shouldToggleOn == nonZero to start blackout, zero to stop.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    __boolean wantBlackOut = (shouldToggleOn == 0) ? __false : __true;
+
+    if (cookedLevels == NULL)   /* no device yet; just remember it. */
+        blackOutEnabled = wantBlackOut;
+    else
+    {
+        if (lockFades() != 0)
+        {
+            errno = EAGAIN;
+            return(-1);
+        } /* if */
+
+            /* Blackout just cooks with a master of zero. */
+        if (blackOutEnabled != wantBlackOut)
+        {
+            blackOutEnabled = wantBlackOut;
+            cookRange(0, devInfo.numChannels);
+        } /* if */
+        pthread_mutex_unlock(&fadeLock);
+    } /* else */
+
+    return(0);
+} /* dimmer_toggle_blackout */
+
+
+static struct PatchMap *repatchChannel(const struct PatchMap *old,
+                                       int channel, int *dimmers,
+                                       unsigned char *proportions, int count)
+/*
+ * A copy of (old), but with (channel) driving (dimmers) instead of
+ *  whatever it drove before.
+ *
+ *    params : old         == map to copy. Caller holds patchLock.
+ *             channel     == channel to repatch.
+ *             dimmers     == (count) dimmers it'll drive.
+ *             proportions == how much of each; NULL for full.
+ *   returns : the new map, NULL if out of memory.
+ */
+{
+    int before = old->first[channel];
+    int after = old->first[channel + 1];
+    int rest = old->numPatches - after;
+    int change = count - (after - before);
+    struct PatchMap *map;
+    int i;
+
+    map = allocPatchMap(old->numChannels, old->numPatches + change);
+    if (map == NULL)
+        return(NULL);
+
+    memcpy(map->first, old->first, sizeof (int) * (channel + 1));
+    for (i = channel + 1; i <= old->numChannels; i++)
+        map->first[i] = old->first[i] + change;
+
+    memcpy(map->dimmers, old->dimmers, sizeof (int) * before);
+    memcpy(map->dimmers + before, dimmers, sizeof (int) * count);
+    memcpy(map->dimmers + before + count, old->dimmers + after,
+           sizeof (int) * rest);
+
+    memcpy(map->proportions, old->proportions, before);
+    if (proportions == NULL)
+        memset(map->proportions + before, 255, count);
+    else
+        memcpy(map->proportions + before, proportions, count);
+    memcpy(map->proportions + before + count, old->proportions + after, rest);
+
+    return(map);
+} /* repatchChannel */
+
+
+int dimmer_channel_patch_ex(int channel, int *dimmers,
+                            unsigned char *proportions, int count)
+/*
+ * Patch one channel to any number of dimmers, each getting its own
+ *  proportion of the channel's level. This replaces whatever (channel)
+ *  drove before. Fades and output carry on while the new patch is
+ *  swapped in; it's used from the next level set, fade or frame on.
+ *  Dimmers the channel stops driving keep their levels until something
+ *  else sets them.
+ *
+ *    params : channel     == channel to patch.
+ *             dimmers     == (count) dimmers it'll drive.
+ *             proportions == (count) proportions, 255 being all of the
+ *                             channel's level. NULL for full on all.
+ *             count       == number of dimmers; 0 drives nothing.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad channel, dimmer or count.)
+ *             ENOMEM (out of memory.)
+ */
+{
+    struct PatchMap *map;
+    int err = EINVAL;
+    int i;
+
+    if ((!dimmerLibInitialized) || (count < 0) ||
+        ((count > 0) && (dimmers == NULL)))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    pthread_mutex_lock(&patchLock);
+
+    if ((patchMap != NULL) && (channel >= 0) &&
+        (channel < patchMap->numChannels))
+    {
+        for (i = 0; i < count; i++)
+        {
+            if ((dimmers[i] < 0) || (dimmers[i] >= patchMap->numChannels))
+                break;
+        } /* for */
+
+        if (i == count)
+        {
+            map = repatchChannel(patchMap, channel, dimmers,
+                                 proportions, count);
+            if (map == NULL)
+                err = ENOMEM;
+            else
+            {
+                publishPatchMap(map);
+                err = 0;
+            } /* else */
+        } /* if */
+    } /* if */
+
+    pthread_mutex_unlock(&patchLock);
+
+    if (err != 0)
+    {
+        errno = err;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* dimmer_channel_patch_ex */
+
+
+int dimmer_channel_patch(int channel, int patchTo)
+/*
+ * Define a channel patch. Any time access is attempted on
+ *  (channel), it'll actually use (patchTo) instead. See
+ *  dimmer_channel_patch_ex() to drive more than one dimmer.
+ *
+ *    params : channel == channel to patch.
+ *             patchTo == what (channel) will now access.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad channel or patchTo.)
+ *             ENOMEM (out of memory.)
+ */
+{
+    return(dimmer_channel_patch_ex(channel, &patchTo, NULL, 1));
+} /* dimmer_channel_patch */
+
+
+int dimmer_patch_load(struct DimmerPatch *patches, int count)
+/*
+ * Replace the whole patch at once, as dimmer_channel_patch_ex() would
+ *  for each channel in turn, but swapped in as one. A channel may appear
+ *  any number of times, and drives each dimmer it's listed with; a
+ *  channel that isn't listed drives nothing.
+ *
+ *    params : patches == (count) patches, in any order.
+ *             count   == number of patches.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad channel, dimmer or count.)
+ *             ENOMEM (out of memory.)
+ */
+{
+    struct PatchMap *map = NULL;
+    int *next;
+    int chan;
+    int i;
+
+    if ((!dimmerLibInitialized) || (count < 0) ||
+        ((count > 0) && (patches == NULL)))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    pthread_mutex_lock(&patchLock);
+
+    chan = (patchMap == NULL) ? 0 : patchMap->numChannels;
+    for (i = 0; i < count; i++)
+    {
+        if ((patches[i].channel < 0) || (patches[i].channel >= chan) ||
+            (patches[i].dimmer < 0) || (patches[i].dimmer >= chan))
+            break;
+    } /* for */
+
+    if ((chan == 0) || (i < count))
+    {
+        pthread_mutex_unlock(&patchLock);
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    map = allocPatchMap(chan, count);
+    next = (int *) malloc(sizeof (int) * chan);
+    if ((map == NULL) || (next == NULL))
+    {
+        pthread_mutex_unlock(&patchLock);
+        free(map);
+        free(next);
+        errno = ENOMEM;
+        return(-1);
+    } /* if */
+
+        /* count each channel's patches, then file them, in list order. */
+    memset(map->first, '\0', sizeof (int) * (chan + 1));
+    for (i = 0; i < count; i++)
+        map->first[patches[i].channel + 1]++;
+    for (i = 0; i < chan; i++)
+    {
+        map->first[i + 1] += map->first[i];
+        next[i] = map->first[i];
+    } /* for */
+
+    for (i = 0; i < count; i++)
+    {
+        map->dimmers[next[patches[i].channel]] = patches[i].dimmer;
+        map->proportions[next[patches[i].channel]++] = patches[i].proportion;
+    } /* for */
+
+    free(next);
+    publishPatchMap(map);
+    pthread_mutex_unlock(&patchLock);
+    return(0);
+} /* dimmer_patch_load */
+
+
+int dimmer_patch_reset(void)
+/*
+ * Put every channel back on the dimmer of the same number, at full.
+ *
+ *    params : void.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (library not initialized, or no device.)
+ *             ENOMEM (out of memory.)
+ */
+{
+    struct PatchMap *map;
+    int retVal = -1;
+
+    if (!dimmerLibInitialized)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    pthread_mutex_lock(&patchLock);
+    if (patchMap == NULL)
+        errno = EINVAL;
+    else if ((map = identityPatchMap(patchMap->numChannels)) == NULL)
+        errno = ENOMEM;
+    else
+    {
+        publishPatchMap(map);
+        retVal = 0;
+    } /* else */
+    pthread_mutex_unlock(&patchLock);
+
+    return(retVal);
+} /* dimmer_patch_reset */
+
+
+int dimmer_set_grand_master(int intensity)
+/*
+ * The grand master is a dimmer for all other dimmers. If you set
+ *  channel X to 100%, and the grand master to 80%, then channel X
+ *  will really only have an intensity of 80%. If channel X is set to
+ *  50% and the GM is at 80%, then channel X will really only have an
+ *  intensity of 40%. This affects every channel.
+ *
+ * Moving the grand master recooks every channel in one pass.
  *
- *     params : autoInit == if not zero, select the first device that
- *                          initializes successfully as the default device.
- *                          if zero, no devices initializations are attempted
- *                          by this function, and the default device is set to
- *                          (-1) (none of the above). This function returns an
- *                          error if this flag is set and either no devices
- *                          exist or no devices initialize. No error is
- *                          returned if this flag is not set and no devices
- *                          are usable.
- *    returns : -1 on error, 0 on success. (errno) is set on error.
- *      errno : EPERM (trying to call init more than once).
- *              EAGAIN (threads wouldn't spin.)
+ *    params : intensity == level (0 to 100) to set GM to.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (intensity out of range.)
+ *             EAGAIN (couldn't lock the fade thread.)
  */
 {
-    if (dimmerLibInitialized)
+    if ((intensity < 0) || (intensity > 100))
     {
-        errno = EPERM;
+        errno = EINVAL;
         return(-1);
     } /* if */
 
-    if (checkForDevices() <= 0)
+    if (cookedLevels == NULL)   /* no device yet; just remember it. */
+        grandMasterLevel = (unsigned char) (((intensity * 255) + 50) / 100);
+    else
     {
-        errno = ENODEV;
+        if (lockFades() != 0)
+        {
+            errno = EAGAIN;
+            return(-1);
+        } /* if */
+
+        grandMasterLevel = (unsigned char) (((intensity * 255) + 50) / 100);
+        cookRange(0, devInfo.numChannels);
+        pthread_mutex_unlock(&fadeLock);
+    } /* else */
+
+    return(0);
+} /* dimmer_set_grand_master */
+
+
+int dimmer_submaster_record(int sub, unsigned int *channels,
+                            unsigned char *levels, int count)
+/*
+ * Record a look into a submaster. A submaster holds levels for any set
+ *  of channels; pushing its fader up brings those channels up to their
+ *  recorded levels (scaled by the fader), highest-takes-precedence
+ *  against everything else. Recording replaces the sub's previous
+ *  contents, but leaves its fader where it is. Recording zero channels
+ *  empties the sub.
+ *
+ *    params : sub      == submaster number, 0 to DIMMER_MAX_SUBMASTERS - 1.
+ *             channels == (count) channel numbers.
+ *             levels   == (count) levels, one for each of (channels).
+ *             count    == number of channels in the look.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad sub, channel or count.)
+ *             ENOMEM (out of memory.)
+ *             EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct Submaster *subPtr;
+    const struct PatchMap *map;
+    unsigned char *buf = NULL;
+    int oldFirst;
+    int oldCount;
+    int lo = 0x7FFFFFFF;
+    int hi = -1;
+    int top = -1;
+    int patched;
+    int i;
+    int j;
+
+    if ((sub < 0) || (sub >= DIMMER_MAX_SUBMASTERS) || (count < 0) ||
+        (cookedLevels == NULL))
+    {
+        errno = EINVAL;
         return(-1);
     } /* if */
 
-    if (autoInit)
+    for (i = 0; i < count; i++)
     {
-        if (attemptAutoInit() == -1)
+        if (channels[i] >= devInfo.numChannels)
         {
-            errno = ENODEV;
+            errno = EINVAL;
             return(-1);
         } /* if */
+        else if ((int) channels[i] > top)
+            top = channels[i];
+    } /* for */
+
+        /* the patch can only be looked at with the lock held. */
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
     } /* if */
 
-    if (spinThreads() == -1)
+        /* find the span of patched channels this look covers... */
+    map = currentPatchMap();
+    if (top >= map->numChannels)
     {
-        deinitDevice();
+        pthread_mutex_unlock(&fadeLock);   /* the device just shrank. */
+        errno = EINVAL;
         return(-1);
     } /* if */
+    for (i = 0; i < count; i++)
+    {
+        for (j = map->first[channels[i]]; j < map->first[channels[i] + 1]; j++)
+        {
+            patched = map->dimmers[j];
+            if (patched < lo)
+                lo = patched;
+            if (patched > hi)
+                hi = patched;
+        } /* for */
+    } /* for */
 
-    atexit(dimmer_deinit);
+    if (hi >= 0)
+    {
+        buf = calloc(1, (hi - lo) + 1);
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&fadeLock);
+            errno = ENOMEM;
+            return(-1);
+        } /* if */
 
-    dimmerLibInitialized = __true;
+        for (i = 0; i < count; i++)
+        {
+            for (j = map->first[channels[i]]; j < map->first[channels[i] + 1];
+                 j++)
+            {
+                buf[map->dimmers[j] - lo] =
+                    (unsigned char) scale255(levels[i], map->proportions[j]);
+            } /* for */
+        } /* for */
+    } /* if */
+
+    subPtr = &submasters[sub];
+    oldFirst = subPtr->firstChannel;
+    oldCount = subPtr->channelCount;
+    if (subPtr->levels != NULL)
+        free(subPtr->levels);
+
+    subPtr->levels = buf;
+    subPtr->firstChannel = (hi >= 0) ? lo : 0;
+    subPtr->channelCount = (hi >= 0) ? (hi - lo) + 1 : 0;
+
+    if (oldCount > 0)
+        remixSubmasters(oldFirst, oldCount);
+    if (subPtr->channelCount > 0)
+        remixSubmasters(subPtr->firstChannel, subPtr->channelCount);
+
+    pthread_mutex_unlock(&fadeLock);
     return(0);
-} /* dimmer_init */
+} /* dimmer_submaster_record */
 
 
-void dimmer_deinit(void)
+int dimmer_submaster_set(int sub, unsigned char level)
 /*
- * This is called atexit() to clean up, but for flexibility, we
- *  set everything back to its default state.
+ * Move a submaster's fader. Only the channels the sub covers are
+ *  recooked.
  *
- *    params : void.
- *   returns : Always (0).
+ *    params : sub   == submaster number, 0 to DIMMER_MAX_SUBMASTERS - 1.
+ *             level == fader level, 0 to 255.
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad sub.)
+ *             EAGAIN (couldn't lock the fade thread.)
  */
 {
-    struct ChannelFadeStatus *list;
+    struct Submaster *subPtr;
 
-    if (dimmerLibInitialized)
+    if ((sub < 0) || (sub >= DIMMER_MAX_SUBMASTERS) || (cookedLevels == NULL))
     {
-        killThreads();
-        deinitDevice();
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
 
-        if (rawLevels != NULL)
-            free(rawLevels);
+    subPtr = &submasters[sub];
+    if (subPtr->master != level)
+    {
+        subPtr->master = level;
+        if (subPtr->channelCount > 0)
+            remixSubmasters(subPtr->firstChannel, subPtr->channelCount);
+    } /* if */
 
-        if (cookedLevels != NULL)
-            free(cookedLevels);
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* dimmer_submaster_set */
 
-        if (patchTable != NULL)
-            free(patchTable);
 
-        if (sysInfo.devsAvailable != NULL)
-            free(sysInfo.devsAvailable);
+int dimmer_source_create(const char *name)
+/*
+ * Create a new level source. Each source (a playback, an external
+ *  program, a live DMX input, etc) has its own level for every channel,
+ *  which are merged together according to each channel's merge mode
+ *  (see dimmer_channel_merge_mode()). dimmer_channel_set() and the fade
+ *  functions always use source 0, named "application".
+ *
+ *    params : name == what to call the source. Truncated to 31 chars.
+ *   returns : -1 on error, new source ID on success. (errno) set on error.
+ *     errno : EINVAL (name is NULL.)
+ *             ENOSPC (DIMMER_MAX_SOURCES already exist.)
+ *             ENOMEM (out of memory.)
+ *             EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct LevelSource *src;
+    int retVal = -1;
+    int i;
 
-        (void *) patchTable = (void *) rawLevels = (void *) cookedLevels = NULL;
+    if (name == NULL)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
 
-        grandMasterLevel = 255;
-        blackOutEnabled = __false;
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
 
-        memset(&sysInfo, '\0', sizeof (struct DimmerSystemInfo));
-        sysInfo.activeDevID = -1;
-        activeModFuncs = NULL;
-        duplexEnabled = __false;
+    for (i = 1; (i < DIMMER_MAX_SOURCES) && (sources[i].inUse); i++)
+        ;   /* find a free slot. Zero is always the application's. */
 
-        list = fadeList;
-        while (list != NULL)
+    if (i == DIMMER_MAX_SOURCES)
+        errno = ENOSPC;
+    else
+    {
+        src = &sources[i];
+        if ((cookedLevels != NULL) &&
+            (allocSourceLevels(&src->levels, &src->stamps, levelStride) == -1))
         {
-            list = fadeList->next;
-            free(fadeList);
-            fadeList = list;
-        } /* for */
+            freeSource(src);
+            errno = ENOMEM;
+        } /* if */
+        else
+        {
+            strncpy(src->name, name, sizeof (src->name));
+            src->name[sizeof (src->name) - 1] = '\0';
+            src->inUse = __true;
+            retVal = i;
+        } /* else */
+    } /* else */
 
-            /* fadeList is returned to NULL after the above loop... */
+    pthread_mutex_unlock(&fadeLock);
+    return(retVal);
+} /* dimmer_source_create */
 
-        dimmerLibInitialized = __false;
+
+int dimmer_source_destroy(int source)
+/*
+ * Get rid of a source. Every channel is remerged without it.
+ *
+ *    params : source == ID from dimmer_source_create().
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bogus source, or source 0.)
+ *             EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    if ((source <= 0) || (source >= DIMMER_MAX_SOURCES) ||
+        (!sources[source].inUse))
+    {
+        errno = EINVAL;
+        return(-1);
     } /* if */
-} /* dimmer_deinit */
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    freeSource(&sources[source]);
+    if (cookedLevels != NULL)
+        mergeRange(0, devInfo.numChannels);
+
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* dimmer_source_destroy */
 
 
-static int resize_channel_buffers(void)
+int dimmer_source_find(const char *name)
 /*
- * Make channel buffers match the amount of channels supported
- *  by the dimmer device. This is needed after a change in duplexing
- *  or after selecting a dimming device.
+ * Look up a source by name.
  *
- *     params : void.
- *    returns : -1 on error, 0 on success. (errno) set on error.
- *      errno : EAGAIN (thread problems.)
- *              ENOMEM (couldn't allocate new buffers.)
- *              ENODEV (No device selected.)
+ *    params : name == name the source was created with.
+ *   returns : -1 on error, source ID on success. (errno) set on error.
+ *     errno : ENOENT (no source has that name.)
  */
 {
     int i;
-    int chan = devInfo.numChannels;
-    __boolean threadsRunning = threadLiveFlag;
 
-    if (threadsRunning)
-        killThreads(); /* threads can't be checking buffers while we resize. */
+    for (i = 0; i < DIMMER_MAX_SOURCES; i++)
+    {
+        if ((sources[i].inUse) && (strcmp(sources[i].name, name) == 0))
+            return(i);
+    } /* for */
+
+    errno = ENOENT;
+    return(-1);
+} /* dimmer_source_find */
 
-    cookedLevels = realloc(cookedLevels, sizeof (unsigned char) * chan);
-    rawLevels = realloc(rawLevels, sizeof (unsigned char) * chan);
-    patchTable = realloc(patchTable, sizeof (int) * chan);
 
-        // !!! these should not overwrite globals prematurely.
-    if ((rawLevels == NULL) || (patchTable == NULL) || cookedLevels == NULL)
+int dimmer_source_channel_set(int source, unsigned int channel,
+                              unsigned char intensity)
+/*
+ * Set one source's level for a channel. This is dimmer_channel_set()
+ *  for sources other than the application's.
+ *
+ *   params : source    == ID from dimmer_source_create(), or 0.
+ *            channel   == channel to set.
+ *            intensity == 0-255 level.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (bad source or channel, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct ChannelCommand cmd;
+
+    if ((source < 0) || (source >= DIMMER_MAX_SOURCES) ||
+        (!sources[source].inUse) || (channel >= devInfo.numChannels))
+    {
+        errno = EINVAL;
         return(-1);
+    } /* if */
 
-    memset(rawLevels, '\0', sizeof (unsigned char) * chan);
-    memset(cookedLevels, '\0', sizeof (unsigned char) * chan);
+    memset(&cmd, '\0', sizeof (cmd));
+    cmd.type = COMMAND_SET;
+    cmd.channel = channel;
+    cmd.source = (unsigned char) source;
+    cmd.level = intensity;
+    return(queueCommand(&cmd));
+} /* dimmer_source_channel_set */
 
-    for (i = 0; i < chan; i++)
-        patchTable[i] = i;
 
-    if (threadsRunning)
+int dimmer_source_set_levels(int source, unsigned int first,
+                             unsigned char *levels, int count)
+/*
+ * Set one source's levels for a run of channels at once, such as a
+ *  whole universe of live input. The affected channels are remerged in
+ *  one pass instead of one at a time, and all reach the device in the
+ *  same frame.
+ *
+ *   params : source == ID from dimmer_source_create(), or 0.
+ *            first  == first channel to set.
+ *            levels == (count) 0-255 levels, for channels (first) onward.
+ *            count  == number of channels to set.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (bad source or channel range, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    struct LevelSource *src;
+    const struct PatchMap *map;
+    unsigned long long stamp;
+    int lo = 0x7FFFFFFF;
+    int hi = -1;
+    int patched;
+    int i;
+    int j;
+
+    if ((source < 0) || (source >= DIMMER_MAX_SOURCES) ||
+        (!sources[source].inUse) || (count < 0) ||
+        (first > devInfo.numChannels) ||
+        (count > devInfo.numChannels - first))
     {
-        if (spinThreads() == -1)  /* restart buffer scanners... */
-            return(-1);
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (count == 0)
+        return(0);
+
+        /* the fade thread can't publish half of this while we hold it. */
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    src = &sources[source];
+    map = currentPatchMap();
+    if (first + count > (unsigned int) map->numChannels)
+    {
+        pthread_mutex_unlock(&fadeLock);   /* the device just shrank. */
+        errno = EINVAL;
+        return(-1);
     } /* if */
 
+    stamp = ++mergeClock;
+    for (i = 0; i < count; i++)
+    {
+        for (j = map->first[first + i]; j < map->first[first + i + 1]; j++)
+        {
+            patched = map->dimmers[j];
+            src->levels[patched] = scale255(levels[i], map->proportions[j]);
+            src->stamps[patched] = stamp;
+            if (patched < lo)
+                lo = patched;
+            if (patched > hi)
+                hi = patched;
+        } /* for */
+    } /* for */
+
+    if (hi >= 0)
+        mergeRange(lo, (hi - lo) + 1);
+    pthread_mutex_unlock(&fadeLock);
     return(0);
-} /* resize_channel_buffers */
+} /* dimmer_source_set_levels */
 
 
-int dimmer_device_available(char *devName, int *devID)
+int dimmer_channel_merge_mode(unsigned int channel, int mode)
 /*
- * In the name of code reuse, this function will check if
- *  a given device is available for use. This could be
- *  accomplished on the application level by calling
- *  dimmer_query_system(), and then checking against
- *  devsAvailable and devCount. But we'll make your life easy. :)
+ * Choose how a channel's level is decided when several sources set it.
+ *  DIMMER_MERGE_HTP (the default) is "highest takes precedence": the
+ *  brightest source wins. DIMMER_MERGE_LTP is "latest takes precedence":
+ *  whichever source changed it last wins, which is what you want for
+ *  anything that isn't an intensity, like a color scroller.
  *
- *     params : devName == name of device module to check for availability.
- *              devID == filled in with ID number of device module.
- *    returns : zero if not available, non-zero if exists.
+ *   params : channel == channel to change.
+ *            mode    == DIMMER_MERGE_HTP or DIMMER_MERGE_LTP.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (bad channel or mode, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
  */
 {
+    const struct PatchMap *map;
+    int patched;
     int i;
-    int curDevID;
-    int retVal = 0;
-    char buffer[100];
 
-    for (i = 0; (i < sysInfo.devCount) && (!retVal); i++)
+    if ((channel >= devInfo.numChannels) || (mergeModes == NULL) ||
+        ((mode != DIMMER_MERGE_HTP) && (mode != DIMMER_MERGE_LTP)))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    map = currentPatchMap();
+    if (channel >= (unsigned int) map->numChannels)
+    {
+        pthread_mutex_unlock(&fadeLock);   /* the device just shrank. */
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    for (i = map->first[channel]; i < map->first[channel + 1]; i++)
+    {
+        patched = map->dimmers[i];
+        if (mergeModes[patched] != mode)
+        {
+            ltpChannelCount += (mode == DIMMER_MERGE_LTP) ? 1 : -1;
+            mergeModes[patched] = (unsigned char) mode;
+            mergeRange(patched, 1);
+        } /* if */
+    } /* for */
+
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* dimmer_channel_merge_mode */
+
+
+int dimmer_curve_create(const unsigned char *table)
+/*
+ * Add a dimmer curve of your own, for dimmer_channel_curve(). Level
+ *  (i) goes out as (table[i]). A curve can't be changed once it's made,
+ *  but making one costs only the 256 bytes, so make another.
+ *
+ *   params : table == 256 levels; copied.
+ *  returns : the new curve's number, -1 on error. (errno) set on error.
+ *    errno : EINVAL (no table.)
+ *            ENOSPC (there are already DIMMER_MAX_CURVES curves.)
+ *            EAGAIN (couldn't lock the fade thread.)
+ */
+{
+    int curve;
+
+    if (table == NULL)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (lockFades() != 0)
+    {
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    curve = curveCount;
+    if (curve >= DIMMER_MAX_CURVES)
+    {
+        pthread_mutex_unlock(&fadeLock);
+        errno = ENOSPC;
+        return(-1);
+    } /* if */
+
+    memcpy(curveTables + (curve << 8), table, 256);
+    __atomic_store_n(&curveCount, curve + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fadeLock);
+    return(curve);
+} /* dimmer_curve_create */
+
+
+int dimmer_curve_create_clamped(int curve, unsigned char low,
+                                unsigned char high)
+/*
+ * Make a copy of a curve that never goes below (low) or above (high).
+ *  A low limit keeps lamps warm even at zero, so they come up without
+ *  a thump; a high limit keeps lamps run at a lower voltage inside it.
+ *
+ *   params : curve == curve to start from: DIMMER_CURVE_*, or one from
+ *                      dimmer_curve_create().
+ *            low   == lowest level to send.
+ *            high  == highest level to send.
+ *  returns : the new curve's number, -1 on error. (errno) set on error.
+ *    errno : EINVAL (bad curve, or (low) above (high).)
+ *            anything dimmer_curve_create() sets.
+ */
+{
+    unsigned char table[256];
+    const unsigned char *from;
+    int i;
+
+    if ((curve < 0) || (low > high) ||
+        (curve >= __atomic_load_n(&curveCount, __ATOMIC_ACQUIRE)))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    from = curveTables + (curve << 8);
+    for (i = 0; i < 256; i++)
     {
-        curDevID = sysInfo.devsAvailable[i];
-        devFunctions[curDevID]->queryModuleName(buffer, sizeof (buffer));
-        if (strcmp(buffer, devName) == 0)
-        {
-            *devID = curDevID;
-            retVal = -1;
-        } /* if */
+        if (from[i] < low)
+            table[i] = low;
+        else if (from[i] > high)
+            table[i] = high;
+        else
+            table[i] = from[i];
     } /* for */
 
-    return(retVal);
-} /* dimmer_device_available */
+    return(dimmer_curve_create(table));
+} /* dimmer_curve_create_clamped */
 
 
-int dimmer_select_device(char *devName)
+int dimmer_channel_curve(unsigned int channel, int curve)
 /*
- * Use this function to switch to a device other than the default.
- *  You can find out the default through the dimmer_query_system()
- *  call (returnValue.currentDevID). This function call is
- *  unnecessary if you use the autoInit feature of dimmer_init() and
- *  don't care what specific protocol you use.
+ * Choose the dimmer curve a channel's level goes out through, after the
+ *  submasters and grand master. Every dimmer the channel is patched to
+ *  gets it, and keeps it if the channel is repatched. Channels start
+ *  out DIMMER_CURVE_LINEAR.
  *
- *      params : devName == device module name to select.
- *     returns : -1 on error, 0 on success. errno set.
- *       errno : ENODEV (bogus device ID number).
- *               anything else device initialization chooses to set.
+ *   params : channel == channel to change.
+ *            curve   == DIMMER_CURVE_*, or one from dimmer_curve_create().
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (bad channel or curve, or no device selected.)
+ *            EAGAIN (couldn't lock the fade thread.)
  */
 {
-    int retVal = -1;
-    int devModID;
+    const struct PatchMap *map;
+    int patched;
+    int i;
 
-    if (!dimmer_device_available(devName, &devModID))
-        errno = ENODEV;
-    else
+    if ((channel >= devInfo.numChannels) || (dimmerCurves == NULL) ||
+        (curve < 0) ||
+        (curve >= __atomic_load_n(&curveCount, __ATOMIC_ACQUIRE)))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (lockFades() != 0)
     {
-        if (devFunctions[devModID]->initialize() != -1)
+        errno = EAGAIN;
+        return(-1);
+    } /* if */
+
+    map = currentPatchMap();
+    if (channel >= (unsigned int) map->numChannels)
+    {
+        pthread_mutex_unlock(&fadeLock);   /* the device just shrank. */
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    for (i = map->first[channel]; i < map->first[channel + 1]; i++)
+    {
+        patched = map->dimmers[i];
+        if (dimmerCurves[patched] != curve)
         {
-            if (activeModFuncs != NULL)
-                activeModFuncs->deinitialize();
-            activeModFuncs = devFunctions[devModID];
-            sysInfo.activeDevID = devModID;
-            dimmer_query_device(&devInfo);
-            resize_channel_buffers();
-            retVal = 0;  /* success. */
+            if (dimmerCurves[patched] == DIMMER_CURVE_LINEAR)
+                curvedChannelCount++;
+            else if (curve == DIMMER_CURVE_LINEAR)
+                curvedChannelCount--;
+            dimmerCurves[patched] = (unsigned char) curve;
+            cookRange(patched, 1);
         } /* if */
-    } /* else */
+    } /* for */
 
-    return(retVal);
-} /* dimmer_select_device */
+    pthread_mutex_unlock(&fadeLock);
+    return(0);
+} /* dimmer_channel_curve */
 
 
-int dimmer_query_system(struct DimmerSystemInfo *info)
+int dimmer_set_refresh_rate(int hz)
 /*
- * Gets details on the system in relation to dimmer control.
+ * Set how many frames per second are sent to the dimmers. Selecting a
+ *  device resets this to whatever that device asks for (44 for a full
+ *  DMX512 universe), so call this afterwards. Running fades are
+ *  evaluated at the same rate. This also resets the frame timing stats.
  *
- *   params : *info == ptr to structure to fill with information.
+ * A device that can send universes short is normally run as fast as the
+ *  slots actually in use allow (see DimmerFrameTiming's effectiveHz);
+ *  a rate set here holds regardless, until it's put back with zero.
+ *
+ *   params : hz == frames per second, 1 to DIMMER_MAX_REFRESH_HZ. Zero
+ *                  puts back the device's own rate.
  *  returns : -1 on error, 0 on success. (errno) set on error.
- *    errno : EPERM (dimmer_init() was never called).
+ *    errno : EINVAL (hz out of range.)
+ *            EAGAIN (couldn't lock the fade thread.)
  */
 {
-    int retVal = 0;
+    if ((hz < 0) || (hz > DIMMER_MAX_REFRESH_HZ))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
 
-    if (dimmerLibInitialized)
-        memcpy(info, &sysInfo, sizeof (struct DimmerSystemInfo));
-    else
+    refreshPinned = (hz != 0) ? __true : __false;
+    if (hz == 0)
     {
-        retVal = -1;
-        errno = EPERM;
-    } /* else */
+        hz = DEFAULT_REFRESH_HZ;
+        if ((activeModFuncs != NULL) && (devInfo.refreshHz > 0))
+            hz = devInfo.refreshHz;
+    } /* if */
 
-    return(retVal);
-} /* dimmer_query_system */
+    return(setRefreshRate(hz));
+} /* dimmer_set_refresh_rate */
 
 
-int dimmer_query_device(struct DimmerDeviceInfo *info)
+int dimmer_set_realtime(int priority, int cpu)
 /*
- * Get information regarding the currently selected dimming device.
+ * Irregular refresh makes some dimmers flicker, so on a busy machine
+ *  you may want the output thread scheduled SCHED_FIFO and pinned to
+ *  a CPU of its own. This needs root (or CAP_SYS_NICE and enough
+ *  RLIMIT_MEMLOCK), since it also locks all of the process's memory.
+ *  The setting survives device changes, until dimmer_deinit().
  *
- *   params : *info == ptr to structure to fill with information.
+ *   params : priority == SCHED_FIFO priority, 1 to 99. Zero goes back to
+ *                         normal scheduling, but memory stays locked
+ *                         for the life of the process.
+ *            cpu      == CPU to pin the output thread to, or -1 for any.
  *  returns : -1 on error, 0 on success. (errno) set on error.
- *    errno : ENODEV (no dimmer device is selected).
- *            Whatever device function wants to set.
+ *    errno : EINVAL (priority or cpu out of range.)
+ *            EPERM  (not allowed to go real-time.)
+ *            ENOMEM (couldn't lock memory.)
  */
 {
-    int retVal = -1;
+    if ((priority < 0) || (priority > sched_get_priority_max(SCHED_FIFO)) ||
+        (cpu < -1) || (cpu >= CPU_SETSIZE))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
 
-    if (activeModFuncs == NULL)
-        errno = ENODEV;
-    else
-        retVal = activeModFuncs->queryDevice(info);
+    if ((threadLiveFlag) && (applyRealtime(priority, cpu) == -1))
+        return(-1);
 
-    return(retVal);
-} /* dimmer_query_device */
+    rtPriority = priority;
+    rtCPU = cpu;
+    return(0);
+} /* dimmer_set_realtime */
 
 
-int dimmer_set_duplex_mode(int shouldSet)
+int dimmer_query_timing(struct DimmerFrameTiming *timing)
 /*
- * Some dimming hardware has multiple outputs. If possible, this
- *  function call instructs that hardware on how to treat the
- *  outputs. This call can set the hardware to attempt to duplex
- *  (use two separate outlets to double the number of accessible
- *  channels) the outputs, or send the same signal down both.
+ * Find out how regularly frames have actually been going out, since
+ *  dimmer_init(), the last refresh rate change, or the last call to
+ *  dimmer_reset_timing().
  *
- * See the (potentially nonexistant) documentation for a better
- *  explanation of duplexing.
- *
- *     params : shouldSet == 1 to attempt duplexing, 0 to disable duplexing.
- *    returns : -1 if unsuccessful, 0 on success. (errno) set on error.
- *      errno : ENODEV  (no dimmer device is selected).
- *              ENOSYS  (device can't duplex).
+ *   params : timing == filled in with the stats.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (dimmer_init() was never called.)
  */
 {
-    int retVal = -1;
-    __boolean wantDuplex = (shouldSet == 0) ? __false : __true;
-
-    if (activeModFuncs == NULL)
-        errno = ENODEV;
-    else
+    if (!dimmerLibInitialized)
     {
-        if (duplexEnabled != wantDuplex)
-        {
-            retVal = activeModFuncs->setDuplexMode(duplexEnabled);
+        errno = EPERM;
+        return(-1);
+    } /* if */
 
-            if (retVal != -1)
-            {
-                duplexEnabled = wantDuplex;
-                retVal = resize_channel_buffers();
-            } /* if */
-        } /* if */
-    } /* else */
+    pthread_mutex_lock(&timingLock);
+    memcpy(timing, &frameTiming, sizeof (struct DimmerFrameTiming));
+    pthread_mutex_unlock(&timingLock);
+    return(0);
+} /* dimmer_query_timing */
 
-    return(retVal);
-} /* dimmer_set_duplex_mode */
 
+void dimmer_reset_timing(void)
+/*
+ * Zero the frame timing stats, so dimmer_query_timing() only covers
+ *  frames from here on.
+ *
+ *   params : void.
+ *  returns : void.
+ */
+{
+    resetFrameTiming();
+} /* dimmer_reset_timing */
 
 
-int dimmer_channel_set(unsigned int channel, unsigned char intensity)
+static long long timingPercentile(const struct DimmerFrameTiming *timing,
+                                  int percent)
 /*
- * Set a specific channel to a specific intensity.
- *
- *   params : channel == see above.
- *  returns : -1 on error, 0 on success. (errno) set on error.
- *    errno : ENODEV (no dimmer device is selected).
- *            Whatever device function wants to set.
+ * Estimate the interval (percent) percent of timed frames came in under,
+ *  from the upper edge of the histogram bucket it falls in.
  */
 {
-    int retVal = -1;
-    int cookedLevel;
-    int patched = patchTable[channel];
+    const long long width = DIMMER_TIMING_BUCKET_USECS * 1000LL;
+    unsigned long want;
+    unsigned long seen = 0;
+    long long interval;
+    int i;
 
-    rawLevels[patched] = intensity;
-    if (blackOutEnabled)   /* cooked level should already be zero. */
-        retVal = 0;
-    else
+    if ((timing->frames == 0) || (timing->effectiveHz <= 0))
+        return(0);
+
+    want = timing->frames - ((timing->frames * (100 - percent)) / 100);
+    for (i = 0; i < DIMMER_TIMING_BUCKETS - 1; i++)
     {
-        // !!! grandmaster/etc...!
-        cookedLevel = rawLevels[patched];
-        cookedLevels[patched] = cookedLevel;
-        retVal = 0;
-    } /* else */
+        seen += timing->histogram[i];
+        if (seen >= want)
+            break;
+    } /* for */
 
-    return(retVal);
-} /* dimmer_channel_set */
+    interval = (1000000000LL / timing->effectiveHz) +
+                ((i - (DIMMER_TIMING_BUCKETS / 2) + 1) * width);
 
+        /* the end buckets are open-ended; the extremes were kept exactly. */
+    if (interval > timing->maxInterval)
+        interval = timing->maxInterval;
+    if (interval < timing->minInterval)
+        interval = timing->minInterval;
 
+    return(interval);
+} /* timingPercentile */
 
-static inline void initChannelFadeStatus(struct ChannelFadeStatus *fadePtr,
-                                         unsigned int channel,
-                                         unsigned char intensity,
-                                         double seconds)
+
+int dimmer_query_stats(struct DimmerStats *stats)
 /*
- * This is called by dimmer_fade_channel() to initialize a ChannelFadeStatus
- *  structure before it is initially passed on to the fading thread for
- *  use. All parameters are guaranteed to be valid before this call, so
- *  no sanity checks should be necessary here.
+ * Find out how the library is keeping up: frames sent and how evenly,
+ *  how much fading there is and how long it takes, how often threads
+ *  wait on each other, and how often the device has failed. All of it
+ *  is counted as it happens, cheaply enough to leave running, and
+ *  reading it holds nothing up.
  *
- *     params : fadePtr   == struct to initialize.
- *              channel   == channel we're fading.
- *              intensity == raw level to fade to.
- *              seconds   == time to fade over.
- *    returns : void.
+ *   params : stats == filled in with the stats.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EPERM (dimmer_init() was never called.)
  */
 {
-    double timeBetweenFades;
-    long secsBetweenFades;
-    long microsecsBetweenFades;
-    int totalChange = intensity - rawLevels[patchTable[channel]];
+    struct DimmerFrameTiming timing;
+    unsigned long long passes;
+    int i;
 
-    if (totalChange == 0)
-        fadePtr->fadeActive = __false;
-    else
-    {
-        fadePtr->fadeActive = __true;
+    if (dimmer_query_timing(&timing) == -1)
+        return(-1);
 
-        timeBetweenFades = seconds / ((double) abs(totalChange));
-        secsBetweenFades = (long) timeBetweenFades;   /* lose fractions. */
-        microsecsBetweenFades =
-           (long) (1000000.0 * (timeBetweenFades - (double) secsBetweenFades));
+    memset(stats, '\0', sizeof (struct DimmerStats));
 
-        fadePtr->fadeTimeIncrement.tv_sec = secsBetweenFades;
-        fadePtr->fadeTimeIncrement.tv_usec = microsecsBetweenFades;
+    stats->framesSent = STATS_READ(deviceStats.framesSent);
+    stats->deviceErrors = STATS_READ(deviceStats.errors) +
+                           STATS_READ(outputRing.errors);
 
-            /*
-             * Set up the first fade time here. This will be handled
-             *  from now on by the fade thread.
-             */
-        gettimeofday(&fadePtr->nextFadeTime, NULL);
-        addTimevalStructs(&fadePtr->nextFadeTime, &fadePtr->fadeTimeIncrement);
+    if (timing.totalInterval > 0)
+    {
+        stats->achievedHz = (timing.frames * 1000000000.0) /
+                             timing.totalInterval;
+        stats->meanInterval = timing.totalInterval / timing.frames;
+    } /* if */
+
+    stats->minInterval = timing.minInterval;
+    stats->maxInterval = timing.maxInterval;
+    stats->p99Interval = timingPercentile(&timing, 99);
+    stats->missedFrames = timing.missedFrames;
+    stats->busyFrames = timing.busyFrames;
+    for (i = (DIMMER_TIMING_BUCKETS / 2) + 1; i < DIMMER_TIMING_BUCKETS; i++)
+        stats->lateFrames += timing.histogram[i];
+
+    stats->activeFades = STATS_READ(fadeStats.activeFades);
+    stats->delayedFades = STATS_READ(fadeStats.delayedFades);
+
+    passes = STATS_READ(fadeStats.passes);
+    stats->fadePasses = passes;
+    stats->lastFadePass = STATS_READ(fadeStats.lastPass);
+    stats->maxFadePass = STATS_READ(fadeStats.maxPass);
+    if (passes > 0)
+        stats->meanFadePass = STATS_READ(fadeStats.totalPass) / passes;
+
+    stats->lockAcquires = STATS_READ(lockStats.acquires);
+    stats->lockContended = STATS_READ(lockStats.contended);
+    stats->lockWaitTotal = STATS_READ(lockStats.totalWait);
+    stats->lockWaitMax = STATS_READ(lockStats.maxWait);
+    return(0);
+} /* dimmer_query_stats */
 
-            /* fade up or fade down? */
-        fadePtr->levelChangeRate = ((totalChange > 0) ? 1 : -1);
 
-            /* the easy stuff. :) */
-        fadePtr->destinationLevel = intensity;
-        fadePtr->channel = channel;
-    } /* else */
-} /* initChannelFadeStatus */
+int dimmer_trace_dump(int fd)
+/*
+ * Write out the recent history of what libdimmer and the device module
+ *  have been up to: frames sent and missed, fades starting and ending,
+ *  waits on the fade lock, and device errors. Each thread keeps its last
+ *  TRACE_RING_SIZE events; they come out merged, oldest first, one per
+ *  line as "seconds.nanoseconds threadID event arg0 arg1". Recording
+ *  them is cheap enough to leave on; this is the only costly part.
+ *
+ *   params : fd == file descriptor to write to.
+ *  returns : -1 on error, number of events written on success.
+ *             (errno) set on error.
+ *    errno : ENOSYS (libdimmer was built without DIMMER_TRACE.)
+ *            ENOMEM (out of memory.)
+ *            anything write() sets.
+ */
+{
+    return(traceDump(fd));
+} /* dimmer_trace_dump */
 
 
-int dimmer_channel_fade(unsigned int channel,
-                        unsigned char intensity,
-                        double seconds)
+static int universeChannel(int universe, int slot)
 /*
- * Fade a channel. Even though the fade may take many seconds,
- *  this call does not block. The fade is passed off to another
- *  thread to be processed.
+ * Turn a universe and slot into a channel number.
  *
- *      params : channel = channel # to fade.
- *               intensity = 0-255 level to fade light to.
- *               seconds = number of seconds (or fractions thereof) that
- *                         it should take for light to reach (intensity).
- *      returns : -1 on error, 0 on success. (errno) set on error.
- *        errno : ENOMEM (Not enough memory for malloc).
- *                EINVAL (bad agruments.)
+ *    params : universe == universe, from 0 to numUniverses - 1.
+ *             slot     == slot in that universe, from 0 to 511.
+ *   returns : -1 on error, channel number on success. (errno) set on error.
+ *     errno : EINVAL (no such universe or slot on this device.)
  */
 {
-    struct ChannelFadeStatus *fadePtr;
-    struct ChannelFadeStatus *lastPtr = NULL;
-    __boolean newStruct = __false;
+    int channel = (universe * DIMMER_UNIVERSE_SIZE) + slot;
 
-        /* sanity checks... */
-    if ((channel >= devInfo.numChannels) || (seconds < 0.0))
+    if ((universe < 0) || (universe >= devInfo.numUniverses) ||
+        (slot < 0) || (slot >= DIMMER_UNIVERSE_SIZE) ||
+        (channel >= devInfo.numChannels))
     {
         errno = EINVAL;
         return(-1);
     } /* if */
 
-    channel = patchTable[channel];
+    return(channel);
+} /* universeChannel */
 
-    for (fadePtr = fadeList;
-        (fadePtr != NULL) && (fadePtr->channel < channel);
-        fadePtr = fadePtr->next)
-    {
-        lastPtr = fadePtr;
-    } /* for */
 
-        /* this channel hasn't faded yet? Allocate a new list item... */
-    if ((fadePtr == NULL) || (fadePtr->channel != channel))
-    {
-        newStruct = __true;
-        fadePtr = calloc(1, sizeof (struct ChannelFadeStatus));
-        if (fadePtr == NULL)
-        {
-            errno = ENOMEM;
-            return(-1);
-        } /* if */
-    } /* if */
+int dimmer_universe_set(int universe, int slot, unsigned char intensity)
+/*
+ * dimmer_channel_set(), addressed by universe and slot.
+ *
+ *   params : universe  == universe, from 0 to numUniverses - 1.
+ *            slot      == slot in that universe, from 0 to 511.
+ *            intensity == 0-255 level.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (no such universe or slot.)
+ */
+{
+    int channel = universeChannel(universe, slot);
 
-        /* grabbing the ThreadLock halts the fade thread... */
-    if (pthread_mutex_lock(&fadeLock) != 0)
-    {
-        if (newStruct == __true)
-            free(fadePtr);
-        errno = EAGAIN;
+    if (channel == -1)
         return(-1);
-    } /* if */
-
-        /* set up the structure... */
-    initChannelFadeStatus(fadePtr, channel, intensity, seconds);
 
-        /* plug the structure into the list, if need be... */
-    if (newStruct == __true)
-    {
-        if (lastPtr == NULL)        /* start of new list? */
-        {
-            fadePtr->next = NULL;
-            fadeList = fadePtr;
-        } /* if */
-        else                        /* insert item into place. */
-        {
-            fadePtr->next = lastPtr->next;
-            lastPtr->next = fadePtr;
-        } /* else */
-    } /* else */
-
-        /* we're golden; let the fade thread go again... */
-    pthread_mutex_unlock(&fadeLock);
+    return(dimmer_channel_set(channel, intensity));
+} /* dimmer_universe_set */
 
-    return(0);
-} /* dimmer_channel_fade */
 
-
-int dimmer_toggle_blackout(int shouldToggleOn)
+int dimmer_universe_set_levels(int universe, int slot,
+                               unsigned char *levels, int count)
 /*
- * First call to this bumps all channels to zero.
- * Next call restores (by bump) all channels to where they where before
- *  the blackout. Any other attempts to modify a channel's intensity will
- *  be noted, but the change will not be made during blackout.
+ * Set a run of slots in one universe at once; the whole universe, if
+ *  you like. This writes the application's source, like
+ *  dimmer_channel_set() does, but remerges them all in one pass.
  *
- *    params : shouldToggleOn == nonZero to start blackout, zero to stop.
- *   returns : always returns (0);
+ *   params : universe == universe, from 0 to numUniverses - 1.
+ *            slot     == first slot to set.
+ *            levels   == (count) 0-255 levels.
+ *            count    == number of slots to set. They must all be in
+ *                         (universe).
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (no such universe or slots.)
+ *            EAGAIN (couldn't lock the fade thread.)
  */
 {
-    int i;
+    int channel = universeChannel(universe, slot);
 
-        /* make sure we aren't requesting the current state... */
-    if ( ((blackOutEnabled == __true)  && (shouldToggleOn == 0)) ||
-         ((blackOutEnabled == __false) && (shouldToggleOn != 0)) )
-    {
-            /* swap state. */
-        blackOutEnabled = ((blackOutEnabled) ? __false : __true);
+    if (channel == -1)
+        return(-1);
 
-        if (blackOutEnabled)
-        {
-            blackOutEnabled = __true;
-            for (i = 0; i < devInfo.numChannels; i++)
-                cookedLevels[i] = 0;  /* bypass dimmer_channel_set() */
-        } /* if */
-        else
-        {
-            blackOutEnabled = __false;
-            for (i = 0; i < devInfo.numChannels; i++)
-                dimmer_channel_set(i, rawLevels[patchTable[i]]);
-        } /* else */
+    if ((count < 0) || (slot + count > DIMMER_UNIVERSE_SIZE))
+    {
+        errno = EINVAL;
+        return(-1);
     } /* if */
 
-    return(0);
-} /* dimmer_toggle_blackout */
+    return(dimmer_source_set_levels(0, channel, levels, count));
+} /* dimmer_universe_set_levels */
 
 
-int dimmer_channel_patch(int channel, int patchTo)
+int dimmer_universe_fade(int universe, int slot, unsigned char intensity,
+                         double seconds, double delay, int curve)
 /*
- * Define a channel patch. Any time access is attempted on
- *  (channel), it'll actually use (patchTo) instead.
+ * dimmer_channel_fade_ex(), addressed by universe and slot.
  *
- *    params : channel == channel to patch.
- *             patchTo == what (channel) will now access.
- *   returns : -1 on error, 0 on success.
+ *   params : universe == universe, from 0 to numUniverses - 1.
+ *            slot     == slot in that universe, from 0 to 511.
+ *            see dimmer_channel_fade_ex() for the rest.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (no such universe or slot, or bad arguments.)
+ *            EAGAIN (couldn't lock the fade thread.)
  */
 {
-    int retVal = -1;
+    int channel = universeChannel(universe, slot);
 
-    if ((!dimmerLibInitialized) ||
-        (patchTo < 0) || (patchTo >= devInfo.numChannels) ||
-        (channel < 0) || (patchTo >= devInfo.numChannels))
-    {
-        errno = EINVAL;
-    } /* if */
-    else
-    {
-        if (pthread_mutex_lock(&fadeLock) != -1)
-        {
-            patchTable[channel] = patchTo;
-            retVal = 0;
-            pthread_mutex_unlock(&fadeLock);
-        } /* if */
-    } /* else */
-    return(retVal);
-} /* dimmer_channel_patch */
+    if (channel == -1)
+        return(-1);
 
+    return(dimmer_channel_fade_ex(channel, intensity, seconds, delay, curve));
+} /* dimmer_universe_fade */
 
-int dimmer_set_grand_master(int intensity)
+
+int dimmer_universe_patch(int universe, int slot, int toUniverse, int toSlot)
 /*
- * The grand master is a dimmer for all other dimmers. If you set
- *  channel X to 100%, and the grand master to 80%, then channel X
- *  will really only have an intensity of 80%. If channel X is set to
- *  50% and the GM is at 80%, then channel X will really only have an
- *  intensity of 40%. This affects every channel.
+ * dimmer_channel_patch(), addressed by universe and slot. Patches can
+ *  cross universes.
  *
- *    params : intensity == level (0 to 100) to set GM to.
- *   returns : always returns (0);
+ *   params : universe, slot     == what to patch.
+ *            toUniverse, toSlot == where it'll really go.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (no such universe or slot.)
  */
 {
-    /* !!! write this! */
-    return(0);
-} /* dimmer_set_grand_master */
+    int channel = universeChannel(universe, slot);
+    int patchTo = universeChannel(toUniverse, toSlot);
+
+    if ((channel == -1) || (patchTo == -1))
+        return(-1);
+
+    return(dimmer_channel_patch(channel, patchTo));
+} /* dimmer_universe_patch */
 
 /* End of dimmer.c ... */
 
@@ -23,11 +23,125 @@ struct DimmerSystemInfo
 };
 
 
+    /* slots in a universe. A universe is what one DMX512 line carries. */
+#define DIMMER_UNIVERSE_SIZE  512
+
+    /*
+     * Channels are numbered straight through every universe: channel
+     *  (universe * DIMMER_UNIVERSE_SIZE + slot). The levels handed to
+     *  updateDevice() are laid out the same way, with each universe
+     *  starting on a 64-byte boundary. A module may fill in just one of
+     *  numChannels and numUniverses; dimmer_query_device() works out the
+     *  other.
+     *
+     * A device that can send a universe short, stopping after the last
+     *  slot in use, says how long sending takes with slotUsecs and
+     *  packetUsecs. The library then runs the frame clock as fast as the
+     *  longest universe it actually sends allows (see setUniverseSlots()).
+     */
 struct DimmerDeviceInfo
 {
     int numChannels;
     int numOutputs;
     int isDuplexed;
+    int refreshHz;      /* frames per second it wants. Zero for default. */
+    int numUniverses;   /* DIMMER_UNIVERSE_SIZE-slot universes.          */
+    int slotUsecs;      /* time on the wire per slot. Zero if it always  */
+                        /*  sends whole universes.                       */
+    int packetUsecs;    /* time on the wire per universe, besides slots. */
+};
+
+    /* no universe is sent shorter than this, even if it's all dark. */
+#define DIMMER_MIN_UNIVERSE_SLOTS  24
+
+
+#define DIMMER_MAX_REFRESH_HZ       1000
+#define DIMMER_TIMING_BUCKETS       64
+#define DIMMER_TIMING_BUCKET_USECS  100
+
+    /*
+     * Output frame timing, from dimmer_query_timing(). Intervals are in
+     *  nanoseconds. histogram[DIMMER_TIMING_BUCKETS / 2] counts frames
+     *  that went out up to DIMMER_TIMING_BUCKET_USECS later than the
+     *  nominal frame time after the one before; each bucket either side
+     *  is another DIMMER_TIMING_BUCKET_USECS late (or early). The first
+     *  and last buckets also catch everything beyond them.
+     */
+struct DimmerFrameTiming
+{
+    int refreshHz;                  /* nominal frames per second.          */
+    int effectiveHz;                /* what the frame clock really runs at; */
+                                    /*  more than (refreshHz) if short      */
+                                    /*  universes allow it.                 */
+    int longestUniverse;            /* slots sent in the longest universe. */
+    unsigned long frames;           /* frames timed.                       */
+    unsigned long missedFrames;     /* deadlines skipped for running late. */
+    unsigned long busyFrames;       /* frames the device turned away.      */
+    long long minInterval;
+    long long maxInterval;
+    long long totalInterval;        /* divide by (frames) for the mean.    */
+    unsigned long histogram[DIMMER_TIMING_BUCKETS];
+};
+
+
+    /*
+     * A snapshot of how the library is running, from dimmer_query_stats().
+     *  Times are in nanoseconds. The frame interval figures cover the
+     *  same frames as dimmer_query_timing(); everything else counts from
+     *  dimmer_init(). Each figure is read without stopping anything, so
+     *  two of them may be a frame out of step with each other.
+     */
+struct DimmerStats
+{
+    unsigned long long framesSent;  /* frames handed on to the device.     */
+    double achievedHz;              /* timed frames over the time they took. */
+    long long minInterval;
+    long long meanInterval;
+    long long maxInterval;
+    long long p99Interval;          /* to DIMMER_TIMING_BUCKET_USECS or so. */
+    unsigned long lateFrames;       /* a whole timing bucket late or more. */
+    unsigned long missedFrames;     /* deadlines skipped for running late. */
+    unsigned long busyFrames;       /* frames the device turned away.      */
+    unsigned long long deviceErrors;/* sends that failed outright.         */
+    int activeFades;                /* fades running, as of the last pass. */
+    int delayedFades;               /* fades still waiting out a delay.    */
+    unsigned long long fadePasses;  /* times the fade thread ran.          */
+    long long lastFadePass;         /* how long each pass took...          */
+    long long meanFadePass;
+    long long maxFadePass;
+    unsigned long long lockAcquires;  /* times the fade lock was taken... */
+    unsigned long long lockContended; /*  ...and somebody else had it.    */
+    long long lockWaitTotal;        /* time spent waiting for it.          */
+    long long lockWaitMax;
+};
+
+
+    /*
+     * One line of a patch, for dimmer_patch_load(): (channel) drives
+     *  (dimmer) at (proportion) / 255 of its level.
+     */
+struct DimmerPatch
+{
+    int channel;
+    int dimmer;
+    unsigned char proportion;
+};
+
+
+    /*
+     * One of a device's outputs, for queryAsyncOutputs(). Each frame,
+     *  (header) and then the 512 levels of (universe) go to (fd) in a
+     *  single write.
+     */
+#define DIMMER_MAX_ASYNC_OUTPUTS  32
+#define DIMMER_MAX_PACKET_HEADER  8
+
+struct DimmerAsyncOutput
+{
+    int fd;
+    int universe;
+    int headerSize;                 /* bytes of (header) actually used. */
+    unsigned char header[DIMMER_MAX_PACKET_HEADER];
 };
 
 
@@ -41,8 +155,85 @@ struct DimmerDeviceFunctions
     int (*channelSet)(int channel, int intensity);
     int (*setDuplexMode)(__boolean shouldSet);
     void (*updateDevice)(unsigned char *levels);
+
+        /*
+         * Optional; leave NULL if the device can't do it. If present, it
+         *  is called instead of updateDevice(), once per universe per
+         *  frame, each universe from a thread of its own. Calls for
+         *  different universes can happen at the same time.
+         */
+    void (*updateUniverse)(int universe, unsigned char *levels);
+
+        /*
+         * Optional. If present, it is called instead of updateDevice(),
+         *  and may turn a frame away: return -1 with (errno) set to EAGAIN
+         *  if the device can't take one right now, and the newest frame
+         *  is offered again shortly. Return 0 if the frame was sent, or
+         *  didn't need to be.
+         */
+    int (*sendFrame)(unsigned char *levels);
+
+        /*
+         * Optional. Lets the library do the writing itself, without ever
+         *  waiting on it: fill in up to (max) outputs and return how many,
+         *  or return 0 to be sent frames the usual way. The file
+         *  descriptors still belong to the module, and must stay open
+         *  until deinitialize().
+         */
+    int (*queryAsyncOutputs)(struct DimmerAsyncOutput *outputs, int max);
+
+        /*
+         * Optional. If present, it is called instead of sendFrame() and
+         *  updateDevice(), with a bitmap of the channels that changed
+         *  since the last frame it accepted: test a channel with
+         *  DIMMER_CHANNEL_CHANGED(). A frame where nothing changed still
+         *  comes through, for devices that need refreshing anyhow. If
+         *  (changed) is NULL, assume everything did. Returns as sendFrame()
+         *  does; changes in a frame that's turned away come around again.
+         */
+    int (*sendChanges)(unsigned char *levels, const unsigned char *changed);
+
+        /*
+         * Optional, for devices with a nonzero slotUsecs. Between frames,
+         *  the library says how many slots of (universe) are in use;
+         *  from the next frame on, send just that many. It's never fewer
+         *  than DIMMER_MIN_UNIVERSE_SLOTS, and only grows until the
+         *  device is resized. Universes start out whole.
+         */
+    void (*setUniverseSlots)(int universe, int slots);
 };
 
+#define DIMMER_CHANNEL_CHANGED(changed, chan)  \
+            ((changed)[(chan) >> 3] & (1 << ((chan) & 7)))
+
+
+#define DIMMER_MAX_SUBMASTERS  32
+#define DIMMER_MAX_SOURCES     16
+
+    /* Merge modes for dimmer_channel_merge_mode(). */
+#define DIMMER_MERGE_HTP  0
+#define DIMMER_MERGE_LTP  1
+
+    /* Fade shapes for dimmer_channel_fade_ex(). */
+#define DIMMER_FADE_LINEAR    0
+#define DIMMER_FADE_EASE_IN   1
+#define DIMMER_FADE_EASE_OUT  2
+#define DIMMER_FADE_SCURVE    3
+
+    /*
+     * Dimmer curves for dimmer_channel_curve(). Square law gives finer
+     *  control at the bottom, inverse square at the top; a switch is
+     *  off below half and full from there up, for anything that mustn't
+     *  be dimmed; LED makes an LED fixture's brightness look linear.
+     *  dimmer_curve_create() makes more, up to DIMMER_MAX_CURVES.
+     */
+#define DIMMER_CURVE_LINEAR          0
+#define DIMMER_CURVE_SQUARE          1
+#define DIMMER_CURVE_INVERSE_SQUARE  2
+#define DIMMER_CURVE_SWITCH          3
+#define DIMMER_CURVE_LED             4
+#define DIMMER_MAX_CURVES            32
+
 
 void dimmer_deinit(void);
 int dimmer_init(int autoInit);
@@ -52,10 +243,49 @@ int dimmer_query_system(struct DimmerSystemInfo *info);
 int dimmer_query_device(struct DimmerDeviceInfo *info);
 int dimmer_set_duplex_mode(int shouldSet);
 int dimmer_channel_set(unsigned int channel, unsigned char intensity);
+int dimmer_channel_set_levels(unsigned int first, unsigned char *levels,
+                              int count);
+int dimmer_channel_set_list(unsigned int *channels, unsigned char *levels,
+                            int count);
+int dimmer_begin_frame(void);
+int dimmer_commit_frame(void);
 int dimmer_channel_fade(unsigned int chan, unsigned char level, double secs);
+int dimmer_channel_fade_ex(unsigned int chan, unsigned char level,
+                           double secs, double delay, int curve);
 int dimmer_channel_patch(int channel, int patchTo);
+int dimmer_channel_patch_ex(int channel, int *dimmers,
+                            unsigned char *proportions, int count);
+int dimmer_patch_load(struct DimmerPatch *patches, int count);
+int dimmer_patch_reset(void);
 int dimmer_toggle_blackout(int shouldToggleOn);
 int dimmer_set_grand_master(int intensity);
+int dimmer_submaster_record(int sub, unsigned int *channels,
+                            unsigned char *levels, int count);
+int dimmer_submaster_set(int sub, unsigned char level);
+int dimmer_source_create(const char *name);
+int dimmer_source_destroy(int source);
+int dimmer_source_find(const char *name);
+int dimmer_source_channel_set(int source, unsigned int channel,
+                              unsigned char intensity);
+int dimmer_source_set_levels(int source, unsigned int first,
+                             unsigned char *levels, int count);
+int dimmer_channel_merge_mode(unsigned int channel, int mode);
+int dimmer_curve_create(const unsigned char *table);
+int dimmer_curve_create_clamped(int curve, unsigned char low,
+                                unsigned char high);
+int dimmer_channel_curve(unsigned int channel, int curve);
+int dimmer_set_refresh_rate(int hz);
+int dimmer_set_realtime(int priority, int cpu);
+int dimmer_query_timing(struct DimmerFrameTiming *timing);
+void dimmer_reset_timing(void);
+int dimmer_query_stats(struct DimmerStats *stats);
+int dimmer_trace_dump(int fd);
+int dimmer_universe_set(int universe, int slot, unsigned char intensity);
+int dimmer_universe_set_levels(int universe, int slot,
+                               unsigned char *levels, int count);
+int dimmer_universe_fade(int universe, int slot, unsigned char intensity,
+                         double seconds, double delay, int curve);
+int dimmer_universe_patch(int universe, int slot, int toUniverse, int toSlot);
 
 #define dimmer_channel_bump(chan)     dimmer_channel_set(channel, 255)
 #define dimmer_channel_blackout(chan) dimmer_channel_set(channel, 0)
@@ -0,0 +1,372 @@
+/*
+ * Fade evaluation kernels for libdimmer. Every frame, the fade thread
+ *  hands all running fades to one of these in a single call. There's a
+ *  plain C version, and SSE2/AVX2 versions picked at runtime when the
+ *  CPU has them. All of them must produce identical results.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "boolean.h"
+#include "dimmer.h"
+#include "fade_kernel.h"
+
+#if (defined __x86_64__) || (defined __i386__)
+#define FADE_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+
+int fadeCurve(int curve, int frac)
+/*
+ * Reshape fade progress.
+ *
+ *    params : curve == DIMMER_FADE_* shape.
+ *             frac  == linear progress, 0 to 65536.
+ *   returns : shaped progress, 0 to 65536.
+ */
+{
+    long long f = frac;
+
+    switch (curve)
+    {
+        case DIMMER_FADE_EASE_IN:
+            return((int) ((f * f) >> 16));
+
+        case DIMMER_FADE_EASE_OUT:
+            f = 65536 - f;
+            return((int) (65536 - ((f * f) >> 16)));
+
+        case DIMMER_FADE_SCURVE:   /* smoothstep: 3f^2 - 2f^3 */
+            return((int) ((((f * f) >> 16) * ((3 * 65536) - (2 * f))) >> 16));
+
+        default:
+            return(frac);
+    } /* switch */
+} /* fadeCurve */
+
+
+unsigned int fadeInverseDuration(int duration)
+/*
+ * Calculate the (invDuration) entry for a fade of (duration) ticks.
+ *  (elapsed * invDuration) >> 16 is then fade progress, 0 to 65536.
+ *
+ *    params : duration == length of fade, in ticks. Zero is legal.
+ *   returns : (2^32 / duration), clamped to 32 bits.
+ */
+{
+    unsigned long long inv;
+
+    if (duration <= 1)
+        return(0xFFFFFFFF);   /* zero-length fades are "done" immediately. */
+
+    inv = (1ULL << 32) / (unsigned long long) duration;
+    return((unsigned int) inv);
+} /* fadeInverseDuration */
+
+
+static inline void fadeOne(const struct FadeArrays *fades, int i, int now,
+                           unsigned char *levels, unsigned char *done)
+{
+    int elapsed = (int) ((unsigned int) now - (unsigned int) fades->startTime[i]);
+    int start = fades->startLevel[i];
+    int end = fades->endLevel[i];
+    int frac;
+
+    if (elapsed >= fades->duration[i])
+    {
+        levels[i] = (unsigned char) end;
+        done[i] = 1;
+        return;
+    } /* if */
+
+    if (elapsed < 0)
+        elapsed = 0;
+
+    frac = (int) (((unsigned long long) elapsed * fades->invDuration[i]) >> 16);
+    if (fades->curve[i] != DIMMER_FADE_LINEAR)
+        frac = fadeCurve(fades->curve[i], frac);
+
+    levels[i] = (unsigned char) (start + ((((end - start) * frac) + 32768) >> 16));
+    done[i] = 0;
+} /* fadeOne */
+
+
+void fadeKernelScalar(const struct FadeArrays *fades, int count, int now,
+                      unsigned char *levels, unsigned char *done)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        fadeOne(fades, i, now, levels, done);
+} /* fadeKernelScalar */
+
+
+static inline __boolean anyCurves(const unsigned char *curve, int n)
+{
+    unsigned long long bits = 0;   /* DIMMER_FADE_LINEAR is zero. */
+
+    memcpy(&bits, curve, n);       /* (n) is never more than 8. */
+    return((bits != 0) ? __true : __false);
+} /* anyCurves */
+
+
+static inline void curveBlock(const unsigned char *curve, int *frac, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (curve[i] != DIMMER_FADE_LINEAR)
+            frac[i] = fadeCurve(curve[i], frac[i]);
+    } /* for */
+} /* curveBlock */
+
+
+#ifdef FADE_KERNEL_X86
+
+__attribute__((target("sse2")))
+static inline __m128i mulLo32SSE2(__m128i a, __m128i b)
+/*
+ * SSE2 has no 32-bit multiply that keeps the low halves (that's SSE4.1),
+ *  so do the even and odd lanes separately and stitch them together.
+ *  The low 32 bits come out the same for signed and unsigned inputs.
+ */
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return(_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0))));
+} /* mulLo32SSE2 */
+
+
+__attribute__((target("sse2")))
+static inline __m128i mulHi16SSE2(__m128i a, __m128i b)
+/*
+ * Full 32x32->64-bit unsigned multiply, returning bits 16 to 47 of
+ *  each product: (a * b) >> 16, per lane.
+ */
+{
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(a, b), 16);
+    __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32),
+                                               _mm_srli_epi64(b, 32)), 16);
+    return(_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0))));
+} /* mulHi16SSE2 */
+
+
+__attribute__((target("sse2")))
+void fadeKernelSSE2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i round = _mm_set1_epi32(32768);
+    const __m128i now4 = _mm_set1_epi32(now);
+    __m128i elapsed, duration, start, end, frac, level, finished, packed;
+    int fracs[4];
+    int bytes;
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        elapsed = _mm_sub_epi32(now4,
+                      _mm_loadu_si128((const __m128i *) &fades->startTime[i]));
+        duration = _mm_loadu_si128((const __m128i *) &fades->duration[i]);
+        start = _mm_loadu_si128((const __m128i *) &fades->startLevel[i]);
+        end = _mm_loadu_si128((const __m128i *) &fades->endLevel[i]);
+
+            /* finished == (elapsed >= duration) == !(duration > elapsed) */
+        finished = _mm_cmpeq_epi32(_mm_cmpgt_epi32(duration, elapsed), zero);
+        elapsed = _mm_and_si128(elapsed, _mm_cmpgt_epi32(elapsed, zero));
+
+        frac = mulHi16SSE2(elapsed,
+                  _mm_loadu_si128((const __m128i *) &fades->invDuration[i]));
+
+        if (anyCurves(&fades->curve[i], 4))
+        {
+            _mm_storeu_si128((__m128i *) fracs, frac);
+            curveBlock(&fades->curve[i], fracs, 4);
+            frac = _mm_loadu_si128((const __m128i *) fracs);
+        } /* if */
+
+        level = mulLo32SSE2(_mm_sub_epi32(end, start), frac);
+        level = _mm_add_epi32(start,
+                              _mm_srai_epi32(_mm_add_epi32(level, round), 16));
+        level = _mm_or_si128(_mm_and_si128(finished, end),
+                             _mm_andnot_si128(finished, level));
+
+        packed = _mm_packs_epi32(level, level);
+        bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        memcpy(&levels[i], &bytes, 4);
+
+        packed = _mm_packs_epi32(_mm_and_si128(finished, one), zero);
+        bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        memcpy(&done[i], &bytes, 4);
+    } /* for */
+
+    for ( ; i < count; i++)
+        fadeOne(fades, i, now, levels, done);
+} /* fadeKernelSSE2 */
+
+
+__attribute__((target("avx2")))
+void fadeKernelAVX2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i round = _mm256_set1_epi32(32768);
+    const __m256i now8 = _mm256_set1_epi32(now);
+    __m256i elapsed, duration, start, end, inv, even, odd;
+    __m256i frac, level, finished, packed;
+    int fracs[8];
+    int bytes;
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        elapsed = _mm256_sub_epi32(now8,
+                   _mm256_loadu_si256((const __m256i *) &fades->startTime[i]));
+        duration = _mm256_loadu_si256((const __m256i *) &fades->duration[i]);
+        start = _mm256_loadu_si256((const __m256i *) &fades->startLevel[i]);
+        end = _mm256_loadu_si256((const __m256i *) &fades->endLevel[i]);
+        inv = _mm256_loadu_si256((const __m256i *) &fades->invDuration[i]);
+
+        finished = _mm256_cmpeq_epi32(_mm256_cmpgt_epi32(duration, elapsed),
+                                      zero);
+        elapsed = _mm256_max_epi32(elapsed, zero);
+
+            /* (elapsed * inv) >> 16, with 64-bit intermediates. */
+        even = _mm256_srli_epi64(_mm256_mul_epu32(elapsed, inv), 16);
+        odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(elapsed, 32),
+                                                 _mm256_srli_epi64(inv, 32)), 16);
+        frac = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+
+        if (anyCurves(&fades->curve[i], 8))
+        {
+            _mm256_storeu_si256((__m256i *) fracs, frac);
+            curveBlock(&fades->curve[i], fracs, 8);
+            frac = _mm256_loadu_si256((const __m256i *) fracs);
+        } /* if */
+
+        level = _mm256_mullo_epi32(_mm256_sub_epi32(end, start), frac);
+        level = _mm256_add_epi32(start,
+                           _mm256_srai_epi32(_mm256_add_epi32(level, round), 16));
+        level = _mm256_blendv_epi8(level, end, finished);
+
+            /* packs work within 128-bit halves, so take four from each. */
+        packed = _mm256_packs_epi32(level, level);
+        packed = _mm256_packus_epi16(packed, packed);
+        bytes = _mm_cvtsi128_si32(_mm256_castsi256_si128(packed));
+        memcpy(&levels[i], &bytes, 4);
+        bytes = _mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1));
+        memcpy(&levels[i + 4], &bytes, 4);
+
+        packed = _mm256_packs_epi32(_mm256_and_si256(finished, one), zero);
+        packed = _mm256_packus_epi16(packed, packed);
+        bytes = _mm_cvtsi128_si32(_mm256_castsi256_si128(packed));
+        memcpy(&done[i], &bytes, 4);
+        bytes = _mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1));
+        memcpy(&done[i + 4], &bytes, 4);
+    } /* for */
+
+    for ( ; i < count; i++)
+        fadeOne(fades, i, now, levels, done);
+} /* fadeKernelAVX2 */
+
+#else   /* no x86 SIMD; these exist so callers don't need #ifdefs. */
+
+void fadeKernelSSE2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done)
+{
+    fadeKernelScalar(fades, count, now, levels, done);
+} /* fadeKernelSSE2 */
+
+
+void fadeKernelAVX2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done)
+{
+    fadeKernelScalar(fades, count, now, levels, done);
+} /* fadeKernelAVX2 */
+
+#endif
+
+
+int fadeKernelAvailable(FadeKernel kernel)
+/*
+ * Check whether this CPU can run a given kernel.
+ *
+ *    params : kernel == one of the fadeKernel*() functions.
+ *   returns : non-zero if (kernel) is usable, zero otherwise.
+ */
+{
+    if (kernel == fadeKernelScalar)
+        return(1);
+
+#ifdef FADE_KERNEL_X86
+    __builtin_cpu_init();
+    if (kernel == fadeKernelSSE2)
+        return(__builtin_cpu_supports("sse2"));
+    if (kernel == fadeKernelAVX2)
+        return(__builtin_cpu_supports("avx2"));
+#endif
+
+    return(0);
+} /* fadeKernelAvailable */
+
+
+FadeKernel fadeKernelSelect(const char **name)
+/*
+ * Pick the fastest kernel this CPU supports. Setting the environment
+ *  variable DIMMER_SIMD to "scalar", "sse2" or "avx2" overrides the
+ *  choice (if the CPU can actually run it), which is handy for
+ *  comparing them.
+ *
+ *    params : name == if not NULL, filled in with the kernel's name.
+ *   returns : the kernel to use.
+ */
+{
+    static const struct { const char *name; FadeKernel kernel; } kernels[] =
+    {
+        { "avx2", fadeKernelAVX2 },
+        { "sse2", fadeKernelSSE2 },
+        { "scalar", fadeKernelScalar }
+    };
+    const int total = sizeof (kernels) / sizeof (kernels[0]);
+    const char *want = getenv("DIMMER_SIMD");
+    int i;
+
+    if (want != NULL)
+    {
+        for (i = 0; i < total; i++)
+        {
+            if ((strcmp(want, kernels[i].name) == 0) &&
+                (fadeKernelAvailable(kernels[i].kernel)))
+                break;
+        } /* for */
+
+        if (i == total)
+            want = NULL;   /* bogus or unsupported; pick for ourselves. */
+    } /* if */
+
+    if (want == NULL)
+    {
+        for (i = 0; i < total; i++)
+        {
+            if (fadeKernelAvailable(kernels[i].kernel))
+                break;
+        } /* for */
+    } /* if */
+
+    if (name != NULL)
+        *name = kernels[i].name;
+
+    return(kernels[i].kernel);
+} /* fadeKernelSelect */
+
+/* end of fade_kernel.c ... */
+
@@ -0,0 +1,62 @@
+/*
+ * Internal declarations for the fade evaluation kernels. Not part of
+ *  the public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_FADE_KERNEL_H_
+#define _INCLUDE_FADE_KERNEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Running fades, structure-of-arrays style, so a kernel can chew
+     *  through several of them per instruction. Times are "fade ticks"
+     *  (milliseconds on a wrapping 32-bit clock); only differences between
+     *  them are meaningful.
+     */
+struct FadeArrays
+{
+    int *channel;                /* patched channel each slot drives.     */
+    int *startLevel;             /* 0-255, where the fade began.          */
+    int *endLevel;               /* 0-255, where it ends.                 */
+    int *startTime;              /* tick when the level started moving.   */
+    int *duration;               /* ticks from start to end.              */
+    unsigned int *invDuration;   /* (2^32 / duration), for the multiply.  */
+    unsigned char *curve;        /* DIMMER_FADE_* shape.                  */
+};
+
+
+    /*
+     * Evaluate (count) fades at tick (now). Writes each fade's level to
+     *  (levels), and a 1 to (done) for fades that have reached their
+     *  destination (0 otherwise).
+     */
+typedef void (*FadeKernel)(const struct FadeArrays *fades, int count,
+                           int now, unsigned char *levels,
+                           unsigned char *done);
+
+void fadeKernelScalar(const struct FadeArrays *fades, int count, int now,
+                      unsigned char *levels, unsigned char *done);
+void fadeKernelSSE2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done);
+void fadeKernelAVX2(const struct FadeArrays *fades, int count, int now,
+                    unsigned char *levels, unsigned char *done);
+
+int fadeKernelAvailable(FadeKernel kernel);
+FadeKernel fadeKernelSelect(const char **name);
+unsigned int fadeInverseDuration(int duration);
+int fadeCurve(int curve, int frac);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_FADE_KERNEL_H_ */
+
+/* end of fade_kernel.h ... */
+
@@ -0,0 +1,211 @@
+/*
+ * Lock-free frame handoff for libdimmer. See frame_exchange.h.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "frame_exchange.h"
+
+    /* set in (state) when the middle buffer hasn't been picked up yet. */
+#define FRAME_FRESH  4
+#define FRAME_INDEX  3
+
+    /* keep each buffer on its own cache lines. */
+#define FRAME_ALIGN  64
+
+    /* looks at the shared words before deciding they're garbage. */
+#define FRAME_ATTACH_TRIES  1000
+
+
+int frameExchangeStride(int size)
+{
+    int stride = (size + (FRAME_ALIGN - 1)) & ~(FRAME_ALIGN - 1);
+    return((stride == 0) ? FRAME_ALIGN : stride);
+} /* frameExchangeStride */
+
+
+int frameExchangeInit(struct FrameExchange *x, int size)
+/*
+ * Allocate three zeroed frames of (size) bytes.
+ *
+ *    params : x    == exchange to set up. Any old buffers are NOT freed.
+ *             size == bytes per frame.
+ *   returns : -1 on error, 0 on success.
+ */
+{
+    size_t stride = (size_t) frameExchangeStride(size);
+    void *block;
+    int i;
+
+    if (posix_memalign(&block, FRAME_ALIGN, stride * 3) != 0)
+        return(-1);
+
+    memset(block, '\0', stride * 3);
+    x->block = (unsigned char *) block;
+    for (i = 0; i < 3; i++)
+        x->buffers[i] = x->block + (stride * i);
+
+    x->size = size;
+    x->front = 0;
+    x->localState = 1;
+    x->state = &x->localState;
+    x->sharedFront = NULL;
+    x->back = 2;
+    return(0);
+} /* frameExchangeInit */
+
+
+int frameExchangeAttach(struct FrameExchange *x, unsigned char *block,
+                        int size, unsigned int *state,
+                        unsigned int *sharedFront, int consumer)
+/*
+ * Use frames that live somewhere else, such as shared memory. See
+ *  frame_exchange.h. frameExchangeFree() won't free (block). The other
+ *  process is trusted with the levels, but not with the indexes; words
+ *  that don't name a buffer are refused here, and ignored afterwards.
+ *
+ *    params : x           == exchange to set up.
+ *             block       == the three frames.
+ *             size        == bytes per frame.
+ *             state       == the shared state word.
+ *             sharedFront == the shared word holding the consumer's frame.
+ *             consumer    == non-zero to attach as consumer, else producer.
+ *   returns : -1 if the shared words are garbage, 0 otherwise.
+ */
+{
+    size_t stride = (size_t) frameExchangeStride(size);
+    unsigned int middle = 0;
+    unsigned int front = 0;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        x->buffers[i] = block + (stride * i);
+
+    x->block = NULL;
+    x->size = size;
+    x->state = state;
+    x->sharedFront = sharedFront;
+    x->localState = 0;
+    x->back = x->front = -1;
+
+    if (consumer)
+    {
+        front = __atomic_load_n(sharedFront, __ATOMIC_ACQUIRE);
+        if (front > 2)
+            return(-1);
+        x->front = (int) front;
+    } /* if */
+    else
+    {
+            /*
+             * The consumer only ever swaps its frame with the middle one,
+             *  so the back buffer is whichever is neither. If we catch it
+             *  halfway through a swap, both words name the same buffer;
+             *  just look again.
+             */
+        for (i = 0; i < FRAME_ATTACH_TRIES; i++)
+        {
+            middle = __atomic_load_n(state, __ATOMIC_ACQUIRE) & FRAME_INDEX;
+            front = __atomic_load_n(sharedFront, __ATOMIC_ACQUIRE);
+            if (middle != front)
+                break;
+        } /* for */
+
+        if ((middle > 2) || (front > 2) || (middle == front))
+            return(-1);
+
+        x->back = (int) (3 - middle - front);
+    } /* else */
+
+    return(0);
+} /* frameExchangeAttach */
+
+
+void frameExchangeFree(struct FrameExchange *x)
+{
+    free(x->block);     /* NULL when attached. */
+    memset(x, '\0', sizeof (struct FrameExchange));
+} /* frameExchangeFree */
+
+
+void frameExchangeMove(struct FrameExchange *to, struct FrameExchange *from)
+/*
+ * Move an exchange to another struct, leaving (from) empty. A plain copy
+ *  won't do; an exchange that isn't attached points into itself. Nobody
+ *  may be using either side meanwhile.
+ */
+{
+    memcpy(to, from, sizeof (struct FrameExchange));
+    if (from->state == &from->localState)
+        to->state = &to->localState;
+    memset(from, '\0', sizeof (struct FrameExchange));
+} /* frameExchangeMove */
+
+
+unsigned char *frameExchangeBack(struct FrameExchange *x)
+/*
+ * Producer only: the buffer to fill in before frameExchangePublish().
+ *  Its contents are whatever some older frame left there.
+ */
+{
+    return(x->buffers[x->back]);
+} /* frameExchangeBack */
+
+
+void frameExchangePublish(struct FrameExchange *x)
+/*
+ * Producer only: make the back buffer the newest frame, and take the
+ *  old middle buffer (which the consumer either never saw or is done
+ *  with) as the new back buffer.
+ */
+{
+    unsigned int old = __atomic_exchange_n(x->state,
+                                           (unsigned int) x->back | FRAME_FRESH,
+                                           __ATOMIC_ACQ_REL);
+
+        /* only a garbled shared word says 3; then keep the one we had. */
+    if ((old & FRAME_INDEX) <= 2)
+        x->back = (int) (old & FRAME_INDEX);
+} /* frameExchangePublish */
+
+
+int frameExchangeTaken(struct FrameExchange *x)
+/*
+ * Producer only: has the consumer picked up the newest published frame?
+ *  Once it has, that stays true until the next frameExchangePublish().
+ *
+ *   returns : non-zero if it has, zero if that frame is still waiting.
+ */
+{
+    return((__atomic_load_n(x->state, __ATOMIC_ACQUIRE) & FRAME_FRESH) == 0);
+} /* frameExchangeTaken */
+
+
+unsigned char *frameExchangeLatest(struct FrameExchange *x)
+/*
+ * Consumer only: the newest published frame. If nothing was published
+ *  since the last call, this is the same frame as last time. The buffer
+ *  stays valid and unchanged until the next call.
+ */
+{
+    unsigned int old;
+
+    if (__atomic_load_n(x->state, __ATOMIC_ACQUIRE) & FRAME_FRESH)
+    {
+        old = __atomic_exchange_n(x->state, (unsigned int) x->front,
+                                  __ATOMIC_ACQ_REL);
+        if ((old & FRAME_INDEX) <= 2)   /* as in frameExchangePublish(). */
+            x->front = (int) (old & FRAME_INDEX);
+        if (x->sharedFront != NULL)
+            __atomic_store_n(x->sharedFront, (unsigned int) x->front,
+                             __ATOMIC_RELEASE);
+    } /* if */
+
+    return(x->buffers[x->front]);
+} /* frameExchangeLatest */
+
+/* end of frame_exchange.c ... */
+
@@ -0,0 +1,66 @@
+/*
+ * Internal declarations for the frame exchange, which hands complete
+ *  frames of levels from the thread that cooks them to the thread that
+ *  sends them. Not part of the public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_FRAME_EXCHANGE_H_
+#define _INCLUDE_FRAME_EXCHANGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * A triple buffer. The producer fills its back buffer and publishes
+     *  it; the consumer grabs the newest published frame whenever it
+     *  wants one. Each side owns one buffer outright, and the third is
+     *  traded through (state) with a single atomic exchange, so neither
+     *  side ever waits for the other, and the consumer can never see a
+     *  frame the producer is still writing. There must be exactly one
+     *  producer thread and one consumer thread.
+     */
+struct FrameExchange
+{
+    unsigned char *buffers[3];
+    unsigned char *block;       /* one allocation holding all three.      */
+    int size;                   /* bytes per frame.                       */
+    unsigned int *state;        /* middle buffer's index | FRAME_FRESH.   */
+    unsigned int *sharedFront;  /* where the consumer posts (front).      */
+    unsigned int localState;    /* (state) points here unless attached.   */
+    int back;                   /* producer's buffer. Producer only.      */
+    int front;                  /* consumer's buffer. Consumer only.      */
+};
+
+    /*
+     * Frames in memory shared between processes, as the device process
+     *  uses them: three frames, each frameExchangeStride() bytes apart,
+     *  plus two words for (state) and (sharedFront), which whoever creates
+     *  the memory must set to 1 and 0. One process attaches as producer,
+     *  another as consumer. A producer can attach in place of one that
+     *  died, and carries on without disturbing the consumer.
+     */
+int frameExchangeStride(int size);
+int frameExchangeAttach(struct FrameExchange *x, unsigned char *block,
+                        int size, unsigned int *state,
+                        unsigned int *sharedFront, int consumer);
+
+int frameExchangeInit(struct FrameExchange *x, int size);
+void frameExchangeFree(struct FrameExchange *x);
+void frameExchangeMove(struct FrameExchange *to, struct FrameExchange *from);
+unsigned char *frameExchangeBack(struct FrameExchange *x);
+void frameExchangePublish(struct FrameExchange *x);
+int frameExchangeTaken(struct FrameExchange *x);
+unsigned char *frameExchangeLatest(struct FrameExchange *x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_FRAME_EXCHANGE_H_ */
+
+/* end of frame_exchange.h ... */
+
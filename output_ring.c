@@ -0,0 +1,535 @@
+/*
+ * Asynchronous output for device modules. See output_ring.h.
+ *
+ * There's no liburing here; io_uring is small enough to drive with its
+ *  three system calls and the rings it shares with us.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "output_ring.h"
+#include "trace.h"
+
+#define PACKET_ALIGN  64
+
+    /* (user_data) of a cancel; reapCompletions() skips anything past count. */
+#define CANCEL_DATA  (~0ULL)
+
+    /* how long outputRingStop() waits for the kernel to let go. */
+#define DRAIN_MSECS  1000
+
+
+static int ringSetup(unsigned int entries, struct io_uring_params *params)
+{
+    return((int) syscall(__NR_io_uring_setup, entries, params));
+} /* ringSetup */
+
+
+static int ringEnter(int fd, unsigned int toSubmit)
+{
+    int rc;
+
+    do
+    {
+        rc = (int) syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, NULL, 0);
+    } while ((rc == -1) && (errno == EINTR));
+
+    return(rc);
+} /* ringEnter */
+
+
+static int ringRegister(int fd, unsigned int opcode, void *arg,
+                        unsigned int count)
+{
+    return((int) syscall(__NR_io_uring_register, fd, opcode, arg, count));
+} /* ringRegister */
+
+
+static void unmapRings(struct OutputRing *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqesSize);
+    if ((ring->cqRing != NULL) && (ring->cqRing != ring->sqRing))
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL)
+        munmap(ring->sqRing, ring->sqRingSize);
+
+    ring->sqes = ring->cqRing = ring->sqRing = NULL;
+    if (ring->ringFD != -1)
+        close(ring->ringFD);
+    ring->ringFD = -1;
+} /* unmapRings */
+
+
+static int mapRings(struct OutputRing *ring)
+/*
+ * Set up an io_uring big enough for a write per output, plus slack,
+ *  and map its rings.
+ *
+ *   returns : -1 on error, 0 on success.
+ */
+{
+    struct io_uring_params params;
+    unsigned char *sq;
+    unsigned char *cq;
+    unsigned int entries = 8;
+    struct iovec iov[DIMMER_MAX_ASYNC_OUTPUTS];
+    int i;
+
+    while (entries < (unsigned int) (ring->count * 2))
+        entries *= 2;
+
+    memset(&params, '\0', sizeof (params));
+    ring->ringFD = ringSetup(entries, &params);
+    if (ring->ringFD == -1)
+        return(-1);
+
+    ring->sqRingSize = params.sq_off.array + (params.sq_entries *
+                                              sizeof (unsigned int));
+    ring->cqRingSize = params.cq_off.cqes + (params.cq_entries *
+                                             sizeof (struct io_uring_cqe));
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    } /* if */
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ringFD,
+                        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        ring->sqRing = NULL;
+        unmapRings(ring);
+        return(-1);
+    } /* if */
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->ringFD,
+                            IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+        {
+            ring->cqRing = NULL;
+            unmapRings(ring);
+            return(-1);
+        } /* if */
+    } /* else */
+
+    ring->sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ringFD,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        unmapRings(ring);
+        return(-1);
+    } /* if */
+
+    sq = (unsigned char *) ring->sqRing;
+    cq = (unsigned char *) ring->cqRing;
+    ring->sqHead = (unsigned int *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned int *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+        /* pipes and ttys have no offset; -1 means "wherever it is now." */
+    ring->offset = (params.features & IORING_FEAT_RW_CUR_POS) ?
+                        (unsigned long long) -1 : 0;
+
+        /*
+         * Registered buffers save the kernel mapping our pages on every
+         *  write. They count against RLIMIT_MEMLOCK on older kernels, so
+         *  carry on with ordinary writes if that's all we can get.
+         */
+    for (i = 0; i < ring->count; i++)
+    {
+        iov[i].iov_base = ring->packets + (i * ring->packetStride);
+        iov[i].iov_len = ring->packetStride;
+    } /* for */
+    ring->fixedBuffers = (ringRegister(ring->ringFD, IORING_REGISTER_BUFFERS,
+                                       iov, ring->count) == 0);
+    return(0);
+} /* mapRings */
+
+
+int outputRingStart(struct OutputRing *ring,
+                    const struct DimmerAsyncOutput *outputs, int count)
+/*
+ * Get ready to write frames to (outputs).
+ *
+ *    params : ring    == ring to set up.
+ *             outputs == what the device module's queryAsyncOutputs()
+ *                         gave us. Copied.
+ *             count   == number of (outputs).
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ *     errno : EINVAL (bad (count) or header size.)
+ *             ENOMEM (out of memory.)
+ */
+{
+    void *block;
+    int i;
+
+    memset(ring, '\0', sizeof (struct OutputRing));
+    ring->ringFD = -1;
+
+    if ((count <= 0) || (count > DIMMER_MAX_ASYNC_OUTPUTS))
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    for (i = 0; i < count; i++)
+    {
+        if ((outputs[i].headerSize < 0) ||
+            (outputs[i].headerSize > DIMMER_MAX_PACKET_HEADER))
+        {
+            errno = EINVAL;
+            return(-1);
+        } /* if */
+    } /* for */
+
+    ring->packetStride = (DIMMER_MAX_PACKET_HEADER + DIMMER_UNIVERSE_SIZE +
+                          (PACKET_ALIGN - 1)) & ~(PACKET_ALIGN - 1);
+    if (posix_memalign(&block, PACKET_ALIGN, ring->packetStride * count) != 0)
+    {
+        errno = ENOMEM;
+        return(-1);
+    } /* if */
+
+    ring->packets = (unsigned char *) block;
+    memset(ring->packets, '\0', ring->packetStride * count);
+    memcpy(ring->outputs, outputs, sizeof (struct DimmerAsyncOutput) * count);
+    ring->count = count;
+
+    for (i = 0; i < count; i++)
+    {
+        memcpy(ring->packets + (i * ring->packetStride), outputs[i].header,
+               outputs[i].headerSize);
+        ring->slots[i] = DIMMER_UNIVERSE_SIZE;
+    } /* for */
+
+    if (mapRings(ring) == -1)
+        ring->ringFD = -1;   /* no io_uring here; plain write()s it is. */
+
+    return(0);
+} /* outputRingStart */
+
+
+void outputRingSetSlots(struct OutputRing *ring, int universe, int slots)
+/*
+ * From the next frame on, only send the first (slots) levels of
+ *  (universe), to every output that carries it.
+ */
+{
+    int i;
+
+    if (slots < 1)
+        slots = 1;
+    else if (slots > DIMMER_UNIVERSE_SIZE)
+        slots = DIMMER_UNIVERSE_SIZE;
+
+    for (i = 0; i < ring->count; i++)
+    {
+        if (ring->outputs[i].universe == universe)
+            ring->slots[i] = slots;
+    } /* for */
+} /* outputRingSetSlots */
+
+
+static inline void countError(struct OutputRing *ring)
+{
+        /* only the ring's own thread writes it, so no locked add. */
+    __atomic_store_n(&ring->errors, ring->errors + 1, __ATOMIC_RELAXED);
+} /* countError */
+
+
+static struct io_uring_sqe *queueEntry(struct OutputRing *ring)
+/*
+ * The next free submission queue entry, zeroed. It goes to the kernel
+ *  with the next enterQueued(). There's always room: each output has at
+ *  most one write and one cancel queued, and the ring holds twice that.
+ */
+{
+    unsigned int tail = *ring->sqTail;
+    unsigned int index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = ((struct io_uring_sqe *) ring->sqes) + index;
+
+    memset(sqe, '\0', sizeof (struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return(sqe);
+} /* queueEntry */
+
+
+static void queueWrite(struct OutputRing *ring, int i)
+/*
+ * Queue a write of whatever's left of output (i)'s packet.
+ */
+{
+    struct io_uring_sqe *sqe = queueEntry(ring);
+    unsigned char *packet = ring->packets + (i * ring->packetStride);
+
+    sqe->opcode = ring->fixedBuffers ? IORING_OP_WRITE_FIXED :
+                                       IORING_OP_WRITE;
+    sqe->fd = ring->outputs[i].fd;
+    sqe->off = ring->offset;
+    packet += ring->written[i];
+    sqe->addr = (unsigned long long) (unsigned long) packet;
+    sqe->len = ring->lengths[i] - ring->written[i];
+    sqe->buf_index = (unsigned short) i;
+    sqe->user_data = (unsigned long long) i;
+    ring->inFlight[i] = 1;
+} /* queueWrite */
+
+
+static int enterQueued(struct OutputRing *ring)
+/*
+ * Hand the kernel everything queued that it hasn't taken yet. Entries
+ *  left over when this fails stay queued, and go with the next call.
+ *
+ *   returns : -1 on error, 0 on success. (errno) set on error.
+ */
+{
+    unsigned int queued = *ring->sqTail -
+                          __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    if ((queued > 0) && (ringEnter(ring->ringFD, queued) == -1))
+        return(-1);
+
+    return(0);
+} /* enterQueued */
+
+
+static void reapCompletions(struct OutputRing *ring, int finishPackets)
+/*
+ * Pick up finished writes. If a port took only part of a packet, the
+ *  rest is queued right away (unless (finishPackets) is zero), and the
+ *  output stays in flight until it's all gone.
+ */
+{
+    unsigned int head = *ring->cqHead;
+    unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    int i;
+
+    while (head != tail)
+    {
+        cqe = ((struct io_uring_cqe *) ring->cqes) + (head & *ring->cqMask);
+        head++;
+        if (cqe->user_data >= (unsigned long long) ring->count)
+            continue;   /* a cancel. */
+
+        i = (int) cqe->user_data;
+        ring->inFlight[i] = 0;
+        if (cqe->res < 0)
+        {
+            TRACE(TRACE_DEVICE_ERROR, -cqe->res, TRACE_CALL_UPDATE);
+            countError(ring);
+        } /* if */
+        else
+        {
+            ring->written[i] += cqe->res;
+            if ((ring->written[i] < ring->lengths[i]) && (finishPackets))
+                queueWrite(ring, i);
+        } /* else */
+    } /* while */
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+} /* reapCompletions */
+
+
+static int submitUring(struct OutputRing *ring, const unsigned char *levels)
+{
+    struct DimmerAsyncOutput *out;
+    unsigned char *packet;
+    int busy = 0;
+    int i;
+
+    reapCompletions(ring, 1);
+
+    for (i = 0; i < ring->count; i++)
+    {
+        if (ring->inFlight[i])
+        {
+            busy++;    /* still writing the last one; skip this frame. */
+            continue;
+        } /* if */
+
+        out = &ring->outputs[i];
+        packet = ring->packets + (i * ring->packetStride);
+        memcpy(packet + out->headerSize,
+               levels + (out->universe * DIMMER_UNIVERSE_SIZE),
+               ring->slots[i]);
+
+        ring->lengths[i] = out->headerSize + ring->slots[i];
+        ring->written[i] = 0;
+        queueWrite(ring, i);
+    } /* for */
+
+        /* if the kernel turned us away last time, those go now, too. */
+    if (enterQueued(ring) == -1)
+    {
+        TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_UPDATE);
+        countError(ring);
+        return(-1);
+    } /* if */
+
+    return(busy);
+} /* submitUring */
+
+
+static int submitWrites(struct OutputRing *ring, const unsigned char *levels)
+{
+    struct DimmerAsyncOutput *out;
+    unsigned char *packet;
+    ssize_t len;
+    int busy = 0;
+    int i;
+
+    for (i = 0; i < ring->count; i++)
+    {
+        out = &ring->outputs[i];
+        packet = ring->packets + (i * ring->packetStride);
+
+        if (!ring->inFlight[i])
+        {
+            memcpy(packet + out->headerSize,
+                   levels + (out->universe * DIMMER_UNIVERSE_SIZE),
+                   ring->slots[i]);
+            ring->lengths[i] = out->headerSize + ring->slots[i];
+            ring->written[i] = 0;
+        } /* if */
+        else
+            busy++;   /* the rest of an old packet goes instead. */
+
+        len = write(out->fd, packet + ring->written[i],
+                    ring->lengths[i] - ring->written[i]);
+        if (len >= 0)
+            ring->written[i] += len;
+        else if (errno == EAGAIN)
+        {
+            if (!ring->inFlight[i])
+                busy++;
+            continue;
+        } /* else if */
+        else
+        {
+            TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_UPDATE);
+            countError(ring);
+            ring->written[i] = ring->lengths[i];   /* give up on it. */
+        } /* else */
+
+            /* a port that took part of it gets the rest first, next time. */
+        ring->inFlight[i] = (ring->written[i] < ring->lengths[i]);
+    } /* for */
+
+    return(busy);
+} /* submitWrites */
+
+
+static int drainRing(struct OutputRing *ring)
+/*
+ * Cancel every write still in flight, and wait for the kernel to be
+ *  done with them, so their buffers can be freed.
+ *
+ *   returns : -1 if something was still in flight after DRAIN_MSECS,
+ *              0 once nothing is.
+ */
+{
+    struct timespec nap = { 0, 1000000 };
+    struct io_uring_sqe *sqe;
+    int pending;
+    int tries;
+    int i;
+
+    for (tries = 0; tries <= DRAIN_MSECS; tries++)
+    {
+        reapCompletions(ring, 0);
+        for (i = pending = 0; i < ring->count; i++)
+            pending += ring->inFlight[i];
+
+        if (pending == 0)
+            return(0);
+
+        if (tries == 0)
+        {
+            for (i = 0; i < ring->count; i++)
+            {
+                if (ring->inFlight[i])
+                {
+                    sqe = queueEntry(ring);
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = (unsigned long long) i;
+                    sqe->user_data = CANCEL_DATA;
+                } /* if */
+            } /* for */
+        } /* if */
+
+        enterQueued(ring);   /* anything never submitted goes, then stops. */
+        nanosleep(&nap, NULL);
+    } /* for */
+
+    return(-1);
+} /* drainRing */
+
+
+void outputRingStop(struct OutputRing *ring)
+/*
+ * Tear down (ring). Writes still in flight are cancelled, and waited
+ *  for; if the kernel still hasn't let go of them after a second, the
+ *  packets are leaked rather than freed out from under it.
+ */
+{
+    if (ring->packets == NULL)
+        return;   /* never started. */
+
+    if ((ring->ringFD != -1) && (drainRing(ring) == -1))
+    {
+        TRACE(TRACE_DEVICE_ERROR, EBUSY, TRACE_CALL_UPDATE);
+        ring->packets = NULL;   /* the kernel may still be reading them. */
+    } /* if */
+
+    unmapRings(ring);
+    free(ring->packets);
+    memset(ring, '\0', sizeof (struct OutputRing));
+    ring->ringFD = -1;
+} /* outputRingStop */
+
+
+int outputRingSubmit(struct OutputRing *ring, const unsigned char *levels)
+/*
+ * Send a frame to every output that's ready for one. Never waits.
+ *
+ *    params : ring   == ring to write through.
+ *             levels == the frame; each output takes its own universe.
+ *   returns : number of outputs too busy to take this frame, -1 on error.
+ *              (errno) set on error.
+ */
+{
+    if (ring->ringFD != -1)
+        return(submitUring(ring, levels));
+    return(submitWrites(ring, levels));
+} /* outputRingSubmit */
+
+/* end of output_ring.c ... */
+
@@ -0,0 +1,75 @@
+/*
+ * Internal declarations for output rings, which write each frame's
+ *  universes to a device module's file descriptors asynchronously, so a
+ *  slow port never holds up the frame clock. Not part of the public
+ *  libdimmer API; device modules opt in with queryAsyncOutputs().
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_OUTPUT_RING_H_
+#define _INCLUDE_OUTPUT_RING_H_
+
+#include "dimmer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Writes go through io_uring where the kernel has it, from buffers
+     *  registered with it up front: submitting a frame is a memcpy per
+     *  output and one system call that never blocks, and completions are
+     *  picked up from shared memory without any. Where io_uring isn't
+     *  available, each output gets a plain nonblocking write() instead.
+     *  An output whose last write is still in flight sits the frame out.
+     *  A packet is never left half sent: if a port only takes part of
+     *  one, the rest goes out before anything else does. Only one thread
+     *  may use a ring.
+     */
+struct OutputRing
+{
+    int count;                  /* outputs; 0 if the ring isn't running.   */
+    struct DimmerAsyncOutput outputs[DIMMER_MAX_ASYNC_OUTPUTS];
+    unsigned char *packets;     /* header + levels, one packet per output. */
+    int packetStride;
+    int slots[DIMMER_MAX_ASYNC_OUTPUTS];   /* levels sent per packet.     */
+    unsigned char inFlight[DIMMER_MAX_ASYNC_OUTPUTS];
+    int lengths[DIMMER_MAX_ASYNC_OUTPUTS];  /* bytes in the packet going. */
+    int written[DIMMER_MAX_ASYNC_OUTPUTS];  /* how many of them went.     */
+    unsigned long long errors;  /* writes that failed; others may read it. */
+
+    int ringFD;                 /* io_uring, or -1 for plain write()s.     */
+    int fixedBuffers;           /* (packets) registered with the kernel.   */
+    unsigned long long offset;  /* file offset passed with each write.     */
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    void *sqes;
+    size_t sqesSize;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqArray;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    void *cqes;
+};
+
+int outputRingStart(struct OutputRing *ring,
+                    const struct DimmerAsyncOutput *outputs, int count);
+void outputRingStop(struct OutputRing *ring);
+void outputRingSetSlots(struct OutputRing *ring, int universe, int slots);
+int outputRingSubmit(struct OutputRing *ring, const unsigned char *levels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_OUTPUT_RING_H_ */
+
+/* end of output_ring.h ... */
+
@@ -0,0 +1,739 @@
+/*
+ * libdimmer's side of talking to the device process. See
+ *  docs/overview.txt for the big picture.
+ *
+ * To the rest of libdimmer, the device process is just another device
+ *  module, "device_process". Control messages (what devices are there,
+ *  initialize one, etc) go down the named pipes as pcmsg_t bytes. Levels
+ *  never do: the device process creates a shared memory segment holding
+ *  a FrameExchange, dimmer.c publishes cooked frames straight into it,
+ *  and the device process sends them straight out of it. The only thing
+ *  that crosses per frame is a futex wake.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "boolean.h"
+#include "dimmer.h"
+#include "process_communication.h"
+#include "trace.h"
+
+    /* how long to wait on the device process before giving up on it. */
+#define PC_TIMEOUT_MS  2000
+
+static int requestPipe = -1;
+static int responsePipe = -1;
+static struct PcShared *shared = NULL;
+static size_t sharedSize = 0;
+
+
+int pcPath(char *buffer, int bufSize, const char *name)
+/*
+ * Build the path of one of the files the device process and libdimmer
+ *  meet at. Each user gets their own directory, so one user's lights
+ *  aren't another's: "libdimmer" in $XDG_RUNTIME_DIR if there is one,
+ *  "/tmp/libdimmer-<uid>" otherwise. Both sides have to agree on
+ *  $XDG_RUNTIME_DIR, which a spawned device process does. Nothing in
+ *  the directory is to be trusted until pcCheckDir() says so.
+ *
+ *    params : buffer  == where to put the path.
+ *             bufSize == size of (buffer).
+ *             name    == PC_REQUEST_PIPE, etc. NULL for the directory.
+ *   returns : -1 if (buffer) is too small, 0 otherwise.
+ */
+{
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if ((runtimeDir != NULL) && (runtimeDir[0] == '/'))
+        len = snprintf(buffer, bufSize, "%s/libdimmer", runtimeDir);
+    else
+        len = snprintf(buffer, bufSize, "/tmp/libdimmer-%d", (int) getuid());
+
+    if ((len >= 0) && (len < bufSize) && (name != NULL))
+        len += snprintf(buffer + len, bufSize - len, "/%s", name);
+
+    return(((len < 0) || (len >= bufSize)) ? -1 : 0);
+} /* pcPath */
+
+
+int pcCheckDir(__boolean create)
+/*
+ * Make sure the rendezvous directory is ours alone before anything in
+ *  it is opened: a real directory, not a symlink, owned by us, and shut
+ *  to everybody else. In /tmp, anybody could have made it first.
+ *
+ *    params : create == __true to make the directory if it isn't there.
+ *   returns : -1 on error, 0 if it's safe. (errno) set on error.
+ *     errno : EPERM (it's somebody else's, or others can get in.)
+ *             anything mkdir() or lstat() sets.
+ */
+{
+    char path[128];
+    struct stat statbuf;
+
+    if (pcPath(path, sizeof (path), NULL) == -1)
+    {
+        errno = ENAMETOOLONG;
+        return(-1);
+    } /* if */
+
+    if ((create) && (mkdir(path, 0700) == -1) && (errno != EEXIST))
+        return(-1);
+
+    if (lstat(path, &statbuf) == -1)
+        return(-1);
+
+    if ((!S_ISDIR(statbuf.st_mode)) || (statbuf.st_uid != getuid()) ||
+        ((statbuf.st_mode & 077) != 0))
+    {
+        errno = EPERM;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* pcCheckDir */
+
+
+int pcSharedName(char *buffer, int bufSize, int attempt)
+/*
+ * Name a shared memory segment for the device process to create. The
+ *  first choice is the same every time, so a device process can clean
+ *  up after one that crashed; after that they're random, so somebody
+ *  squatting on a name can't keep the device process from starting.
+ *  libdimmer asks which one it got with PCMSG_QUERY_SHARED.
+ *
+ *    params : buffer  == where to put the name.
+ *             bufSize == size of (buffer).
+ *             attempt == 0 for the first choice, more for the others.
+ *   returns : -1 if (buffer) is too small, 0 otherwise.
+ */
+{
+    unsigned long long noise;
+    struct timespec now;
+    int len;
+
+    if (attempt == 0)
+        len = snprintf(buffer, bufSize, "/libdimmer-%d", (int) getuid());
+    else
+    {
+        if (getrandom(&noise, sizeof (noise), GRND_NONBLOCK) !=
+                sizeof (noise))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            noise = (((unsigned long long) now.tv_sec << 30) ^
+                     (unsigned long long) now.tv_nsec ^
+                     ((unsigned long long) getpid() << 48));
+        } /* if */
+
+        len = snprintf(buffer, bufSize, "/libdimmer-%d-%016llx",
+                       (int) getuid(), noise);
+    } /* else */
+
+    return(((len < 0) || (len >= bufSize)) ? -1 : 0);
+} /* pcSharedName */
+
+
+size_t pcSharedSize(int frameSize)
+{
+    return(PC_FRAMES_OFFSET + ((size_t) frameExchangeStride(frameSize) * 3));
+} /* pcSharedSize */
+
+
+int pcFutexWait(unsigned int *word, unsigned int val,
+                const struct timespec *deadline)
+/*
+ * Sleep until someone calls pcFutexWake() on (word), or until the
+ *  absolute CLOCK_MONOTONIC time (deadline), unless (*word) isn't (val)
+ *  to begin with. Works across processes.
+ *
+ *    params : word     == futex word, in shared memory.
+ *             val      == what we expect (*word) to still be.
+ *             deadline == when to give up. NULL to wait forever.
+ *   returns : 0 if woken, -1 otherwise. (errno) is ETIMEDOUT if the
+ *              deadline passed, EAGAIN if (*word) had already changed.
+ */
+{
+    return((int) syscall(SYS_futex, word, FUTEX_WAIT_BITSET, val,
+                         deadline, NULL, FUTEX_BITSET_MATCH_ANY));
+} /* pcFutexWait */
+
+
+void pcFutexWake(unsigned int *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+} /* pcFutexWake */
+
+
+static int pcSend(const void *buf, size_t len)
+/*
+ * Write to the request pipe. If the device process has died, that
+ *  raises SIGPIPE, which would kill the application; it's blocked for
+ *  the duration, and any that turns up is swallowed.
+ */
+{
+    const unsigned char *ptr = (const unsigned char *) buf;
+    const struct timespec noWait = { 0, 0 };
+    sigset_t pipeSet;
+    sigset_t oldSet;
+    int retVal = 0;
+    ssize_t rc;
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+
+    while (len > 0)
+    {
+        rc = write(requestPipe, ptr, len);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EPIPE)
+            {
+                sigtimedwait(&pipeSet, NULL, &noWait);
+                errno = EPIPE;
+            } /* if */
+            TRACE(TRACE_DEVICE_ERROR, errno, TRACE_CALL_PIPE);
+            retVal = -1;
+            break;
+        } /* if */
+
+        ptr += rc;
+        len -= rc;
+    } /* while */
+
+    pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+    return(retVal);
+} /* pcSend */
+
+
+static int pcReceive(void *buf, size_t len)
+/*
+ * Read exactly (len) bytes of response, or fail if the device process
+ *  doesn't come through with them in PC_TIMEOUT_MS.
+ */
+{
+    unsigned char *ptr = (unsigned char *) buf;
+    struct pollfd pfd;
+    ssize_t rc;
+
+    pfd.fd = responsePipe;
+    pfd.events = POLLIN;
+
+    while (len > 0)
+    {
+        rc = poll(&pfd, 1, PC_TIMEOUT_MS);
+        if ((rc == -1) && (errno == EINTR))
+            continue;
+        if (rc <= 0)
+        {
+            errno = ETIMEDOUT;
+            return(-1);
+        } /* if */
+
+        rc = read(responsePipe, ptr, len);
+        if (rc == -1)
+        {
+            if ((errno == EINTR) || (errno == EAGAIN))
+                continue;
+            return(-1);
+        } /* if */
+
+        ptr += rc;
+        len -= rc;
+    } /* while */
+
+    return(0);
+} /* pcReceive */
+
+
+static int pcRequest(pcmsg_t msg, const void *args, size_t argSize)
+/*
+ * Send a message and its arguments in one write(), so it can't be
+ *  interleaved with anything else, and get the one-byte response.
+ *
+ *   params : msg     == PCMSG_* to send.
+ *            args    == arguments to follow it. May be NULL.
+ *            argSize == bytes of (args).
+ *  returns : the response, -1 on error. (errno) set on error.
+ */
+{
+    unsigned char buf[sizeof (pcmsg_t) + 16];
+    pcmsg_t response;
+
+    buf[0] = msg;
+    if (argSize > 0)
+        memcpy(buf + sizeof (pcmsg_t), args, argSize);
+
+    if (pcSend(buf, sizeof (pcmsg_t) + argSize) == -1)
+        return(-1);
+
+    if (pcReceive(&response, sizeof (response)) == -1)
+        return(-1);
+
+    return((int) response);
+} /* pcRequest */
+
+
+static void closePipes(void)
+{
+    if (requestPipe != -1)
+        close(requestPipe);
+    if (responsePipe != -1)
+        close(responsePipe);
+    requestPipe = responsePipe = -1;
+} /* closePipes */
+
+
+static int openPipes(void)
+/*
+ * Open our ends of the named pipes. Opening the request pipe fails
+ *  straight away if nothing has the other end open, which is a cheap
+ *  way to find out there's no device process.
+ */
+{
+    char path[128];
+    char junk[256];
+
+    if (pcCheckDir(__false) == -1)
+        return(-1);
+
+    pcPath(path, sizeof (path), PC_RESPONSE_PIPE);
+    responsePipe = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    if (responsePipe == -1)
+        return(-1);
+
+    pcPath(path, sizeof (path), PC_REQUEST_PIPE);
+    requestPipe = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    if (requestPipe == -1)
+    {
+        closePipes();
+        return(-1);
+    } /* if */
+
+    fcntl(requestPipe, F_SETFL, fcntl(requestPipe, F_GETFL) & ~O_NONBLOCK);
+
+        /* whoever had these pipes before us might have left a mess. */
+    while (read(responsePipe, junk, sizeof (junk)) > 0)
+        ;
+
+    return(0);
+} /* openPipes */
+
+
+static int pcAreYouAlive(void)
+{
+    pid_t pid;
+
+    if (pcRequest(PCMSG_ARE_YOU_ALIVE, NULL, 0) != PCMSG_I_AM_ALIVE)
+        return(-1);
+
+    return(pcReceive(&pid, sizeof (pid)));
+} /* pcAreYouAlive */
+
+
+static void closeInheritedFiles(void)
+/*
+ * In the child, before exec: close everything but stdin, stdout and
+ *  stderr, so the device process doesn't hold the application's files,
+ *  sockets and devices open for as long as it runs.
+ */
+{
+    long maxFd;
+    int fd;
+
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0)
+        return;
+
+    maxFd = sysconf(_SC_OPEN_MAX);   /* an older kernel; do it the slow way. */
+    for (fd = 3; fd < maxFd; fd++)
+        close(fd);
+} /* closeInheritedFiles */
+
+
+static int spawnDaemon(void)
+/*
+ * Start the device process. It's forked twice and put in a session of
+ *  its own, so it isn't our child, and outlives us no matter how we go.
+ */
+{
+    const char *path = getenv(PC_DAEMON_ENV);
+    pid_t pid;
+
+    if ((path == NULL) || (access(path, X_OK) == -1))
+    {
+        errno = ENODEV;
+        return(-1);
+    } /* if */
+
+    pid = fork();
+    if (pid == -1)
+        return(-1);
+
+    if (pid == 0)
+    {
+        setsid();
+        if (fork() == 0)
+        {
+            closeInheritedFiles();
+            execl(path, path, (char *) NULL);
+        } /* if */
+        _exit(0);
+    } /* if */
+
+    waitpid(pid, NULL, 0);
+    return(0);
+} /* spawnDaemon */
+
+
+static int connectDaemon(__boolean canSpawn)
+/*
+ * Make sure we're talking to a live device process, reattaching to a
+ *  running one if there is one, and starting one if there isn't and
+ *  (canSpawn) is set.
+ *
+ *   params : canSpawn == __true to start the device process if needed.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ */
+{
+    int i;
+
+    if (requestPipe != -1)
+    {
+        if (pcAreYouAlive() == 0)
+            return(0);
+        closePipes();
+    } /* if */
+
+    if ((openPipes() == 0) && (pcAreYouAlive() == 0))
+        return(0);
+
+    closePipes();
+    if ((!canSpawn) || (spawnDaemon() == -1))
+        return(-1);
+
+    for (i = 0; i < PC_TIMEOUT_MS / 10; i++)
+    {
+        usleep(10000);
+        if ((openPipes() == 0) && (pcAreYouAlive() == 0))
+            return(0);
+        closePipes();
+    } /* for */
+
+    errno = ETIMEDOUT;
+    return(-1);
+} /* connectDaemon */
+
+
+static void unmapShared(void)
+{
+    if (shared != NULL)
+        munmap(shared, sharedSize);
+    shared = NULL;
+    sharedSize = 0;
+} /* unmapShared */
+
+
+static int mapShared(void)
+/*
+ * Map the device process's shared memory segment, once it's told us
+ *  which one it is. A segment that isn't ours alone is turned away; it
+ *  could have been put there by anybody.
+ */
+{
+    char name[PC_SHARED_NAME_MAX];
+    struct stat statbuf;
+    void *ptr;
+    int fd;
+
+    unmapShared();
+
+    if ((pcRequest(PCMSG_QUERY_SHARED, NULL, 0) != PCMSG_COMPLIANCE) ||
+        (pcReceive(name, sizeof (name)) == -1))
+    {
+        errno = ENODEV;
+        return(-1);
+    } /* if */
+
+    name[sizeof (name) - 1] = '\0';
+    fd = shm_open(name, O_RDWR, 0600);
+    if (fd == -1)
+        return(-1);
+
+    if (fstat(fd, &statbuf) == -1)
+    {
+        close(fd);
+        return(-1);
+    } /* if */
+
+    if ((statbuf.st_uid != getuid()) || ((statbuf.st_mode & 077) != 0))
+    {
+        close(fd);
+        errno = EPERM;
+        return(-1);
+    } /* if */
+
+    if (statbuf.st_size < PC_FRAMES_OFFSET)
+    {
+        close(fd);
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    ptr = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return(-1);
+
+    shared = (struct PcShared *) ptr;
+    sharedSize = statbuf.st_size;
+    if ((shared->magic != PC_SHARED_MAGIC) ||
+        (pcSharedSize(shared->frameSize) > sharedSize))
+    {
+        unmapShared();
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* mapShared */
+
+
+int pcAttachFrames(struct FrameExchange *x, int size)
+/*
+ * Attach (x), as producer, to the device process's frames. Called
+ *  whenever dimmer.c (re)sizes its buffers.
+ *
+ *   params : x    == exchange to attach.
+ *            size == bytes per frame dimmer.c wants.
+ *  returns : -1 on error, 0 on success. (errno) set on error.
+ *    errno : EINVAL (the device process has a different frame size, or
+ *                    the shared frame indexes are garbage.)
+ */
+{
+        /* the device process makes a new segment when the device changes. */
+    if (mapShared() == -1)
+        return(-1);
+
+    if (shared->frameSize != size)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    if (frameExchangeAttach(x, ((unsigned char *) shared) + PC_FRAMES_OFFSET,
+                            size, &shared->state, &shared->front, 0) == -1)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* pcAttachFrames */
+
+
+int pcCurrentLevels(unsigned char *levels, int size)
+/*
+ * Copy out whatever the device process is sending right now. After
+ *  reattaching, dimmer.c starts from these, so the lights don't jump.
+ *
+ *   params : levels == where to put them.
+ *            size   == bytes to copy; must match the frame size.
+ *  returns : -1 on error, 0 on success.
+ */
+{
+    unsigned char *frame;
+    unsigned int front;
+
+    if ((shared == NULL) || (shared->frameSize != size))
+        return(-1);
+
+    front = __atomic_load_n(&shared->front, __ATOMIC_ACQUIRE);
+    if (front > 2)
+        return(-1);   /* not a frame; the device process is confused. */
+
+    frame = ((unsigned char *) shared) + PC_FRAMES_OFFSET +
+                ((size_t) frameExchangeStride(size) * front);
+    memcpy(levels, frame, size);
+    return(0);
+} /* pcCurrentLevels */
+
+
+static int pcInitDevice(void)
+/*
+ * Have the device process initialize the first of its device modules
+ *  that exists and will initialize.
+ */
+{
+    int count;
+    int i;
+
+    if ((pcRequest(PCMSG_QUERY_DEVMODS, NULL, 0) == -1) ||
+        (pcReceive(&count, sizeof (count)) == -1))
+        return(-1);
+
+    for (i = 0; i < count; i++)
+    {
+        if ((pcRequest(PCMSG_DEVICE_EXISTS, &i, sizeof (i)) ==
+                PCMSG_COMPLIANCE) &&
+            (pcRequest(PCMSG_INIT_DEVICE, &i, sizeof (i)) ==
+                PCMSG_COMPLIANCE))
+            return(0);
+    } /* for */
+
+    errno = ENODEV;
+    return(-1);
+} /* pcInitDevice */
+
+
+static void daemon_queryModName(char *buffer, int bufSize)
+{
+    strncpy(buffer, "device_process", bufSize);
+    buffer[bufSize - 1] = '\0';  /* promises null termination. */
+} /* daemon_queryModName */
+
+
+static int daemon_queryExistence(void)
+{
+    const char *path = getenv(PC_DAEMON_ENV);
+
+    if (connectDaemon(__false) == 0)
+        return(1);
+
+    return(((path != NULL) && (access(path, X_OK) == 0)) ? 1 : 0);
+} /* daemon_queryExistence */
+
+
+static int daemon_queryDevice(struct DimmerDeviceInfo *info)
+{
+    int rc = pcRequest(PCMSG_QUERY_DEVICE, NULL, 0);
+
+    if (rc == PCMSG_COMPLIANCE)
+        return(pcReceive(info, sizeof (struct DimmerDeviceInfo)));
+
+    if (rc != -1)
+        errno = ENODEV;
+    return(-1);
+} /* daemon_queryDevice */
+
+
+static int daemon_initialize(void)
+{
+    struct DimmerDeviceInfo info;
+
+    if (connectDaemon(__true) == -1)
+        return(-1);
+
+        /* a device already going means we're reattaching; leave it be. */
+    if ((daemon_queryDevice(&info) == -1) && (pcInitDevice() == -1))
+    {
+        closePipes();
+        return(-1);
+    } /* if */
+
+    if (mapShared() == -1)
+    {
+        closePipes();
+        return(-1);
+    } /* if */
+
+    return(0);
+} /* daemon_initialize */
+
+
+static void daemon_deinitialize(void)
+{
+        /* the device process and its device keep going without us. */
+    unmapShared();
+    closePipes();
+} /* daemon_deinitialize */
+
+
+static int daemon_channelSet(int channel, int intensity)
+{
+    unsigned char buf[sizeof (pcmsg_t) + sizeof (int) + 1];
+
+    buf[0] = PCMSG_SET_CHANNEL;
+    memcpy(buf + sizeof (pcmsg_t), &channel, sizeof (int));
+    buf[sizeof (pcmsg_t) + sizeof (int)] = (unsigned char) intensity;
+    return(pcSend(buf, sizeof (buf)));   /* no response, for speed. */
+} /* daemon_channelSet */
+
+
+static int daemon_setDuplexMode(__boolean shouldSet)
+{
+    if (pcRequest(PCMSG_SET_DUPLEX, &shouldSet, sizeof (shouldSet)) !=
+            PCMSG_COMPLIANCE)
+        return(-1);
+
+    return(0);
+} /* daemon_setDuplexMode */
+
+
+static void daemon_setUniverseSlots(int universe, int slots)
+{
+    unsigned char buf[sizeof (pcmsg_t) + (sizeof (int) * 2)];
+
+    buf[0] = PCMSG_SET_SLOTS;
+    memcpy(buf + sizeof (pcmsg_t), &universe, sizeof (int));
+    memcpy(buf + sizeof (pcmsg_t) + sizeof (int), &slots, sizeof (int));
+    pcSend(buf, sizeof (buf));   /* no response, for speed. */
+} /* daemon_setUniverseSlots */
+
+
+static void daemon_updateDevice(unsigned char *levels)
+{
+        /* (levels) is already in shared memory; just say "go." */
+    if (shared != NULL)
+    {
+        __atomic_add_fetch(&shared->kick, 1, __ATOMIC_RELEASE);
+        pcFutexWake(&shared->kick);
+    } /* if */
+} /* daemon_updateDevice */
+
+
+    /*
+     * This struct is down here so I don't need
+     *  prototypes of all these functions...
+     */
+struct DimmerDeviceFunctions daemon_funcs =   {
+                                                  daemon_queryModName,
+                                                  daemon_queryExistence,
+                                                  daemon_queryDevice,
+                                                  daemon_initialize,
+                                                  daemon_deinitialize,
+                                                  daemon_channelSet,
+                                                  daemon_setDuplexMode,
+                                                  daemon_updateDevice,
+                                                  NULL,   /* updateUniverse */
+                                                  NULL,   /* sendFrame */
+                                                  NULL,   /* queryAsyncOutputs */
+                                                  NULL,   /* sendChanges */
+                                                  daemon_setUniverseSlots
+                                              };
+
+/* end of process_communication.c ... */
+
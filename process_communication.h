@@ -0,0 +1,96 @@
+/*
+ * Internal declarations shared by libdimmer and the device process.
+ *  See docs/overview.txt. Not part of the public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_PROCESS_COMMUNICATION_H_
+#define _INCLUDE_PROCESS_COMMUNICATION_H_
+
+#include <sys/types.h>
+#include "dimmer.h"
+#include "frame_exchange.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Messages down the named pipes. Each is one byte, followed by its
+     *  arguments, if any. See docs/overview.txt for what each one takes
+     *  and what comes back.
+     */
+typedef unsigned char pcmsg_t;
+
+#define PCMSG_SET_CHANNEL       0
+#define PCMSG_ARE_YOU_ALIVE     1
+#define PCMSG_I_AM_ALIVE        2
+#define PCMSG_PLEASE_DIE        3
+#define PCMSG_COMPLIANCE        4
+#define PCMSG_NON_COMPLIANCE    5
+#define PCMSG_QUERY_DEVICE      6
+#define PCMSG_DEVICE_EXISTS     7
+#define PCMSG_INIT_DEVICE       8
+#define PCMSG_DEINIT_DEVICE     9
+#define PCMSG_SET_DUPLEX        10
+#define PCMSG_QUERY_DEVMODS     11
+#define PCMSG_UNKNOWN_MSG       12
+#define PCMSG_SET_SLOTS         13
+#define PCMSG_QUERY_SHARED      14
+
+    /* file names in the rendezvous directory (see pcPath()). */
+#define PC_REQUEST_PIPE   "request"
+#define PC_RESPONSE_PIPE  "response"
+#define PC_LOCK_FILE      "lock"
+
+    /* set DIMMER_DEVICE_PROCESS to the daemon's path to have it spawned. */
+#define PC_DAEMON_ENV     "DIMMER_DEVICE_PROCESS"
+
+#define PC_SHARED_MAGIC   0x444D5831    /* "DMX1" */
+#define PC_SHARED_NAME_MAX  64          /* PCMSG_QUERY_SHARED's answer. */
+#define PC_FRAMES_OFFSET  128
+
+    /*
+     * The head of the shared memory segment. The three frames of a
+     *  FrameExchange follow at PC_FRAMES_OFFSET; libdimmer cooks straight
+     *  into them as producer, the device process sends straight out of
+     *  them as consumer. Each frame libdimmer's clock ticks off, it bumps
+     *  (kick) and wakes the device process with a futex on it; if the
+     *  kicks stop (libdimmer crashed, say), the device process keeps
+     *  resending the last frame at (refreshHz) on its own.
+     */
+struct PcShared
+{
+    unsigned int magic;
+    int frameSize;              /* bytes per frame.                        */
+    int refreshHz;              /* the device process's own frame rate.    */
+    pid_t daemonPid;
+    unsigned int state;         /* FrameExchange state word.               */
+    unsigned int front;         /* FrameExchange shared front word.        */
+    unsigned int kick;          /* futex; bumped once per frame.           */
+    unsigned long framesSent;   /* by the device process, for the curious. */
+};
+
+int pcPath(char *buffer, int bufSize, const char *name);
+int pcCheckDir(__boolean create);
+int pcSharedName(char *buffer, int bufSize, int attempt);
+size_t pcSharedSize(int frameSize);
+int pcFutexWait(unsigned int *word, unsigned int val,
+                const struct timespec *deadline);
+void pcFutexWake(unsigned int *word);
+
+    /* libdimmer side, in process_communication.c ... */
+extern struct DimmerDeviceFunctions daemon_funcs;
+int pcAttachFrames(struct FrameExchange *x, int size);
+int pcCurrentLevels(unsigned char *levels, int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_PROCESS_COMMUNICATION_H_ */
+
+/* end of process_communication.h ... */
+
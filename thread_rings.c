@@ -0,0 +1,100 @@
+/*
+ * Per-thread rings for libdimmer. See thread_rings.h.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "thread_rings.h"
+
+    /* rings start on a cache line of their own. */
+#define RING_ALIGN  64
+
+
+static void releaseRing(void *inUse)
+/*
+ * Thread-specific data destructor: the thread holding this ring exited.
+ *  The key's value is the ring's flag itself, so this works for any
+ *  kind of ring.
+ */
+{
+    __atomic_store_n((int *) inUse, 0, __ATOMIC_RELEASE);
+} /* releaseRing */
+
+
+static inline int *ringFlag(struct ThreadRings *r, void *ring)
+{
+    return((int *) (((unsigned char *) ring) + r->inUseOffset));
+} /* ringFlag */
+
+
+void *threadRingsClaim(struct ThreadRings *r)
+/*
+ * Find the calling thread a ring: one an exited thread gave up, or a
+ *  new one. Callers keep the result in a thread-local pointer and only
+ *  come here when that's NULL, so the lock costs nothing that matters.
+ *
+ *    params : r == the set of rings to claim from.
+ *   returns : the ring, NULL if all (maxRings) are owned or we're out of
+ *              memory.
+ */
+{
+    void *ring = NULL;
+    void *block;
+    int i;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (!r->keyMade)
+    {
+        if (pthread_key_create(&r->key, releaseRing) != 0)
+        {
+            pthread_mutex_unlock(&r->lock);
+            return(NULL);
+        } /* if */
+        r->keyMade = 1;
+    } /* if */
+
+    for (i = 0; i < r->count; i++)
+    {
+        if (!__atomic_load_n(ringFlag(r, r->rings[i]), __ATOMIC_ACQUIRE))
+        {
+            ring = r->rings[i];
+            break;
+        } /* if */
+    } /* for */
+
+    if ((ring == NULL) && (r->count < r->maxRings) &&
+        (posix_memalign(&block, RING_ALIGN, r->ringSize) == 0))
+    {
+        ring = block;
+        memset(ring, '\0', r->ringSize);
+        r->rings[r->count] = ring;
+        __atomic_store_n(&r->count, r->count + 1, __ATOMIC_RELEASE);
+    } /* if */
+
+    if (ring != NULL)
+    {
+        *ringFlag(r, ring) = 1;
+        pthread_setspecific(r->key, ringFlag(r, ring));
+    } /* if */
+
+    pthread_mutex_unlock(&r->lock);
+    return(ring);
+} /* threadRingsClaim */
+
+
+int threadRingsCount(struct ThreadRings *r)
+/*
+ * How many rings there are. Rings below this stay put, so they can be
+ *  read without the lock, even while more are being made.
+ */
+{
+    return(__atomic_load_n(&r->count, __ATOMIC_ACQUIRE));
+} /* threadRingsCount */
+
+/* end of thread_rings.c ... */
+
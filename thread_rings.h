@@ -0,0 +1,57 @@
+/*
+ * Internal declarations for handing out per-thread rings, as the trace
+ *  buffer and the command queue both do. Not part of the public libdimmer
+ *  API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_THREAD_RINGS_H_
+#define _INCLUDE_THREAD_RINGS_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * A set of rings, each owned by at most one live thread. A thread
+     *  claims one the first time it needs it, and gives it up when it
+     *  exits, contents and all, to whichever thread claims next. Rings
+     *  are never freed, and (rings) only ever grows, so a reader can walk
+     *  the first threadRingsCount() of them at any time without locking.
+     *
+     * Each ring must hold an int that is non-zero while a thread owns it;
+     *  (inUseOffset) says where. Set one up with THREAD_RINGS_INIT.
+     */
+struct ThreadRings
+{
+    void **rings;           /* (maxRings) slots, filled in order.       */
+    int maxRings;
+    size_t ringSize;        /* bytes per ring. New ones start zeroed.   */
+    size_t inUseOffset;     /* of the ring's "owned by a thread" flag.  */
+    int count;              /* rings made so far.                       */
+    int keyMade;
+    pthread_key_t key;      /* releases a thread's ring when it exits.  */
+    pthread_mutex_t lock;   /* only taken to claim a ring.              */
+};
+
+#define THREAD_RINGS_INIT(array, type, inUseField) \
+    { (void **) (array), (int) (sizeof (array) / sizeof ((array)[0])), \
+      sizeof (type), offsetof(type, inUseField), 0, 0, 0, \
+      PTHREAD_MUTEX_INITIALIZER }
+
+void *threadRingsClaim(struct ThreadRings *r);
+int threadRingsCount(struct ThreadRings *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_THREAD_RINGS_H_ */
+
+/* end of thread_rings.h ... */
+
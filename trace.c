@@ -0,0 +1,168 @@
+/*
+ * libdimmer's trace buffer. See trace.h.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "thread_rings.h"
+#include "trace.h"
+
+#ifdef DIMMER_TRACE
+
+__thread struct TraceRing *traceRing = NULL;
+__thread int traceTid = 0;
+
+    /* an exited thread's events stay put until its ring is reused. */
+static struct TraceRing *rings[TRACE_MAX_THREADS];
+static struct ThreadRings traceRings =
+                            THREAD_RINGS_INIT(rings, struct TraceRing, inUse);
+
+
+struct TraceRing *traceClaimRing(void)
+/*
+ * Give the calling thread a ring, on its first event. One inherited from
+ *  a dead thread keeps that thread's newest events until they're written
+ *  over, so a dump still shows what it did last.
+ *
+ *    params : void.
+ *   returns : the ring, NULL if there are too many threads tracing or
+ *              we're out of memory. Events are then quietly dropped.
+ */
+{
+    struct TraceRing *ring;
+
+    ring = (struct TraceRing *) threadRingsClaim(&traceRings);
+    if (ring != NULL)
+    {
+        traceTid = (int) syscall(SYS_gettid);
+        traceRing = ring;
+    } /* if */
+
+    return(ring);
+} /* traceClaimRing */
+
+
+static const char *traceEventName(int type)
+{
+    switch (type)
+    {
+        case TRACE_FRAME_SENT:    return("frame-sent");
+        case TRACE_FRAME_MISSED:  return("frame-missed");
+        case TRACE_FADE_START:    return("fade-start");
+        case TRACE_FADE_DONE:     return("fade-done");
+        case TRACE_LOCK_WAIT:     return("lock-wait");
+        case TRACE_DEVICE_ERROR:  return("device-error");
+        case TRACE_DEVICE_CALL:   return("device-call");
+    } /* switch */
+
+    return("unknown");
+} /* traceEventName */
+
+
+static int compareRecords(const void *a, const void *b)
+{
+    long long diff = ((const struct TraceRecord *) a)->when -
+                     ((const struct TraceRecord *) b)->when;
+
+    return((diff < 0) ? -1 : ((diff > 0) ? 1 : 0));
+} /* compareRecords */
+
+
+static int snapshotRing(struct TraceRing *ring, struct TraceRecord *out)
+/*
+ * Copy out every whole record in (ring), while its owner may still be
+ *  writing to it. A record whose (seq) changes under us, or isn't the
+ *  one we expected at that slot, was overwritten mid-copy; skip it.
+ */
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    struct TraceRecord *rec;
+    unsigned int seq;
+    unsigned int pos;
+    int count = 0;
+
+    for (pos = first; pos != head; pos++)
+    {
+        rec = &ring->records[pos & (TRACE_RING_SIZE - 1)];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        memcpy(&out[count], rec, sizeof (struct TraceRecord));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq == pos + 1) &&
+            (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq))
+            count++;
+    } /* for */
+
+    return(count);
+} /* snapshotRing */
+
+
+int traceDump(int fd)
+/*
+ * Write every event still in the rings to (fd) as text, one per line,
+ *  oldest first. Safe to call from any thread while others are tracing.
+ *
+ *    params : fd == where to write.
+ *   returns : number of events written, -1 on error. (errno) set on error.
+ *     errno : ENOMEM (couldn't allocate a snapshot.)
+ *             anything write() sets.
+ */
+{
+    struct TraceRecord *all;
+    char line[128];
+    int count = 0;
+    int total;
+    int len;
+    int i;
+
+    total = threadRingsCount(&traceRings);
+
+    all = malloc(sizeof (struct TraceRecord) * TRACE_RING_SIZE * (total + 1));
+    if (all == NULL)
+    {
+        errno = ENOMEM;
+        return(-1);
+    } /* if */
+
+    for (i = 0; i < total; i++)
+        count += snapshotRing(rings[i], all + count);
+
+    qsort(all, count, sizeof (struct TraceRecord), compareRecords);
+
+    for (i = 0; i < count; i++)
+    {
+        len = snprintf(line, sizeof (line), "%lld.%09lld %d %s %d %d\n",
+                       all[i].when / 1000000000LL, all[i].when % 1000000000LL,
+                       all[i].tid, traceEventName(all[i].type),
+                       all[i].arg0, all[i].arg1);
+        if (write(fd, line, len) != len)
+        {
+            free(all);
+            return(-1);
+        } /* if */
+    } /* for */
+
+    free(all);
+    return(count);
+} /* traceDump */
+
+#else
+
+int traceDump(int fd)
+{
+    errno = ENOSYS;   /* built without DIMMER_TRACE. */
+    return(-1);
+} /* traceDump */
+
+#endif /* defined DIMMER_TRACE */
+
+/* end of trace.c ... */
+
@@ -0,0 +1,119 @@
+/*
+ * Internal declarations for libdimmer's trace buffer, which records
+ *  what the library and device modules are doing, cheaply enough to
+ *  leave on in production. Not part of the public libdimmer API; see
+ *  dimmer_trace_dump() for getting the events back out.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_TRACE_H_
+#define _INCLUDE_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Event types, and what their two arguments mean. */
+#define TRACE_FRAME_SENT     1   /* universe (-1 for all), bytes.           */
+#define TRACE_FRAME_MISSED   2   /* deadlines skipped, 0.                   */
+#define TRACE_FADE_START     3   /* patched channel, target level.          */
+#define TRACE_FADE_DONE      4   /* patched channel, final level.           */
+#define TRACE_LOCK_WAIT      5   /* microseconds waited, 0.                 */
+#define TRACE_DEVICE_ERROR   6   /* errno, TRACE_CALL_* that failed.        */
+#define TRACE_DEVICE_CALL    7   /* TRACE_CALL_*, argument if it has one.   */
+
+    /* Device module entry points, for TRACE_DEVICE_CALL/ERROR. */
+#define TRACE_CALL_QUERY_NAME     0
+#define TRACE_CALL_EXISTENCE      1
+#define TRACE_CALL_QUERY_DEVICE   2
+#define TRACE_CALL_INITIALIZE     3
+#define TRACE_CALL_DEINITIALIZE   4
+#define TRACE_CALL_CHANNEL_SET    5
+#define TRACE_CALL_SET_DUPLEX     6
+#define TRACE_CALL_UPDATE         7
+#define TRACE_CALL_PIPE           8
+
+    /* events kept per thread; older ones are overwritten. Power of two. */
+#define TRACE_RING_SIZE    1024
+#define TRACE_MAX_THREADS  64
+
+    /*
+     * Every thread that traces gets a ring of its own, so recording an
+     *  event is a clock read and a few stores: no locks, no atomics
+     *  beyond ordering, and no system calls. A reader can walk the rings
+     *  at any time; (seq) lets it throw away a record that was being
+     *  overwritten while it looked.
+     */
+struct TraceRecord
+{
+    long long when;         /* CLOCK_MONOTONIC, nanoseconds.            */
+    unsigned int seq;       /* position in ring + 1; 0 while writing.   */
+    short type;             /* TRACE_*.                                 */
+    short pad;
+    int tid;                /* kernel thread ID.                        */
+    int arg0;
+    int arg1;
+};
+
+struct TraceRing
+{
+    unsigned int head;      /* records ever written. Owner only.        */
+    int inUse;              /* owned by a live thread.                  */
+    struct TraceRecord records[TRACE_RING_SIZE];
+};
+
+#ifdef DIMMER_TRACE
+
+#include <time.h>
+
+extern __thread struct TraceRing *traceRing;
+extern __thread int traceTid;
+struct TraceRing *traceClaimRing(void);
+
+static inline void traceEvent(int type, int arg0, int arg1)
+{
+    struct TraceRing *ring = traceRing;
+    struct TraceRecord *rec;
+    struct timespec ts;
+    unsigned int pos;
+
+    if ((ring == NULL) && ((ring = traceClaimRing()) == NULL))
+        return;
+
+    pos = ring->head;
+    rec = &ring->records[pos & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->when = ((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+    rec->type = (short) type;
+    rec->tid = traceTid;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELEASE);
+} /* traceEvent */
+
+#define TRACE(type, arg0, arg1)  traceEvent((type), (arg0), (arg1))
+
+#else
+
+#define TRACE(type, arg0, arg1)
+
+#endif /* defined DIMMER_TRACE */
+
+    /* writes every event still in the rings to (fd), oldest first. */
+int traceDump(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_TRACE_H_ */
+
+/* end of trace.h ... */
+
@@ -0,0 +1,191 @@
+/*
+ * Helper threads for libdimmer. See work_pool.h.
+ *
+ * A job is a range of items cut into fixed-size chunks. The caller and
+ *  every helper claim chunks off a shared atomic counter until there are
+ *  none left, so whoever finishes early just takes more, and one slow
+ *  thread can't hold up more than the chunk it's on. Helpers sleep on a
+ *  condition variable between jobs. There's one job at a time; callers
+ *  queue up on (runLock).
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "work_pool.h"
+
+static pthread_t helpers[WORK_POOL_MAX_THREADS];
+static int helperCount = 0;
+static int poolLive = 0;
+
+static pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobFinished = PTHREAD_COND_INITIALIZER;
+
+    /* the current job. Only changed under (jobLock), with no helper busy. */
+static unsigned int jobGeneration = 0;
+static WorkFunc jobFunc = NULL;
+static void *jobArg = NULL;
+static int jobTotal = 0;
+static int jobChunk = 0;
+static int jobChunks = 0;
+static int nextChunk = 0;       /* atomic; next chunk nobody has claimed. */
+static int helpersBusy = 0;     /* helpers working on the job.            */
+
+
+static void doChunks(void)
+{
+    int chunk;
+    int first;
+    int count;
+
+    while ((chunk = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_ACQ_REL))
+             < jobChunks)
+    {
+        first = chunk * jobChunk;
+        count = jobTotal - first;
+        if (count > jobChunk)
+            count = jobChunk;
+        jobFunc(jobArg, first, count);
+    } /* while */
+} /* doChunks */
+
+
+static void *helperEntry(void *args)
+{
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&jobLock);
+    while (1)
+    {
+        while ((poolLive) && (jobGeneration == seen))
+            pthread_cond_wait(&jobReady, &jobLock);
+
+        if (!poolLive)
+            break;
+
+        seen = jobGeneration;
+        helpersBusy++;
+        pthread_mutex_unlock(&jobLock);
+
+        doChunks();
+
+        pthread_mutex_lock(&jobLock);
+        if (--helpersBusy == 0)
+            pthread_cond_broadcast(&jobFinished);
+    } /* while */
+    pthread_mutex_unlock(&jobLock);
+
+    return(NULL);
+} /* helperEntry */
+
+
+int workPoolStart(void)
+/*
+ * Spin the helper threads: one fewer than there are CPUs (the caller
+ *  of workPoolRun() does its share too), or however many the
+ *  DIMMER_THREADS environment variable asks for.
+ *
+ *    params : void.
+ *   returns : number of helper threads running. Zero is fine; every
+ *              job then runs on the caller's thread.
+ */
+{
+    const char *env = getenv("DIMMER_THREADS");
+    int want;
+
+    if (poolLive)
+        return(helperCount);
+
+    if (env != NULL)
+        want = atoi(env) - 1;
+    else
+        want = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (want > WORK_POOL_MAX_THREADS - 1)
+        want = WORK_POOL_MAX_THREADS - 1;
+
+    poolLive = 1;
+    for (helperCount = 0; helperCount < want; helperCount++)
+    {
+        if (pthread_create(&helpers[helperCount], NULL, helperEntry, NULL))
+            break;
+    } /* for */
+
+    return(helperCount);
+} /* workPoolStart */
+
+
+void workPoolStop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&jobLock);
+    poolLive = 0;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&jobLock);
+
+    for (i = 0; i < helperCount; i++)
+        pthread_join(helpers[i], NULL);
+
+    helperCount = 0;
+} /* workPoolStop */
+
+
+int workPoolThreads(void)
+{
+    return(helperCount);
+} /* workPoolThreads */
+
+
+void workPoolRun(WorkFunc func, void *arg, int total, int chunk)
+/*
+ * Do a job, using the helper threads if there are any, and return when
+ *  all of it is done. (func) may be called from any thread, on any
+ *  chunk, in any order, so chunks must not depend on each other.
+ *
+ *    params : func  == does a chunk of the job.
+ *             arg   == passed to (func).
+ *             total == number of items in the job.
+ *             chunk == items per chunk. Big enough to be worth a thread.
+ *   returns : void.
+ */
+{
+    if ((helperCount == 0) || (total <= chunk))
+    {
+        func(arg, 0, total);   /* not worth waking anyone. */
+        return;
+    } /* if */
+
+    pthread_mutex_lock(&runLock);
+    pthread_mutex_lock(&jobLock);
+
+        /* a helper that woke late for the last job might still be here. */
+    while (helpersBusy > 0)
+        pthread_cond_wait(&jobFinished, &jobLock);
+
+    jobFunc = func;
+    jobArg = arg;
+    jobTotal = total;
+    jobChunk = chunk;
+    jobChunks = (total + chunk - 1) / chunk;
+    __atomic_store_n(&nextChunk, 0, __ATOMIC_RELEASE);
+    jobGeneration++;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&jobLock);
+
+    doChunks();
+
+    pthread_mutex_lock(&jobLock);
+    while (helpersBusy > 0)
+        pthread_cond_wait(&jobFinished, &jobLock);
+    pthread_mutex_unlock(&jobLock);
+    pthread_mutex_unlock(&runLock);
+} /* workPoolRun */
+
+/* end of work_pool.c ... */
+
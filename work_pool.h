@@ -0,0 +1,34 @@
+/*
+ * Internal declarations for libdimmer's helper threads, which split big
+ *  per-frame jobs (evaluating thousands of fades, recooking every
+ *  universe) across CPUs. Not part of the public libdimmer API.
+ *
+ *  Copyright (c) 1999 Lighting and Sound Technologies.
+ *   Written by Ryan C. Gordon.
+ */
+
+#ifndef _INCLUDE_WORK_POOL_H_
+#define _INCLUDE_WORK_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WORK_POOL_MAX_THREADS  16
+
+    /* do items (first) through (first + count - 1) of a job. */
+typedef void (*WorkFunc)(void *arg, int first, int count);
+
+int workPoolStart(void);
+void workPoolStop(void);
+int workPoolThreads(void);
+void workPoolRun(WorkFunc func, void *arg, int total, int chunk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined _INCLUDE_WORK_POOL_H_ */
+
+/* end of work_pool.h ... */
+